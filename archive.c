@@ -0,0 +1,482 @@
+/**
+ * @file
+ * @brief Index of miniseed data already on local disk
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <libmseed/libmseed.h>
+
+#include "archive.h"
+#include "miniseed_sac.h"
+#include "chash.h"
+#include "array.h"
+#include "strip.h"
+#include "defs.h"
+
+/**
+ * @defgroup archive archive
+ * @brief Index of miniseed data already on local disk
+ *
+ * @details Records in miniseed files, either earlier downloads or an SDS
+ *    tree, are parsed but not unpacked, and the time spans they cover are
+ *    kept for each source id.  Spans closer than half a sample are joined.
+ *    Data requests can then ask for only what is missing, see
+ *    data_request_subtract_archive()
+ *
+ * @code
+ *   archive *a = archive_new();
+ *   archive_add(a, "/data/SDS");
+ *   data_request_subtract_archive(fdr, a);
+ *   archive_free(a);
+ * @endcode
+ */
+
+/**
+ * @brief Time spans of a single source id
+ * @private
+ * @ingroup archive
+ */
+typedef struct {
+    nstime_t *t;    /**< \private start and end of each span, 2 per span */
+    size_t n;       /**< \private number of spans */
+    size_t alloc;   /**< \private spans allocated */
+    nstime_t tol;   /**< \private largest half sample period of the records */
+    int sorted;     /**< \private spans are sorted and joined */
+} archive_trace;
+
+/**
+ * @brief Time spans of local miniseed data by source id
+ * @ingroup archive
+ */
+struct archive {
+    dict *traces;     /**< @private archive_trace by source id */
+    size_t nfiles;    /**< @private files read */
+    size_t nrecords;  /**< @private records read */
+};
+
+/**
+ * @brief Create a new, empty, archive index
+ *
+ * @memberof   archive
+ * @ingroup    archive
+ *
+ * @return     archive index
+ */
+archive *
+archive_new() {
+    archive *a = calloc(1, sizeof(archive));
+    a->traces = dict_new();
+    return a;
+}
+
+/**
+ * @brief Free an archive trace
+ *
+ * @ingroup    archive
+ * @private
+ *
+ * @param      p   archive trace
+ *
+ */
+static void
+archive_trace_free(void *p) {
+    archive_trace *t = (archive_trace *) p;
+    if(t) {
+        FREE(t->t);
+        FREE(t);
+    }
+}
+
+/**
+ * @brief Free an archive index
+ *
+ * @memberof   archive
+ * @ingroup    archive
+ *
+ * @param      a   archive index
+ *
+ */
+void
+archive_free(archive *a) {
+    if(a) {
+        dict_free(a->traces, archive_trace_free);
+        FREE(a);
+    }
+}
+
+/**
+ * @brief Number of miniseed files read into an archive index
+ *
+ * @memberof   archive
+ * @ingroup    archive
+ *
+ * @param      a   archive index
+ *
+ * @return     number of files
+ */
+size_t
+archive_files(archive *a) {
+    return (a) ? a->nfiles : 0;
+}
+
+/**
+ * @brief Number of miniseed records read into an archive index
+ *
+ * @memberof   archive
+ * @ingroup    archive
+ *
+ * @param      a   archive index
+ *
+ * @return     number of records
+ */
+size_t
+archive_records(archive *a) {
+    return (a) ? a->nrecords : 0;
+}
+
+/**
+ * @brief Add a span to an archive index
+ *
+ * @ingroup    archive
+ * @private
+ *
+ * @param      a      archive index
+ * @param      sid    source id
+ * @param      t1     start of the span
+ * @param      t2     end of the span
+ * @param      tol    half sample period, spans closer than this are joined
+ *
+ * @note Records usually follow each other in a file, so a span that
+ *    continues the last span extends it rather than adding a new span
+ */
+static void
+archive_trace_add(archive *a, char *sid, nstime_t t1, nstime_t t2, nstime_t tol) {
+    archive_trace *t = dict_get(a->traces, sid);
+    if(!t) {
+        t = calloc(1, sizeof(archive_trace));
+        t->sorted = TRUE;
+        dict_put(a->traces, sid, t);
+    }
+    if(tol > t->tol) {
+        t->tol = tol;
+    }
+    if(t->n > 0) {
+        nstime_t *last = &t->t[2 * (t->n - 1)];
+        if(t1 >= last[0] && t1 <= last[1] + t->tol) {
+            if(t2 > last[1]) {
+                last[1] = t2;
+            }
+            return;
+        }
+        if(t1 < last[0]) {
+            t->sorted = FALSE;
+        }
+    }
+    if(t->n >= t->alloc) {
+        t->alloc = (t->alloc == 0) ? 16 : 2 * t->alloc;
+        t->t = realloc(t->t, 2 * t->alloc * sizeof(nstime_t));
+    }
+    t->t[2 * t->n]     = t1;
+    t->t[2 * t->n + 1] = t2;
+    t->n += 1;
+}
+
+/**
+ * @brief Add the span of a record to an archive index
+ *
+ * @ingroup    archive
+ * @private
+ *
+ * @param      msr    miniseed record
+ * @param      data   archive index
+ *
+ * @return     1
+ */
+static int
+archive_add_record(MS3Record *msr, void *data) {
+    archive *a = (archive *) data;
+    nstime_t tol = 0;
+
+    if(msr->samplecnt <= 0) {
+        return 1;
+    }
+    if(msr->samprate > 0.0) {
+        tol = (nstime_t) ((double) NSTMODULUS / msr->samprate / 2.0);
+    }
+    a->nrecords += 1;
+    archive_trace_add(a, msr->sid, msr->starttime, mseed_record_next(msr), tol);
+    return 1;
+}
+
+/**
+ * @brief Add a time span of data to an archive index
+ *
+ * @memberof   archive
+ * @ingroup    archive
+ *
+ * @param      a     archive index
+ * @param      sid   source id, e.g. FDSN:IU_ANMO_00_B_H_Z
+ * @param      t1    start of the span
+ * @param      t2    end of the span
+ *
+ * @return     1 on success, 0 if the span is empty
+ *
+ * @note For data known to be available elsewhere, e.g. from another data
+ *    center, rather than read from files
+ */
+int
+archive_add_span(archive *a, char *sid, nstime_t t1, nstime_t t2) {
+    if(!a || !sid || t2 <= t1) {
+        return 0;
+    }
+    archive_trace_add(a, sid, t1, t2, 0);
+    return 1;
+}
+
+/**
+ * @brief Compare two spans by start time
+ *
+ * @ingroup    archive
+ * @private
+ *
+ */
+static int
+archive_span_cmp(const void *pa, const void *pb) {
+    const nstime_t *a = (const nstime_t *) pa;
+    const nstime_t *b = (const nstime_t *) pb;
+    if(a[0] != b[0]) {
+        return (a[0] < b[0]) ? -1 : 1;
+    }
+    return (a[1] < b[1]) ? -1 : (a[1] > b[1]);
+}
+
+/**
+ * @brief Sort the spans of a trace and join those that overlap or touch
+ *
+ * @ingroup    archive
+ * @private
+ *
+ * @param      t   archive trace
+ *
+ */
+static void
+archive_trace_merge(archive_trace *t) {
+    size_t k = 0;
+    if(t->sorted || t->n == 0) {
+        t->sorted = TRUE;
+        return;
+    }
+    qsort(t->t, t->n, 2 * sizeof(nstime_t), archive_span_cmp);
+    for(size_t i = 1; i < t->n; i++) {
+        nstime_t *last = &t->t[2 * k];
+        nstime_t *x = &t->t[2 * i];
+        if(x[0] <= last[1] + t->tol) {
+            if(x[1] > last[1]) {
+                last[1] = x[1];
+            }
+        } else {
+            k += 1;
+            t->t[2 * k]     = x[0];
+            t->t[2 * k + 1] = x[1];
+        }
+    }
+    t->n = k + 1;
+    t->sorted = TRUE;
+}
+
+/**
+ * @brief Add the records of a miniseed file to an archive index
+ *
+ * @memberof   archive
+ * @ingroup    archive
+ *
+ * @param      a     archive index
+ * @param      file  miniseed file
+ *
+ * @return     1 on success, 0 if the file could not be read
+ */
+int
+archive_add_file(archive *a, char *file) {
+    if(mseed_file_records(file, archive_add_record, a) < 0) {
+        printf("Error reading archive file %s\n", file);
+        return 0;
+    }
+    a->nfiles += 1;
+    return 1;
+}
+
+/**
+ * @brief Check if a filename looks like miniseed
+ *
+ * @ingroup    archive
+ * @private
+ *
+ * @param      name   filename, without the directory
+ *
+ * @return     1 if the file is read into an archive index, 0 otherwise
+ *
+ * @note Accepted names end in .mseed, .miniseed or .ms, or are SDS day
+ *    files, NET.STA.LOC.CHA.TYPE.YEAR.DAY.  Partial downloads, .part and
+ *    .rpart, are resumed by the download and are not included
+ */
+static int
+archive_is_mseed_name(char *name) {
+    size_t n = strlen(name);
+    size_t dots = 0;
+    char *exts[] = { ".mseed", ".miniseed", ".ms", NULL };
+    for(size_t i = 0; exts[i]; i++) {
+        size_t m = strlen(exts[i]);
+        if(n > m && strcmp(name + n - m, exts[i]) == 0) {
+            return 1;
+        }
+    }
+    for(size_t i = 0; i < n; i++) {
+        dots += (name[i] == '.');
+    }
+    return (dots == 6);
+}
+
+/**
+ * @brief Add a miniseed file, or a directory tree of them, to an archive index
+ *
+ * @ingroup    archive
+ * @private
+ *
+ * @param      a     archive index
+ * @param      path  miniseed file or directory
+ * @param      seen  directories already searched, by device and inode
+ *
+ * @return     1 on success, 0 if the path could not be read
+ *
+ * @note A directory reached again, e.g. through a symbolic link back up the
+ *    tree, is not searched again
+ */
+static int
+archive_add_path(archive *a, char *path, dict *seen) {
+    DIR *dir = NULL;
+    struct dirent *d = NULL;
+    struct stat st;
+    char *file = NULL;
+    char key[64] = {0};
+
+    if(stat(path, &st) != 0) {
+        printf("Error reading archive %s: No such file or directory\n", path);
+        return 0;
+    }
+    if(!S_ISDIR(st.st_mode)) {
+        return archive_add_file(a, path);
+    }
+    snprintf(key, sizeof(key), "%ju:%ju", (uintmax_t) st.st_dev, (uintmax_t) st.st_ino);
+    if(dict_get(seen, key)) {
+        return 1;
+    }
+    dict_put(seen, key, seen);
+    if(!(dir = opendir(path))) {
+        printf("Error reading archive directory %s\n", path);
+        return 0;
+    }
+    while((d = readdir(dir))) {
+        if(d->d_name[0] == '.') {
+            continue;
+        }
+        fern_asprintf(&file, "%s/%s", path, d->d_name);
+        if(stat(file, &st) == 0) {
+            if(S_ISDIR(st.st_mode)) {
+                archive_add_path(a, file, seen);
+            } else if(S_ISREG(st.st_mode) && archive_is_mseed_name(d->d_name)) {
+                archive_add_file(a, file);
+            }
+        }
+        FREE(file);
+    }
+    closedir(dir);
+    return 1;
+}
+
+/**
+ * @brief Add a miniseed file, or a directory tree of them, to an archive index
+ *
+ * @memberof   archive
+ * @ingroup    archive
+ *
+ * @param      a     archive index
+ * @param      path  miniseed file or directory, e.g. an SDS tree
+ *
+ * @return     1 on success, 0 if the path could not be read
+ *
+ * @note Directories are searched recursively for files that look like
+ *    miniseed, see archive_is_mseed_name().  A file named directly is always
+ *    read.  Hidden files and directories are skipped.  Symbolic links are
+ *    followed, but each directory is searched only once
+ */
+int
+archive_add(archive *a, char *path) {
+    int retval = 0;
+    dict *seen = dict_new();
+    retval = archive_add_path(a, path, seen);
+    dict_free(seen, NULL);
+    return retval;
+}
+
+/**
+ * @brief Find the time intervals of a source id missing from an archive
+ *
+ * @memberof   archive
+ * @ingroup    archive
+ *
+ * @param      a    archive index
+ * @param      sid  miniseed source id, e.g. FDSN:IU_ANMO_00_B_H_Z
+ * @param      t1   start of the interval
+ * @param      t2   end of the interval
+ * @param      n    output, number of missing intervals
+ *
+ * @return     start and end of each missing interval, 2 per interval, NULL
+ *    if nothing is missing
+ *
+ * @warning User owns the intervals and is responsible for freeing them
+ */
+nstime_t *
+archive_missing(archive *a, char *sid, nstime_t t1, nstime_t t2, size_t *n) {
+    nstime_t *out = NULL;
+    nstime_t t = t1;
+    archive_trace *tr = NULL;
+    size_t k = 0;
+
+    *n = 0;
+    if(t2 <= t1) {
+        return NULL;
+    }
+    if(a && (tr = dict_get(a->traces, sid))) {
+        archive_trace_merge(tr);
+    }
+    out = calloc(2 * ((tr) ? tr->n + 1 : 1), sizeof(nstime_t));
+    for(size_t i = 0; tr && i < tr->n && t < t2; i++) {
+        nstime_t s1 = tr->t[2 * i], s2 = tr->t[2 * i + 1];
+        if(s2 <= t) {
+            continue;
+        }
+        if(s1 >= t2) {
+            break;
+        }
+        if(s1 > t) {
+            out[2 * k]     = t;
+            out[2 * k + 1] = s1;
+            k += 1;
+        }
+        t = s2;
+    }
+    if(t < t2) {
+        out[2 * k]     = t;
+        out[2 * k + 1] = t2;
+        k += 1;
+    }
+    if(k == 0) {
+        FREE(out);
+    }
+    *n = k;
+    return out;
+}
@@ -0,0 +1,28 @@
+/**
+ * @file
+ * @brief Index of miniseed data already on local disk
+ */
+
+#ifndef _ARCHIVE_H_
+#define _ARCHIVE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <libmseed/libmseed.h>
+
+/**
+ * Time spans of local miniseed data by source id
+ */
+typedef struct archive archive;
+
+archive *  archive_new();
+int        archive_add(archive *a, char *path);
+int        archive_add_file(archive *a, char *file);
+int        archive_add_span(archive *a, char *sid, nstime_t t1, nstime_t t2);
+size_t     archive_files(archive *a);
+size_t     archive_records(archive *a);
+nstime_t * archive_missing(archive *a, char *sid, nstime_t t1, nstime_t t2,
+                           size_t *n);
+void       archive_free(archive *a);
+
+#endif /* _ARCHIVE_H_ */
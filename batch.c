@@ -0,0 +1,347 @@
+/**
+ * @file
+ * @brief Data requests for many events at once
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <sacio/sacio.h>
+#include <sacio/timespec.h>
+#include <libmseed/libmseed.h>
+
+#include "batch.h"
+#include "miniseed_sac.h"
+#include "meta.h"
+#include "cprint.h"
+#include "array.h"
+#include "strip.h"
+#include "defs.h"
+
+/**
+ * @defgroup batch batch
+ * @brief Data requests for many events at once
+ *
+ * @details A data availability request is made for each event, all at once,
+ *    and the request lines from all events are merged into a single data
+ *    request.  Lines to the same data center are combined and chunked
+ *    together, so nearby events share downloads.  After the download the
+ *    channels requested for each event are cut back into its time window
+ *
+ * @code
+ *   event_batch *b = event_batch_new(avail, events, &dur);
+ *   event_batch_query(b, 4);
+ *   fdr = event_batch_data_request(b);
+ *   data_request_chunks(fdr, max);
+ *   mst3k = data_request_download(fdr, file, prefix, FALSE, TRUE);
+ *   for(size_t i = 0; i < event_batch_length(b); i++) {
+ *       sac **out = event_batch_sac(b, mst3k, i, verbose);
+ *       ...
+ *   }
+ *   event_batch_free(b);
+ * @endcode
+ */
+
+/**
+ * @brief Data request for a set of events
+ * @ingroup batch
+ */
+struct event_batch {
+    request *avail;      /**< @private data availability request, not owned */
+    Event **ev;          /**< @private events, not owned */
+    timespec64 *t1;      /**< @private start of each event's time window */
+    timespec64 *t2;      /**< @private end of each event's time window */
+    data_request *fdr;   /**< @private merged data request */
+    data_request **own;  /**< @private request lines of each event, NULL until queried */
+    size_t nfailed;      /**< @private availability requests that failed */
+};
+
+/**
+ * @brief Availability request of a single event in a batch
+ * @ingroup batch
+ * @private
+ */
+typedef struct {
+    event_batch *b; /**< \private batch the event belongs to */
+    size_t i;       /**< \private index of the event */
+} event_batch_item;
+
+/**
+ * @brief Create a data request for a set of events
+ *
+ * @memberof   event_batch
+ * @ingroup    batch
+ *
+ * @param      avail  data availability request, e.g. network, channel and
+ *                    radius, the time and origin are set for each event
+ * @param      ev     events, in an \ref xarray
+ * @param      d      duration of data from each origin time
+ *
+ * @return     event batch, NULL if there are no events
+ *
+ * @warning The request and events must remain until the batch is freed
+ */
+event_batch *
+event_batch_new(request *avail, Event **ev, duration *d) {
+    event_batch *b = NULL;
+    size_t n = xarray_length(ev);
+    if(!avail || n == 0) {
+        return NULL;
+    }
+    b = calloc(1, sizeof(event_batch));
+    b->avail = avail;
+    b->ev = ev;
+    b->t1 = calloc(n, sizeof(timespec64));
+    b->t2 = calloc(n, sizeof(timespec64));
+    for(size_t i = 0; i < n; i++) {
+        b->t1[i] = event_time(ev[i]);
+        b->t2[i] = (d) ? timespec64_add_duration(b->t1[i], d) : b->t1[i];
+    }
+    b->fdr = data_request_new();
+    return b;
+}
+
+/**
+ * @brief Free an event batch
+ *
+ * @memberof   event_batch
+ * @ingroup    batch
+ *
+ * @param      b   event batch
+ *
+ * @note The data request is freed, the request and events are not
+ */
+void
+event_batch_free(event_batch *b) {
+    if(b) {
+        for(size_t i = 0; b->own && i < event_batch_length(b); i++) {
+            data_request_free(b->own[i]);
+        }
+        FREE(b->own);
+        FREE(b->t1);
+        FREE(b->t2);
+        data_request_free(b->fdr);
+        FREE(b);
+    }
+}
+
+/**
+ * @brief Number of events in a batch
+ *
+ * @memberof   event_batch
+ * @ingroup    batch
+ *
+ * @param      b   event batch
+ *
+ * @return     number of events
+ */
+size_t
+event_batch_length(event_batch *b) {
+    return (b) ? xarray_length(b->ev) : 0;
+}
+
+/**
+ * @brief Get an event from a batch
+ *
+ * @memberof   event_batch
+ * @ingroup    batch
+ *
+ * @param      b   event batch
+ * @param      i   index of the event
+ *
+ * @return     event, NULL if i is out of range
+ */
+Event *
+event_batch_event(event_batch *b, size_t i) {
+    return (i < event_batch_length(b)) ? b->ev[i] : NULL;
+}
+
+/**
+ * @brief Get the merged data request of a batch
+ *
+ * @memberof   event_batch
+ * @ingroup    batch
+ *
+ * @param      b   event batch
+ *
+ * @return     data request, owned by the batch
+ */
+data_request *
+event_batch_data_request(event_batch *b) {
+    return (b) ? b->fdr : NULL;
+}
+
+/**
+ * @brief Add the availability of an event to the merged data request
+ *
+ * @ingroup    batch
+ * @private
+ *
+ * @param      fr     result of the availability request
+ * @param      data   event, \ref event_batch_item
+ *
+ * @note The event keeps its own copy of the request lines, which selects
+ *    its channels from the merged download
+ */
+static void
+event_batch_done(result *fr, void *data) {
+    event_batch_item *it = (event_batch_item *) data;
+    event_batch *b = it->b;
+    char *id = event_id(b->ev[it->i]);
+    if(result_is_ok(fr)) {
+        data_request *one = data_request_parse(result_data(fr));
+        b->own[it->i] = data_request_parse(result_data(fr));
+        data_request_merge(b->fdr, one);
+        data_request_free(one);
+    } else if(result_is_empty(fr)) {
+        printf("%s: No data available\n", id);
+    } else {
+        char *msg = result_error_msg(fr);
+        printf("%s: %s\n", id, msg);
+        FREE(msg);
+        b->nfailed += 1;
+    }
+    RESULT_FREE(fr);
+}
+
+/**
+ * @brief Replace a time argument of a request
+ *
+ * @ingroup    batch
+ * @private
+ *
+ */
+static void
+event_batch_set_time(request *r, char *key, timespec64 t) {
+    request_del_arg(r, key);
+    request_set_arg(r, key, arg_time_new(t));
+}
+
+/**
+ * @brief Replace a numeric argument of a request
+ *
+ * @ingroup    batch
+ * @private
+ *
+ */
+static void
+event_batch_set_double(request *r, char *key, double v) {
+    request_del_arg(r, key);
+    request_set_arg(r, key, arg_double_new(v));
+}
+
+/**
+ * @brief Request the availability of data for all events
+ *
+ * @memberof   event_batch
+ * @ingroup    batch
+ *
+ * @param      b     event batch
+ * @param      jobs  number of concurrent availability requests
+ *
+ * @return     1 if all requests succeeded, 0 if any failed
+ *
+ * @note Events without data are skipped.  Request lines from all events are
+ *    merged into event_batch_data_request()
+ */
+int
+event_batch_query(event_batch *b, int jobs) {
+    size_t n = event_batch_length(b);
+    event_batch_item *items = NULL;
+    fern_loop *loop = NULL;
+    if(n == 0) {
+        return 0;
+    }
+    items = calloc(n, sizeof(event_batch_item));
+    if(!b->own) {
+        b->own = calloc(n, sizeof(data_request *));
+    }
+    loop = fern_loop_new();
+    fern_loop_set_max_transfers(loop, jobs);
+    for(size_t i = 0; i < n; i++) {
+        items[i].b = b;
+        items[i].i = i;
+        event_batch_set_time(b->avail, "start", b->t1[i]);
+        event_batch_set_time(b->avail, "end", b->t2[i]);
+        event_batch_set_double(b->avail, "lat", event_lat(b->ev[i]));
+        event_batch_set_double(b->avail, "lon", event_lon(b->ev[i]));
+        if(!fern_loop_add(loop, b->avail, NULL, NULL, event_batch_done, &items[i])) {
+            printf("%s: Error constructing request\n", event_id(b->ev[i]));
+            b->nfailed += 1;
+        }
+    }
+    fern_loop_run(loop);
+    fern_loop_free(loop);
+    FREE(items);
+    return (b->nfailed == 0);
+}
+
+/**
+ * @brief Get the sac files of an event from downloaded data
+ *
+ * @memberof   event_batch
+ * @ingroup    batch
+ *
+ * @param      b        event batch
+ * @param      mst3k    data downloaded for the whole batch
+ * @param      i        index of the event
+ * @param      verbose  be verbose when setting meta data
+ *
+ * @return     sac files cut to the event's time window with its event
+ *    parameters set, in an \ref xarray, NULL if there is no data
+ *
+ * @note Only channels requested for the event are used, so a station
+ *    selected for another event with an overlapping time window, e.g.
+ *    outside this event's radius, is left out.  If the availability was not
+ *    requested, see event_batch_query(), all channels are used.  Files are
+ *    named EVENTID/Net.Sta.Loc.Cha.Qual.Year.Day.HMS.sac, with : and / in
+ *    the event id replaced by _, and the directory is created
+ */
+sac **
+event_batch_sac(event_batch *b, MS3TraceList *mst3k, size_t i, int verbose) {
+    sac **out = NULL;
+    char dir[EVENTID_LEN] = {0};
+    char *p = NULL;
+    nstime_t t1 = 0, t2 = 0;
+    MS3TraceID *t = NULL;
+    if(i >= event_batch_length(b) || !mst3k) {
+        return NULL;
+    }
+    if(b->own && !b->own[i]) {
+        // No data available for the event
+        return NULL;
+    }
+    t1 = (nstime_t) b->t1[i].tv_sec * NSTMODULUS + (nstime_t) b->t1[i].tv_nsec;
+    t2 = (nstime_t) b->t2[i].tv_sec * NSTMODULUS + (nstime_t) b->t2[i].tv_nsec;
+    out = xarray_new('p');
+    t = mst3k->traces;
+    for(uint32_t k = 0; k < mst3k->numtraces; k++) {
+        if(!b->own || data_request_selects(b->own[i], t->sid)) {
+            out = miniseed_trace_to_sac_window(t, t1, t2, out);
+        }
+        t = t->next;
+    }
+    if(xarray_length(out) == 0) {
+        xarray_free(out);
+        return NULL;
+    }
+    fern_strlcpy(dir, event_id(b->ev[i]), sizeof(dir));
+    for(p = dir; *p; p++) {
+        if(*p == ':' || *p == '/') {
+            *p = '_';
+        }
+    }
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        printf("Error creating directory %s\n", dir);
+    }
+    for(size_t j = 0; j < xarray_length(out); j++) {
+        char *name = out[j]->m->filename;
+        out[j]->m->filename = NULL;
+        fern_asprintf(&out[j]->m->filename, "%s/%s", dir, name);
+        FREE(name);
+    }
+    sac_array_fill_meta_data_from_event(out, b->ev[i], verbose);
+    return out;
+}
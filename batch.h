@@ -0,0 +1,30 @@
+/**
+ * @file
+ * @brief Data requests for many events at once
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <sacio/sacio.h>
+#include <libmseed/libmseed.h>
+
+#include "request.h"
+#include "event.h"
+#include "datareq.h"
+
+/**
+ * Data request for a set of events
+ */
+typedef struct event_batch event_batch;
+
+event_batch *  event_batch_new(request *avail, Event **ev, duration *d);
+int            event_batch_query(event_batch *b, int jobs);
+data_request * event_batch_data_request(event_batch *b);
+size_t         event_batch_length(event_batch *b);
+Event *        event_batch_event(event_batch *b, size_t i);
+sac **         event_batch_sac(event_batch *b, MS3TraceList *mst3k, size_t i,
+                               int verbose);
+void           event_batch_free(event_batch *b);
+
+#endif /* _BATCH_H_ */
@@ -0,0 +1,594 @@
+/**
+ * @file
+ * @brief On-disk cache of HTTP responses
+ */
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "array.h"
+#include "defs.h"
+#include "strip.h"
+
+/**
+ * @defgroup cache cache
+ * @brief On-disk cache of HTTP responses
+ *
+ * @details Responses are stored in a directory, one file per request, keyed
+ *    on the method, URL and POST data.  Each class of service, see
+ *    \ref CacheClass, has its own lifetime.  Once expired, a response with an
+ *    ETag or Last-Modified time is revalidated with the server.  The least
+ *    recently used responses are removed when the cache grows beyond its
+ *    maximum size
+ *
+ * @code
+ *   cache_set_dir("fern_cache");
+ *   cache_set_ttl(CacheEvent, 24 * 3600);
+ *   // Requests now use the cache
+ * @endcode
+ */
+
+#define CACHE_MAGIC "FERNCACHE 1" /**< @private first line of a cache file */
+
+/**
+ * @brief Cached HTTP response
+ * @ingroup cache
+ */
+struct cache_entry {
+    char *file;          /**< @private cache file */
+    char *url;           /**< @private URL of the request */
+    char *post;          /**< @private POST data of the request, NULL for GET */
+    int64_t stored;      /**< @private time the response was stored or revalidated */
+    int64_t ttl;         /**< @private lifetime of the response in seconds */
+    char *etag;          /**< @private ETag of the response, may be empty */
+    char *last_modified; /**< @private Last-Modified time of the response, may be empty */
+    char *data;          /**< @private response body */
+    size_t n;            /**< @private length of data */
+};
+
+static char *_CACHE_DIR = NULL;               /**< @private cache directory, NULL if disabled */
+static int64_t _CACHE_MAX = 256 * 1024 * 1024; /**< @private maximum size of the cache in bytes */
+static int64_t _CACHE_SIZE = -1;              /**< @private size of the cache in bytes, -1 if not yet scanned */
+static int64_t _CACHE_TTL[] = {
+    0,         // CacheNone
+    3600,      // CacheEvent
+    86400,     // CacheStation
+    3600,      // CacheFedcatalog
+    0,         // CacheOther
+}; /**< @private lifetime of responses by \ref CacheClass */
+
+/**
+ * @brief      Set the cache directory
+ *
+ * @ingroup    cache
+ *
+ * @param      dir   cache directory, created if needed, NULL disables the cache
+ *
+ * @note The cache is disabled by default
+ */
+void
+cache_set_dir(char *dir) {
+    FREE(_CACHE_DIR);
+    _CACHE_SIZE = -1;
+    if(!dir) {
+        return;
+    }
+    if(mkdir(dir, 0755) != 0 && access(dir, W_OK) != 0) {
+        printf("Error creating cache directory: %s\n", dir);
+        return;
+    }
+    _CACHE_DIR = strdup(dir);
+}
+
+/**
+ * @brief      Get the cache directory
+ *
+ * @ingroup    cache
+ *
+ * @return     cache directory, NULL if the cache is disabled
+ */
+char *
+cache_dir() {
+    return _CACHE_DIR;
+}
+
+/**
+ * @brief      Set the maximum size of the cache
+ *
+ * @ingroup    cache
+ *
+ * @param      bytes   maximum size in bytes [256 MiB]
+ *
+ */
+void
+cache_set_max_size(int64_t bytes) {
+    _CACHE_MAX = (bytes < 0) ? 0 : bytes;
+}
+
+/**
+ * @brief      Set the lifetime of cached responses for a class of service
+ *
+ * @ingroup    cache
+ *
+ * @param      c        class of service
+ * @param      seconds  lifetime in seconds, 0 to not cache
+ *
+ * @note Defaults are 1 hour for events and the federated catalog, 1 day for
+ *    station and response metadata, others are not cached.  Waveform data is
+ *    never cached
+ */
+void
+cache_set_ttl(CacheClass c, int64_t seconds) {
+    if(c <= CacheNone || c > CacheOther) {
+        return;
+    }
+    _CACHE_TTL[c] = (seconds < 0) ? 0 : seconds;
+}
+
+/**
+ * @brief      Determine the class of service of a URL
+ *
+ * @ingroup    cache
+ *
+ * @param      url   URL of the request
+ *
+ * @return     class of service
+ */
+CacheClass
+cache_class(char *url) {
+    if(!url || strstr(url, "/dataselect/")) {
+        return CacheNone;
+    }
+    if(strstr(url, "/fedcatalog/")) {
+        return CacheFedcatalog;
+    }
+    if(strstr(url, "/event/")) {
+        return CacheEvent;
+    }
+    if(strstr(url, "/station/") || strstr(url, "/sacpz/") || strstr(url, "/resp/")) {
+        return CacheStation;
+    }
+    return CacheOther;
+}
+
+/**
+ * @brief      Get the lifetime of a cached response
+ *
+ * @ingroup    cache
+ *
+ * @param      url   URL of the request
+ *
+ * @return     lifetime in seconds, 0 if the response is not cached
+ */
+int64_t
+cache_ttl(char *url) {
+    if(!_CACHE_DIR) {
+        return 0;
+    }
+    return _CACHE_TTL[cache_class(url)];
+}
+
+/**
+ * @brief      Get the cache file for a request
+ *
+ * @ingroup    cache
+ * @private
+ *
+ * @param      url    URL of the request
+ * @param      post   POST data of the request, or a key for streamed POST
+ *                    data, NULL for GET
+ *
+ * @return     cache file name, from a 64-bit FNV-1a hash of the method, URL
+ *             and POST data
+ *
+ * @warning    User owns the file name and is responsible for freeing it
+ */
+static char *
+cache_file(char *url, char *post) {
+    char *file = NULL;
+    char *parts[] = { (post) ? "POST" : "GET", url, (post) ? post : "" };
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < sizeof(parts) / sizeof(char *); i++) {
+        for(char *p = parts[i]; *p; p++) {
+            h = (h ^ (uint8_t) *p) * 1099511628211ULL;
+        }
+        h = (h ^ (uint8_t) '\n') * 1099511628211ULL;
+    }
+    fern_asprintf(&file, "%s/%016" PRIx64, _CACHE_DIR, h);
+    return file;
+}
+
+/**
+ * @brief      Free a cached response
+ *
+ * @memberof   cache_entry
+ * @ingroup    cache
+ *
+ * @param      e    cached response to free
+ *
+ */
+void
+cache_entry_free(cache_entry *e) {
+    if(e) {
+        FREE(e->file);
+        FREE(e->url);
+        FREE(e->post);
+        FREE(e->etag);
+        FREE(e->last_modified);
+        FREE(e->data);
+        FREE(e);
+    }
+}
+
+/**
+ * @brief      Read a header line from a cache file
+ *
+ * @ingroup    cache
+ * @private
+ *
+ * @param      fp    cache file
+ * @param      key   expected key
+ *
+ * @return     value of the line, NULL if the key does not match
+ *
+ * @warning    User owns the value and is responsible for freeing it
+ */
+static char *
+cache_read_line(FILE *fp, char *key) {
+    char line[4096] = {0};
+    size_t n = strlen(key);
+    if(!fgets(line, sizeof(line), fp)) {
+        return NULL;
+    }
+    line[strcspn(line, "\n")] = 0;
+    if(strncmp(line, key, n) != 0 || line[n] != ' ') {
+        return NULL;
+    }
+    return strdup(line + n + 1);
+}
+
+/**
+ * @brief      Get a cached response
+ *
+ * @ingroup    cache
+ *
+ * @param      url    URL of the request
+ * @param      post   POST data of the request, or a key for streamed POST
+ *                    data, NULL for GET
+ *
+ * @return     cached response, expired or not, NULL if the response is not
+ *             cached or should not be cached
+ *
+ * @warning    User owns the cached response and must free it with
+ *             cache_entry_free()
+ */
+cache_entry *
+cache_get(char *url, char *post) {
+    FILE *fp = NULL;
+    char *tmp = NULL;
+    char line[64] = {0};
+    size_t n = 0;
+    int64_t ttl = 0;
+    cache_entry *e = NULL;
+
+    if((ttl = cache_ttl(url)) <= 0) {
+        return NULL;
+    }
+    e = calloc(1, sizeof(cache_entry));
+    e->file = cache_file(url, post);
+    e->ttl  = ttl;
+    if(!(fp = fopen(e->file, "rb"))) {
+        goto error;
+    }
+    if(!fgets(line, sizeof(line), fp) || strncmp(line, CACHE_MAGIC, strlen(CACHE_MAGIC)) != 0) {
+        goto error;
+    }
+    if(!(e->url = cache_read_line(fp, "url")) || strcmp(e->url, url) != 0) {
+        goto error;
+    }
+    if(!(tmp = cache_read_line(fp, "time"))) {
+        goto error;
+    }
+    e->stored = strtoll(tmp, NULL, 10);
+    FREE(tmp);
+    if(!(e->etag = cache_read_line(fp, "etag")) ||
+       !(e->last_modified = cache_read_line(fp, "last-modified"))) {
+        goto error;
+    }
+    if(!(tmp = cache_read_line(fp, "length"))) {
+        goto error;
+    }
+    n = (size_t) strtoull(tmp, NULL, 10);
+    FREE(tmp);
+    e->data = calloc(n + 1, sizeof(char));
+    if(fread(e->data, 1, n, fp) != n) {
+        goto error;
+    }
+    e->n = n;
+    e->post = (post) ? strdup(post) : NULL;
+    fclose(fp);
+    // Mark as recently used
+    utime(e->file, NULL);
+    return e;
+ error:
+    if(fp) {
+        fclose(fp);
+    }
+    cache_entry_free(e);
+    return NULL;
+}
+
+/**
+ * @brief      Check if a cached response has not expired
+ *
+ * @memberof   cache_entry
+ * @ingroup    cache
+ *
+ * @param      e    cached response
+ *
+ * @return     1 if the response may be used without asking the server, 0 otherwise
+ */
+int
+cache_entry_is_fresh(cache_entry *e) {
+    if(!e) {
+        return 0;
+    }
+    return ((int64_t) time(NULL) - e->stored) < e->ttl;
+}
+
+/**
+ * @brief      Get the body of a cached response
+ *
+ * @memberof   cache_entry
+ * @ingroup    cache
+ *
+ * @param      e    cached response
+ *
+ * @return     body, owned by the cached response
+ */
+char *
+cache_entry_data(cache_entry *e) {
+    return e->data;
+}
+
+/**
+ * @brief      Get the length of the body of a cached response
+ *
+ * @memberof   cache_entry
+ * @ingroup    cache
+ *
+ * @param      e    cached response
+ *
+ * @return     length of the body in bytes
+ */
+size_t
+cache_entry_len(cache_entry *e) {
+    return e->n;
+}
+
+/**
+ * @brief      Get the ETag of a cached response
+ *
+ * @memberof   cache_entry
+ * @ingroup    cache
+ *
+ * @param      e    cached response
+ *
+ * @return     ETag, empty if the server did not provide one
+ */
+char *
+cache_entry_etag(cache_entry *e) {
+    return e->etag;
+}
+
+/**
+ * @brief      Get the Last-Modified time of a cached response
+ *
+ * @memberof   cache_entry
+ * @ingroup    cache
+ *
+ * @param      e    cached response
+ *
+ * @return     Last-Modified time, empty if the server did not provide one
+ */
+char *
+cache_entry_last_modified(cache_entry *e) {
+    return e->last_modified;
+}
+
+/**
+ * @brief      File in the cache directory
+ * @ingroup    cache
+ * @private
+ */
+typedef struct {
+    char *file;    /**< @private file name */
+    int64_t size;  /**< @private size in bytes */
+    time_t mtime;  /**< @private time of last use */
+} cache_file_info;
+
+/**
+ * @brief      Compare cache files by time of last use
+ * @ingroup    cache
+ * @private
+ */
+static int
+cache_file_info_cmp(const void *pa, const void *pb) {
+    const cache_file_info *a = *(cache_file_info * const *) pa;
+    const cache_file_info *b = *(cache_file_info * const *) pb;
+    return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+/**
+ * @brief      Free a cache file
+ * @ingroup    cache
+ * @private
+ */
+static void
+cache_file_info_free(void *p) {
+    cache_file_info *f = (cache_file_info *) p;
+    if(f) {
+        FREE(f->file);
+        FREE(f);
+    }
+}
+
+/**
+ * @brief      Remove the least recently used responses until the cache fits
+ *             within its maximum size
+ *
+ * @ingroup    cache
+ * @private
+ *
+ * @note The cache directory is scanned and the running size of the cache,
+ *    see cache_put(), is reset to what remains
+ */
+static void
+cache_evict() {
+    DIR *dir = NULL;
+    struct dirent *d = NULL;
+    struct stat st;
+    int64_t total = 0;
+    cache_file_info **files = NULL;
+
+    if(!(dir = opendir(_CACHE_DIR))) {
+        return;
+    }
+    files = xarray_new('p');
+    while((d = readdir(dir))) {
+        cache_file_info *f = NULL;
+        if(d->d_name[0] == '.') {
+            continue;
+        }
+        f = calloc(1, sizeof(cache_file_info));
+        fern_asprintf(&f->file, "%s/%s", _CACHE_DIR, d->d_name);
+        if(stat(f->file, &st) != 0 || !S_ISREG(st.st_mode)) {
+            cache_file_info_free(f);
+            continue;
+        }
+        f->size = (int64_t) st.st_size;
+        f->mtime = st.st_mtime;
+        total += f->size;
+        files = xarray_append(files, f);
+    }
+    closedir(dir);
+    if(total > _CACHE_MAX) {
+        qsort(files, xarray_length(files), sizeof(cache_file_info *), cache_file_info_cmp);
+        for(size_t i = 0; i < xarray_length(files) && total > _CACHE_MAX; i++) {
+            if(unlink(files[i]->file) == 0) {
+                total -= files[i]->size;
+            }
+        }
+    }
+    _CACHE_SIZE = total;
+    xarray_free_items(files, cache_file_info_free);
+    xarray_free(files);
+}
+
+/**
+ * @brief      Store a response in the cache
+ *
+ * @ingroup    cache
+ *
+ * @param      url            URL of the request
+ * @param      post           POST data of the request, or a key for streamed
+ *                            POST data, NULL for GET
+ * @param      data           response body
+ * @param      n              length of data
+ * @param      etag           ETag of the response, may be NULL
+ * @param      last_modified  Last-Modified time of the response, may be NULL
+ *
+ * @return     1 on success, 0 on failure or if the response is not cached
+ *
+ * @note The file is written to a temporary name and renamed into place, so
+ *    readers never see a partial response.  A running size of the cache is
+ *    kept and the cache directory is only scanned for responses to remove
+ *    once it exceeds the maximum size
+ */
+int
+cache_put(char *url, char *post, char *data, size_t n, char *etag, char *last_modified) {
+    FILE *fp = NULL;
+    char *file = NULL;
+    char *tmp = NULL;
+    int retval = 0;
+    int64_t old = 0;
+    struct stat st;
+
+    if(cache_ttl(url) <= 0 || (n > 0 && !data)) {
+        return 0;
+    }
+    if((int64_t) n > _CACHE_MAX) {
+        return 0;
+    }
+    file = cache_file(url, post);
+    fern_asprintf(&tmp, "%s.%d.tmp", file, (int) getpid());
+    if(!(fp = fopen(tmp, "wb"))) {
+        printf("Error writing cache file: %s\n", tmp);
+        goto error;
+    }
+    fprintf(fp, "%s\n", CACHE_MAGIC);
+    fprintf(fp, "url %s\n", url);
+    fprintf(fp, "time %" PRId64 "\n", (int64_t) time(NULL));
+    fprintf(fp, "etag %s\n", (etag) ? etag : "");
+    fprintf(fp, "last-modified %s\n", (last_modified) ? last_modified : "");
+    fprintf(fp, "length %zu\n", n);
+    if(fwrite(data, 1, n, fp) != n) {
+        printf("Error writing cache file: %s\n", tmp);
+        goto error;
+    }
+    if(fclose(fp) != 0) {
+        fp = NULL;
+        goto error;
+    }
+    fp = NULL;
+    if(stat(file, &st) == 0) {
+        old = (int64_t) st.st_size;
+    }
+    if(rename(tmp, file) != 0) {
+        goto error;
+    }
+    retval = 1;
+    if(_CACHE_SIZE >= 0 && stat(file, &st) == 0) {
+        _CACHE_SIZE += (int64_t) st.st_size - old;
+    }
+    if(_CACHE_SIZE < 0 || _CACHE_SIZE > _CACHE_MAX) {
+        cache_evict();
+    }
+ error:
+    if(fp) {
+        fclose(fp);
+    }
+    if(!retval && tmp) {
+        unlink(tmp);
+    }
+    FREE(tmp);
+    FREE(file);
+    return retval;
+}
+
+/**
+ * @brief      Mark a cached response as current after the server confirmed
+ *             it has not changed
+ *
+ * @memberof   cache_entry
+ * @ingroup    cache
+ *
+ * @param      e    cached response
+ *
+ * @return     1 on success, 0 on failure
+ */
+int
+cache_refresh(cache_entry *e) {
+    if(!e) {
+        return 0;
+    }
+    e->stored = (int64_t) time(NULL);
+    return cache_put(e->url, e->post, e->data, e->n, e->etag, e->last_modified);
+}
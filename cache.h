@@ -0,0 +1,51 @@
+/**
+ * @file
+ * @brief On-disk cache of HTTP responses
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum CacheClass CacheClass;
+/**
+ * @brief Class of service, each with its own cache lifetime
+ * @public
+ *
+ * @ingroup cache
+ */
+enum CacheClass {
+    CacheNone       = 0, /**< Never cached, e.g. dataselect @ingroup cache */
+    CacheEvent      = 1, /**< Event services */
+    CacheStation    = 2, /**< Station and response services */
+    CacheFedcatalog = 3, /**< Federated catalog */
+    CacheOther      = 4, /**< Everything else */
+};
+
+/**
+ * Cached HTTP response
+ */
+typedef struct cache_entry cache_entry;
+
+void          cache_set_dir(char *dir);
+char *        cache_dir();
+void          cache_set_max_size(int64_t bytes);
+void          cache_set_ttl(CacheClass c, int64_t seconds);
+CacheClass    cache_class(char *url);
+int64_t       cache_ttl(char *url);
+
+cache_entry * cache_get(char *url, char *post);
+int           cache_put(char *url, char *post, char *data, size_t n,
+                        char *etag, char *last_modified);
+int           cache_refresh(cache_entry *e);
+
+int           cache_entry_is_fresh(cache_entry *e);
+char *        cache_entry_data(cache_entry *e);
+size_t        cache_entry_len(cache_entry *e);
+char *        cache_entry_etag(cache_entry *e);
+char *        cache_entry_last_modified(cache_entry *e);
+void          cache_entry_free(cache_entry *e);
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1,516 @@
+/**
+ * @file
+ * @brief Estimated size of miniseed downloads
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "chunksize.h"
+#include "station.h"
+#include "cache.h"
+#include "chash.h"
+#include "array.h"
+#include "defs.h"
+
+/**
+ * @defgroup chunksize chunksize
+ * @brief Estimated size of miniseed downloads
+ *
+ * @details The size of a request line is the number of samples, from the
+ *    sample rate, times the bytes per sample.  Sample rates come from channel
+ *    metadata when available, otherwise from the band code, see band_to_sps().
+ *    Bytes per sample are learned for each network and channel from completed
+ *    downloads, which includes compression and gaps, and are kept in a file
+ *    for the next run.  The download speed of each data center is learned
+ *    and kept the same way, see chunk_size_speed()
+ *
+ * @code
+ *   chunk_size_add_channels(channels);
+ *   size_t n = chunk_size_estimate("IU", "ANMO", "00", "BHZ", 86400);
+ *   // After a download
+ *   chunk_size_learn("IU", "BHZ", 40.0 * 86400, nbytes);
+ *   chunk_size_save();
+ * @endcode
+ */
+
+#define CHUNK_SIZE_MAGIC   "# fern chunk sizes 1" /**< @private first line of the sizes file */
+#define CHUNK_SIZE_DEFAULT 1.5   /**< @private bytes per sample before any are learned */
+#define CHUNK_SIZE_MIN     1000.0 /**< @private samples needed to use a learned value */
+#define CHUNK_SIZE_DECAY   1e9   /**< @private samples before older downloads count less */
+#define CHUNK_SPEED_DECAY  3600.0 /**< @private seconds of downloads before older ones count less */
+#define CHUNK_SPEED_MIN    1.0    /**< @private seconds of downloads needed to use a learned speed */
+
+/**
+ * @brief Bytes and samples received for a network and channel
+ * @private
+ * @ingroup chunksize
+ */
+typedef struct {
+    double bytes;   /**< \private bytes received */
+    double samples; /**< \private samples requested, seconds taken for a data center */
+} size_ratio;
+
+static char *_SIZE_FILE   = NULL;  /**< @private file learned sizes are kept in, "" for none */
+static int   _SIZE_LOADED = FALSE; /**< @private learned sizes have been read */
+static int   _SIZE_DIRTY  = FALSE; /**< @private learned sizes changed since saved */
+static dict *_RATES       = NULL;  /**< @private sample rates from metadata by NET.STA.LOC.CHA and NET.CHA */
+static dict *_RATIOS      = NULL;  /**< @private learned sizes by NET.CHA and *.CHA, speeds by @DATACENTER */
+
+/**
+ * @brief Convert the channels band code into samples per second (sps)
+ *
+ * @ingroup    chunksize
+ *
+ * @param band
+ *
+ * @return samples per second
+ *
+ * @note Values are approximate
+ */
+double
+band_to_sps(char band) {
+    double sps = 1.0;
+    switch(band) {
+    case 'F': sps =1000.0;     break;
+    case 'G': sps =1000.0;     break;
+    case 'D': sps = 500.0;     break;
+    case 'C': sps = 250.0;     break;
+    case 'E': sps = 100.0;     break; // ExtremelyShortPeriod
+    case 'S': sps =  40.0;     break; // ShortPeriod
+    case 'H': sps = 100.0;     break; // HighBroadBand
+    case 'B': sps =  40.0;     break; // Broadband
+    case 'M': sps =   5.0;     break; // MidPeriod
+    case 'L': sps =   1.0;     break; // LongPeriod
+    case 'V': sps =   0.1;     break; // VeryLongPeriod
+    case 'U': sps =   0.01;    break; // UltraLongPeriod
+    case 'R': sps =   0.00030; break; // ExtremelyLongPeriod
+    case 'P': sps =   0.001;   break; // Does not exist
+    case 'T': sps =   0.001;   break; // Only 3 channels
+    case 'Q': sps =   0.05000; break;
+    case 'A': sps =   1.0;     break; // Administrative
+    case 'O': sps =   1.0;     break; // Opaque
+    case 'W': sps =   1.0;     break; // Associated with Wind and Pressure
+    }
+    return sps;
+}
+
+/**
+ * @brief      Set the file learned sizes are kept in
+ *
+ * @ingroup    chunksize
+ *
+ * @param      file   file name, "" to not keep learned sizes, NULL for the
+ *                    default
+ *
+ * @note The default is chunk_sizes in the cache directory, see cache_set_dir(),
+ *    otherwise $HOME/.fern_chunk_sizes
+ */
+void
+chunk_size_set_file(char *file) {
+    FREE(_SIZE_FILE);
+    if(file) {
+        _SIZE_FILE = strdup(file);
+    }
+    _SIZE_LOADED = FALSE;
+}
+
+/**
+ * @brief      Get the file learned sizes are kept in
+ *
+ * @ingroup    chunksize
+ * @private
+ *
+ * @return     file name, NULL if learned sizes are not kept
+ */
+static char *
+chunk_size_file() {
+    char tmp[2048] = {0};
+    if(!_SIZE_FILE) {
+        if(cache_dir()) {
+            snprintf(tmp, sizeof(tmp), "%s/chunk_sizes", cache_dir());
+        } else if(getenv("HOME")) {
+            snprintf(tmp, sizeof(tmp), "%s/.fern_chunk_sizes", getenv("HOME"));
+        }
+        _SIZE_FILE = strdup(tmp);
+    }
+    return (strlen(_SIZE_FILE) > 0) ? _SIZE_FILE : NULL;
+}
+
+/**
+ * @brief      Read learned sizes from the sizes file
+ *
+ * @ingroup    chunksize
+ * @private
+ *
+ * @note Only read once, lines that cannot be parsed are skipped
+ */
+static void
+chunk_size_load() {
+    FILE *fp = NULL;
+    char *file = NULL;
+    char line[256] = {0};
+    if(_SIZE_LOADED) {
+        return;
+    }
+    _SIZE_LOADED = TRUE;
+    if(!_RATIOS) {
+        _RATIOS = dict_new();
+    }
+    if(!(file = chunk_size_file()) || !(fp = fopen(file, "r"))) {
+        return;
+    }
+    if(!fgets(line, sizeof(line), fp) || strncmp(line, CHUNK_SIZE_MAGIC, strlen(CHUNK_SIZE_MAGIC)) != 0) {
+        fclose(fp);
+        return;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        char key[64] = {0};
+        double bytes = 0.0, samples = 0.0;
+        size_ratio *r = NULL;
+        if(sscanf(line, "%63s %lf %lf", key, &bytes, &samples) != 3 ||
+           bytes < 0.0 || samples <= 0.0) {
+            continue;
+        }
+        if(!(r = dict_get(_RATIOS, key))) {
+            r = calloc(1, sizeof(size_ratio));
+            dict_put(_RATIOS, key, r);
+        }
+        r->bytes = bytes;
+        r->samples = samples;
+    }
+    fclose(fp);
+}
+
+/**
+ * @brief      Write learned sizes to the sizes file
+ *
+ * @ingroup    chunksize
+ *
+ * @return     1 on success or if nothing changed, 0 on error
+ *
+ * @note The file is written to a unique temporary file in the same directory
+ *    and renamed into place, so processes saving at the same time do not
+ *    overwrite each other's partial files
+ */
+int
+chunk_size_save() {
+    int fd = -1;
+    FILE *fp = NULL;
+    char *file = NULL;
+    char tmp[2048] = {0};
+    char **keys = NULL;
+    if(!_SIZE_DIRTY || !(file = chunk_size_file())) {
+        return 1;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+    if((fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w"))) {
+        printf("Error writing chunk sizes: %s\n", tmp);
+        if(fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return 0;
+    }
+    fchmod(fd, 0644);
+    fprintf(fp, "%s\n", CHUNK_SIZE_MAGIC);
+    keys = dict_keys(_RATIOS);
+    for(size_t i = 0; keys && keys[i]; i++) {
+        size_ratio *r = dict_get(_RATIOS, keys[i]);
+        // Speeds keep fractions of a second
+        fprintf(fp, (keys[i][0] == '@') ? "%s %.0f %.3f\n" : "%s %.0f %.0f\n",
+                keys[i], r->bytes, r->samples);
+    }
+    dict_keys_free(keys);
+    if(fclose(fp) != 0 || rename(tmp, file) != 0) {
+        printf("Error writing chunk sizes: %s\n", file);
+        unlink(tmp);
+        return 0;
+    }
+    _SIZE_DIRTY = FALSE;
+    return 1;
+}
+
+/**
+ * @brief      Put a sample rate in the table of sample rates
+ *
+ * @ingroup    chunksize
+ * @private
+ *
+ * @param      key   table key
+ * @param      sps   samples per second
+ * @param      max   keep the larger of sps and the current rate
+ *
+ */
+static void
+chunk_size_put_rate(char *key, double sps, int max) {
+    double *v = NULL;
+    if(!(v = dict_get(_RATES, key))) {
+        v = calloc(1, sizeof(double));
+        dict_put(_RATES, key, v);
+    }
+    if(!max || sps > *v) {
+        *v = sps;
+    }
+}
+
+/**
+ * @brief      Set the sample rate of a channel from metadata
+ *
+ * @ingroup    chunksize
+ *
+ * @param      net   network code
+ * @param      sta   station code
+ * @param      loc   location code
+ * @param      cha   channel code
+ * @param      sps   samples per second
+ *
+ * @note The highest rate of a channel code within a network is also used for
+ *    stations without metadata
+ */
+void
+chunk_size_set_sample_rate(char *net, char *sta, char *loc, char *cha, double sps) {
+    char key[64] = {0};
+    if(sps <= 0.0) {
+        return;
+    }
+    if(!_RATES) {
+        _RATES = dict_new();
+    }
+    snprintf(key, sizeof(key), "%s.%s.%s.%s", net, sta, loc, cha);
+    chunk_size_put_rate(key, sps, FALSE);
+    snprintf(key, sizeof(key), "%s.%s", net, cha);
+    chunk_size_put_rate(key, sps, TRUE);
+}
+
+/**
+ * @brief      Set sample rates from channel metadata
+ *
+ * @ingroup    chunksize
+ *
+ * @param      s     channels, e.g. from channel_xml_parse()
+ *
+ * @note Channels without a sample rate are skipped
+ */
+void
+chunk_size_add_channels(station **s) {
+    for(size_t i = 0; i < xarray_length(s); i++) {
+        chunk_size_set_sample_rate(s[i]->net, s[i]->sta, s[i]->loc, s[i]->cha,
+                                   s[i]->sample_rate);
+    }
+}
+
+/**
+ * @brief      Get the sample rate of a channel
+ *
+ * @ingroup    chunksize
+ *
+ * @param      net   network code
+ * @param      sta   station code
+ * @param      loc   location code, -- for an empty location
+ * @param      cha   channel code
+ *
+ * @return     samples per second, from metadata if available, otherwise from
+ *             the band code
+ */
+double
+chunk_size_sample_rate(char *net, char *sta, char *loc, char *cha) {
+    char key[64] = {0};
+    double *v = NULL;
+    if(_RATES) {
+        snprintf(key, sizeof(key), "%s.%s.%s.%s", net, sta,
+                 (strcmp(loc, "--") == 0) ? "" : loc, cha);
+        if((v = dict_get(_RATES, key))) {
+            return *v;
+        }
+        snprintf(key, sizeof(key), "%s.%s", net, cha);
+        if((v = dict_get(_RATES, key))) {
+            return *v;
+        }
+    }
+    return band_to_sps(cha[0]);
+}
+
+/**
+ * @brief      Get the bytes per sample of miniseed data for a channel
+ *
+ * @ingroup    chunksize
+ *
+ * @param      net   network code
+ * @param      cha   channel code
+ *
+ * @return     bytes per sample learned for the network and channel, or for the
+ *             channel in any network, otherwise 1.5
+ */
+double
+chunk_size_bytes_per_sample(char *net, char *cha) {
+    char key[64] = {0};
+    size_ratio *r = NULL;
+    chunk_size_load();
+    snprintf(key, sizeof(key), "%s.%s", net, cha);
+    if((r = dict_get(_RATIOS, key)) && r->samples >= CHUNK_SIZE_MIN) {
+        return r->bytes / r->samples;
+    }
+    snprintf(key, sizeof(key), "*.%s", cha);
+    if((r = dict_get(_RATIOS, key)) && r->samples >= CHUNK_SIZE_MIN) {
+        return r->bytes / r->samples;
+    }
+    return CHUNK_SIZE_DEFAULT;
+}
+
+/**
+ * @brief      Estimate the size of miniseed data for a channel
+ *
+ * @ingroup    chunksize
+ *
+ * @param      net      network code
+ * @param      sta      station code
+ * @param      loc      location code
+ * @param      cha      channel code
+ * @param      seconds  duration of data
+ *
+ * @return     estimated size in bytes
+ */
+size_t
+chunk_size_estimate(char *net, char *sta, char *loc, char *cha, int64_t seconds) {
+    double sps = chunk_size_sample_rate(net, sta, loc, cha);
+    double bps = chunk_size_bytes_per_sample(net, cha);
+    return (size_t) ceil(sps * (double) seconds * bps);
+}
+
+/**
+ * @brief      Add a learned size to the table of learned sizes
+ *
+ * @ingroup    chunksize
+ * @private
+ *
+ * @param      key      table key
+ * @param      samples  samples requested
+ * @param      bytes    bytes received
+ *
+ * @note Once a key has seen many samples, older downloads are given less
+ *    weight so the sizes follow changes in the data
+ */
+static void
+chunk_size_add_ratio(char *key, double samples, double bytes) {
+    size_ratio *r = NULL;
+    if(!(r = dict_get(_RATIOS, key))) {
+        r = calloc(1, sizeof(size_ratio));
+        dict_put(_RATIOS, key, r);
+    }
+    if(r->samples > CHUNK_SIZE_DECAY) {
+        r->samples *= 0.5;
+        r->bytes *= 0.5;
+    }
+    r->samples += samples;
+    r->bytes += bytes;
+}
+
+/**
+ * @brief      Learn the size of miniseed data from a completed download
+ *
+ * @ingroup    chunksize
+ *
+ * @param      net      network code
+ * @param      cha      channel code
+ * @param      samples  samples requested, from the sample rate and duration
+ * @param      bytes    bytes received
+ *
+ * @note Channel codes with wildcards are not learned.  Save learned sizes
+ *    with chunk_size_save()
+ */
+void
+chunk_size_learn(char *net, char *cha, double samples, int64_t bytes) {
+    char key[64] = {0};
+    if(samples <= 0.0 || bytes <= 0 || strpbrk(cha, "*?") || strpbrk(net, "*?")) {
+        return;
+    }
+    chunk_size_load();
+    snprintf(key, sizeof(key), "%s.%s", net, cha);
+    chunk_size_add_ratio(key, samples, (double) bytes);
+    snprintf(key, sizeof(key), "*.%s", cha);
+    chunk_size_add_ratio(key, samples, (double) bytes);
+    _SIZE_DIRTY = TRUE;
+}
+
+/**
+ * @brief      Learn the download speed of a data center
+ *
+ * @ingroup    chunksize
+ *
+ * @param      dc       data center name, e.g. IRISDMC
+ * @param      bytes    bytes received
+ * @param      seconds  time taken for the download
+ *
+ * @note Save learned speeds with chunk_size_save()
+ */
+void
+chunk_size_learn_speed(char *dc, int64_t bytes, double seconds) {
+    char key[64] = {0};
+    size_ratio *r = NULL;
+    if(!dc || !*dc || bytes <= 0 || seconds <= 0.0) {
+        return;
+    }
+    chunk_size_load();
+    snprintf(key, sizeof(key), "@%s", dc);
+    if(!(r = dict_get(_RATIOS, key))) {
+        r = calloc(1, sizeof(size_ratio));
+        dict_put(_RATIOS, key, r);
+    }
+    if(r->samples > CHUNK_SPEED_DECAY) {
+        r->samples *= 0.5;
+        r->bytes *= 0.5;
+    }
+    r->samples += seconds;
+    r->bytes += (double) bytes;
+    _SIZE_DIRTY = TRUE;
+}
+
+/**
+ * @brief      Get the learned download speed of a data center
+ *
+ * @ingroup    chunksize
+ *
+ * @param      dc    data center name, e.g. IRISDMC
+ *
+ * @return     bytes per second, 0 if not yet learned
+ */
+double
+chunk_size_speed(char *dc) {
+    char key[64] = {0};
+    size_ratio *r = NULL;
+    if(!dc || !*dc) {
+        return 0.0;
+    }
+    chunk_size_load();
+    snprintf(key, sizeof(key), "@%s", dc);
+    if(!(r = dict_get(_RATIOS, key)) || r->samples < CHUNK_SPEED_MIN) {
+        return 0.0;
+    }
+    return r->bytes / r->samples;
+}
+
+/**
+ * @brief      Release sample rates and learned sizes
+ *
+ * @ingroup    chunksize
+ *
+ * @note Learned sizes not yet saved are lost
+ */
+void
+chunk_size_cleanup() {
+    if(_RATES) {
+        dict_free(_RATES, free);
+        _RATES = NULL;
+    }
+    if(_RATIOS) {
+        dict_free(_RATIOS, free);
+        _RATIOS = NULL;
+    }
+    FREE(_SIZE_FILE);
+    _SIZE_LOADED = FALSE;
+    _SIZE_DIRTY = FALSE;
+}
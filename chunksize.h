@@ -0,0 +1,30 @@
+/**
+ * @file
+ * @brief Estimated size of miniseed downloads
+ */
+
+#ifndef _CHUNKSIZE_H_
+#define _CHUNKSIZE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct station;
+
+double   band_to_sps(char band);
+
+void     chunk_size_set_file(char *file);
+void     chunk_size_set_sample_rate(char *net, char *sta, char *loc, char *cha,
+                                    double sps);
+void     chunk_size_add_channels(struct station **s);
+double   chunk_size_sample_rate(char *net, char *sta, char *loc, char *cha);
+double   chunk_size_bytes_per_sample(char *net, char *cha);
+size_t   chunk_size_estimate(char *net, char *sta, char *loc, char *cha,
+                             int64_t seconds);
+void     chunk_size_learn(char *net, char *cha, double samples, int64_t bytes);
+void     chunk_size_learn_speed(char *dc, int64_t bytes, double seconds);
+double   chunk_size_speed(char *dc);
+int      chunk_size_save();
+void     chunk_size_cleanup();
+
+#endif /* _CHUNKSIZE_H_ */
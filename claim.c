@@ -0,0 +1,351 @@
+/**
+ * @file
+ * @brief Leased claims on work shared between processes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "claim.h"
+#include "strip.h"
+#include "defs.h"
+
+/**
+ * @defgroup claim claim
+ * @brief Leased claims on work shared between processes
+ *
+ * @details Processes sharing work, e.g. the chunks of a data request file,
+ *    record what each is working on in a claims file, one claim per line
+ *    with the owner and the time its lease expires.  The file is locked with
+ *    flock() while it is read and rewritten, so checking and taking a claim
+ *    is a single step.  The owner renews the lease while the work makes
+ *    progress.  If the owner stops or dies the lease expires and another
+ *    process may take the claim.  Owners are host:pid, so processes on
+ *    different hosts may share a claims file on a shared filesystem
+ *
+ * @code
+ *   claim_table *c = claim_table_open("big.request.claims", 300);
+ *   if(claim_take(c, "chunk-1", NULL)) {
+ *       // Work, calling claim_renew(c, "chunk-1") now and then
+ *       claim_release(c, "chunk-1");
+ *   }
+ *   claim_table_free(c);
+ * @endcode
+ */
+
+/**
+ * @brief Claim on a single piece of work
+ * @private
+ * @ingroup claim
+ */
+typedef struct {
+    char id[64];      /**< \private identifier of the work */
+    char owner[128];  /**< \private owner, host:pid */
+    int64_t expires;  /**< \private time the lease expires, seconds since 1970 */
+} claim_entry;
+
+/**
+ * @brief Claims on work shared between processes, kept in a file
+ * @ingroup claim
+ */
+struct claim_table {
+    char *file;       /**< @private claims file */
+    int fd;           /**< @private open claims file */
+    int64_t lease;    /**< @private lease of a claim in seconds */
+    char owner[128];  /**< @private this process, host:pid */
+    claim_entry *e;   /**< @private claims read from the file while locked */
+    size_t n;         /**< @private number of claims read */
+    size_t alloc;     /**< @private claims allocated */
+};
+
+/**
+ * @brief Open a claims file
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ *
+ * @param      file   claims file, created if needed
+ * @param      lease  seconds a claim lasts without being renewed
+ *
+ * @return     claims, NULL if the file cannot be opened
+ */
+claim_table *
+claim_table_open(char *file, int64_t lease) {
+    int fd = -1;
+    char host[64] = {0};
+    claim_table *c = NULL;
+    if((fd = open(file, O_RDWR | O_CREAT, 0644)) < 0) {
+        printf("Error opening claims file: %s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+    c = calloc(1, sizeof(claim_table));
+    c->file = strdup(file);
+    c->fd = fd;
+    c->lease = (lease < 1) ? 1 : lease;
+    if(gethostname(host, sizeof(host) - 1) != 0) {
+        fern_strlcpy(host, "localhost", sizeof(host));
+    }
+    snprintf(c->owner, sizeof(c->owner), "%s:%d", host, (int) getpid());
+    return c;
+}
+
+/**
+ * @brief Get the lease of a claim
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ *
+ * @param      c    claims
+ *
+ * @return     seconds a claim lasts without being renewed
+ */
+int64_t
+claim_table_lease(claim_table *c) {
+    return (c) ? c->lease : 0;
+}
+
+/**
+ * @brief Lock the claims file and read the current claims
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ * @private
+ *
+ * @param      c    claims
+ *
+ * @return     1 on success, 0 on error
+ *
+ * @note Lines that cannot be parsed are dropped.  Call claim_table_unlock()
+ *    once done
+ */
+static int
+claim_table_lock(claim_table *c) {
+    char *data = NULL, *p = NULL, *line = NULL;
+    struct stat st;
+    ssize_t n = 0;
+    c->n = 0;
+    if(flock(c->fd, LOCK_EX) != 0) {
+        printf("Error locking claims file: %s: %s\n", c->file, strerror(errno));
+        return 0;
+    }
+    if(fstat(c->fd, &st) != 0) {
+        flock(c->fd, LOCK_UN);
+        return 0;
+    }
+    data = calloc((size_t) st.st_size + 1, sizeof(char));
+    if((n = pread(c->fd, data, (size_t) st.st_size, 0)) < 0) {
+        n = 0;
+    }
+    data[n] = 0;
+    p = data;
+    while((line = strsep(&p, "\n"))) {
+        claim_entry e;
+        memset(&e, 0, sizeof(e));
+        if(sscanf(line, "%63s %127s %" SCNd64, e.id, e.owner, &e.expires) != 3) {
+            continue;
+        }
+        if(c->n >= c->alloc) {
+            c->alloc = (c->alloc == 0) ? 16 : 2 * c->alloc;
+            c->e = realloc(c->e, c->alloc * sizeof(claim_entry));
+        }
+        c->e[c->n++] = e;
+    }
+    FREE(data);
+    return 1;
+}
+
+/**
+ * @brief Write the claims, if changed, and unlock the claims file
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ * @private
+ *
+ * @param      c      claims
+ * @param      write  write the claims back to the file
+ *
+ * @note Expired claims are not written
+ */
+static void
+claim_table_unlock(claim_table *c, int write) {
+    if(write) {
+        size_t k = 0;
+        int64_t now = (int64_t) time(NULL);
+        char *data = calloc(c->n * (sizeof(claim_entry) + 32) + 1, sizeof(char));
+        for(size_t i = 0; i < c->n; i++) {
+            if(c->e[i].expires <= now) {
+                continue;
+            }
+            k += (size_t) sprintf(data + k, "%s %s %" PRId64 "\n",
+                                  c->e[i].id, c->e[i].owner, c->e[i].expires);
+        }
+        if(ftruncate(c->fd, 0) != 0 || pwrite(c->fd, data, k, 0) != (ssize_t) k) {
+            printf("Error writing claims file: %s: %s\n", c->file, strerror(errno));
+        }
+        FREE(data);
+    }
+    flock(c->fd, LOCK_UN);
+}
+
+/**
+ * @brief Find a claim read from the claims file
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ * @private
+ *
+ * @param      c    claims, locked
+ * @param      id   identifier of the work
+ *
+ * @return     claim, NULL if not claimed
+ */
+static claim_entry *
+claim_table_find(claim_table *c, char *id) {
+    for(size_t i = 0; i < c->n; i++) {
+        if(strcmp(c->e[i].id, id) == 0) {
+            return &c->e[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Claim a piece of work
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ *
+ * @param      c        claims
+ * @param      id       identifier of the work, without spaces
+ * @param      expires  time the current claim of another process expires,
+ *                      if not claimed, may be NULL
+ *
+ * @return     1 if claimed, 0 if claimed by another process or on error
+ *
+ * @note Work claimed by another process whose lease has expired is taken over
+ */
+int
+claim_take(claim_table *c, char *id, int64_t *expires) {
+    claim_entry *e = NULL;
+    int64_t now = (int64_t) time(NULL);
+    if(!c || !claim_table_lock(c)) {
+        return 0;
+    }
+    if((e = claim_table_find(c, id)) && e->expires > now && strcmp(e->owner, c->owner) != 0) {
+        if(expires) {
+            *expires = e->expires;
+        }
+        claim_table_unlock(c, FALSE);
+        return 0;
+    }
+    if(!e) {
+        if(c->n >= c->alloc) {
+            c->alloc = (c->alloc == 0) ? 16 : 2 * c->alloc;
+            c->e = realloc(c->e, c->alloc * sizeof(claim_entry));
+        }
+        e = &c->e[c->n++];
+        memset(e, 0, sizeof(claim_entry));
+        fern_strlcpy(e->id, id, sizeof(e->id));
+    }
+    fern_strlcpy(e->owner, c->owner, sizeof(e->owner));
+    e->expires = now + c->lease;
+    claim_table_unlock(c, TRUE);
+    return 1;
+}
+
+/**
+ * @brief Renew the lease of a claim
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ *
+ * @param      c    claims
+ * @param      id   identifier of the work
+ *
+ * @return     1 if the claim is still held, 0 if another process took it over
+ *
+ * @note A claim that expired without being taken over is claimed again
+ */
+int
+claim_renew(claim_table *c, char *id) {
+    claim_entry *e = NULL;
+    int64_t expires = 0;
+    if(!c || !claim_table_lock(c)) {
+        return 0;
+    }
+    if(!(e = claim_table_find(c, id)) || e->expires <= (int64_t) time(NULL)) {
+        claim_table_unlock(c, FALSE);
+        return claim_take(c, id, &expires);
+    }
+    if(strcmp(e->owner, c->owner) != 0) {
+        claim_table_unlock(c, FALSE);
+        return 0;
+    }
+    e->expires = (int64_t) time(NULL) + c->lease;
+    claim_table_unlock(c, TRUE);
+    return 1;
+}
+
+/**
+ * @brief Release a claim
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ *
+ * @param      c    claims
+ * @param      id   identifier of the work
+ *
+ * @note Claims of other processes are left as they are
+ */
+void
+claim_release(claim_table *c, char *id) {
+    size_t k = 0;
+    if(!c || !claim_table_lock(c)) {
+        return;
+    }
+    for(size_t i = 0; i < c->n; i++) {
+        if(strcmp(c->e[i].id, id) == 0 && strcmp(c->e[i].owner, c->owner) == 0) {
+            continue;
+        }
+        c->e[k++] = c->e[i];
+    }
+    c->n = k;
+    claim_table_unlock(c, TRUE);
+}
+
+/**
+ * @brief Release all claims of this process and close the claims file
+ *
+ * @memberof   claim_table
+ * @ingroup    claim
+ *
+ * @param      c    claims
+ *
+ */
+void
+claim_table_free(claim_table *c) {
+    size_t k = 0;
+    if(!c) {
+        return;
+    }
+    if(claim_table_lock(c)) {
+        for(size_t i = 0; i < c->n; i++) {
+            if(strcmp(c->e[i].owner, c->owner) != 0) {
+                c->e[k++] = c->e[i];
+            }
+        }
+        c->n = k;
+        claim_table_unlock(c, TRUE);
+    }
+    close(c->fd);
+    FREE(c->file);
+    FREE(c->e);
+    FREE(c);
+}
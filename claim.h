@@ -0,0 +1,24 @@
+/**
+ * @file
+ * @brief Leased claims on work shared between processes
+ */
+
+#ifndef _CLAIM_H_
+#define _CLAIM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Claims on work shared between processes, kept in a file
+ */
+typedef struct claim_table claim_table;
+
+claim_table * claim_table_open(char *file, int64_t lease);
+int64_t       claim_table_lease(claim_table *c);
+int           claim_take(claim_table *c, char *id, int64_t *expires);
+int           claim_renew(claim_table *c, char *id);
+void          claim_release(claim_table *c, char *id);
+void          claim_table_free(claim_table *c);
+
+#endif /* _CLAIM_H_ */
@@ -6,7 +6,11 @@
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <time.h>
 
 #include <libmseed/libmseed.h>
 
@@ -14,9 +18,14 @@
 #include "datareq.h"
 #include "request.h"
 #include "cprint.h"
+#include "chunksize.h"
+#include "station.h"
 #include "miniseed_sac.h"
 
 #include "chash.h"
+#include "sds.h"
+#include "claim.h"
+#include "slurp.h"
 #include "defs.h"
 #include "strip.h"
 #include "urls.h"
@@ -46,7 +55,9 @@ typedef struct breq_fast      breq_fast;
 struct breq_fast {
     int comment;  /**< if the data request is commented */
     dict *urls;   /**< urls where requests are made */
-    char **lines; /**< individual data lines in the request */
+    breq_fast_line *lines; /**< individual data lines in the request, parsed */
+    size_t nlines; /**< number of data lines */
+    size_t alloc;  /**< number of data lines allocated */
 };
 
 /**
@@ -57,6 +68,75 @@ struct breq_fast {
 struct data_request {
     dict *pars;        /**< search parameters */
     breq_fast **reqs; /**< Individual Data Requests */
+    int max_transfers;      /**< maximum concurrent downloads */
+    int max_per_datacenter; /**< maximum concurrent downloads per data center */
+    SplitAlign split;       /**< alignment of time splits */
+    char *sds;              /**< SDS archive data is written into, NULL for a file per chunk */
+    char **prefer;          /**< data centers in order of preference for duplicated data */
+    int64_t claim_lease;    /**< lease in seconds of chunks claimed from a shared request file, 0 if not shared */
+    data_request_trace_func trace_fn; /**< function called with each channel once downloaded, NULL if none */
+    void *trace_data;       /**< user data passed to trace_fn */
+    data_request_memory_func memory_fn; /**< bytes held by trace_data, NULL if none */
+    size_t memory;          /**< bytes of samples held before new chunks wait, 0 for no limit */
+};
+
+typedef struct data_download data_download;
+/**
+ * @brief State shared by all chunks during a data download
+ * @ingroup    data
+ * @private
+ */
+struct data_download {
+    data_request *fdr;   /**< data request being downloaded */
+    char *filename;      /**< data request filename, updated after each chunk */
+    char *prefix;        /**< prefix for miniseed output files */
+    int save_files;      /**< save data to miniseed files */
+    int unpack_data;     /**< unpack data into mst3k */
+    MS3TraceList *mst3k; /**< unpacked miniseed data */
+    sds_writer *sds;     /**< SDS archive records are written into, NULL for a file per chunk */
+    fern_loop *loop;     /**< transfer loop chunks are downloaded with */
+    int journal;         /**< journal of completed chunks, -1 if not open */
+    size_t unsynced;     /**< journal entries not yet synced to disk */
+    time_t synced;       /**< time the journal was last synced */
+    claim_table *claims; /**< claims on chunks shared with other processes, NULL if not shared */
+    dict *ids;           /**< chunks by identifier, for journal entries of other processes */
+    off_t journal_read;  /**< bytes of the journal read, see data_request_journal_refresh() */
+    int *started;        /**< chunks started by this process, by index, NULL if all are started at once */
+    int64_t *retry_at;   /**< time the claim of another process on a chunk expires, by index */
+    dict *busy;          /**< number of chunks downloading by data center, when started as transfers free up */
+    size_t inflight;     /**< number of chunks downloading, when started as transfers free up */
+    int finished;        /**< the journal was compacted by another process */
+    dict *pending;       /**< chunks not yet finished by channel, see data_request_set_trace_func() */
+    size_t wild;         /**< chunks with wildcards not yet finished */
+};
+
+#define JOURNAL_SYNC_ENTRIES 64 /**< @private journal entries written between syncs */
+#define JOURNAL_SYNC_SECONDS 5  /**< @private seconds between journal syncs */
+
+typedef struct chunk_download chunk_download;
+/**
+ * @brief Single chunk being downloaded
+ * @ingroup    data
+ * @private
+ */
+struct chunk_download {
+    data_download *dl; /**< shared download state */
+    breq_fast *r;      /**< chunk being downloaded */
+    mseed_stream *ms;  /**< decoder for unpacking data as it arrives */
+    int fd;            /**< output miniseed file, -1 if not yet opened */
+    char file[2048];   /**< output miniseed filename */
+    char part[2048];   /**< partial miniseed file written during download */
+    size_t nbytes;     /**< bytes written to the output file */
+    int64_t offset;    /**< bytes of complete records from an earlier download */
+    dict *next;        /**< next expected sample time for each channel in part */
+    int remainder;     /**< part holds data from a remainder request, Range cannot be used */
+    int range;         /**< current download uses a Range */
+    archive *have;     /**< data of the chunk already in the SDS archive */
+    breq_fast *rest;   /**< lines of a remainder request, NULL when requesting all of r */
+    int claimed;       /**< chunk is claimed from a shared request file */
+    time_t renewed;    /**< time the claim was last renewed */
+    int pending;       /**< chunk is counted in the pending channels of the download */
+    int fed;           /**< chunk is counted in the chunks downloading, see data_request_feed() */
 };
 
 
@@ -65,6 +145,7 @@ struct data_request {
 void             breq_fast_line_free(breq_fast_line *r);
 breq_fast_line * breq_fast_line_new();
 char *           breq_fast_line_format(breq_fast_line *x);
+static size_t    breq_fast_line_format_to(breq_fast_line *x, char *dst, size_t n);
 
 /**
  * @brief Data Availability Request
@@ -429,11 +510,15 @@ data_avail_from_station_file(request *r, char *file) {
             printf("Error reading station file on line: %s\n", line);
             goto error;
         }
-        sprintf(tmp, "%-5s %-8s %-4s %-5s %s %s\n", net, sta, loc, cha, t1, t2);
-        req = str_grow(req, &nalloc, n, strlen(tmp));
-        n = fern_strlcat(req, tmp, nalloc);
+        int k = snprintf(tmp, sizeof(tmp), "%-5s %-8s %-4s %-5s %s %s\n", net, sta, loc, cha, t1, t2);
+        if(!(req = str_grow(req, &nalloc, n, (size_t) k))) {
+            goto error;
+        }
+        // Append at the known end, strlcat would rescan the whole request
+        memcpy(req + n, tmp, (size_t) k + 1);
+        n += (size_t) k;
     }
-
+    fclose(fp);
     return req;
  error:
     if(fp) {
@@ -443,48 +528,6 @@ data_avail_from_station_file(request *r, char *file) {
     return NULL;
 }
 
-/**
- * @brief Convert the channels band code into samples per second (sps)
- *
- * @memberof   breq_fast
- * @ingroup    data
- *
- * @param band
- *
- * @private
- *
- * @return samples per second
- *
- * @note Values are approximate
- */
-double
-band_to_sps(char band) {
-    double sps = 1.0;
-    switch(band) {
-    case 'F': sps =1000.0;     break;
-    case 'G': sps =1000.0;     break;
-    case 'D': sps = 500.0;     break;
-    case 'C': sps = 250.0;     break;
-    case 'E': sps = 100.0;     break; // ExtremelyShortPeriod
-    case 'S': sps =  40.0;     break; // ShortPeriod
-    case 'H': sps = 100.0;     break; // HighBroadBand
-    case 'B': sps =  40.0;     break; // Broadband
-    case 'M': sps =   5.0;     break; // MidPeriod
-    case 'L': sps =   1.0;     break; // LongPeriod
-    case 'V': sps =   0.1;     break; // VeryLongPeriod
-    case 'U': sps =   0.01;    break; // UltraLongPeriod
-    case 'R': sps =   0.00030; break; // ExtremelyLongPeriod
-    case 'P': sps =   0.001;   break; // Does not exist
-    case 'T': sps =   0.001;   break; // Only 3 channels
-    case 'Q': sps =   0.05000; break;
-    case 'A': sps =   1.0;     break; // Administrative
-    case 'O': sps =   1.0;     break; // Opaque
-    case 'W': sps =   1.0;     break; // Associated with Wind and Pressure
-    }
-    return sps;
-}
-
-
 /**
  * @brief Create an new data request
  *
@@ -516,38 +559,65 @@ void
 breq_fast_init(breq_fast *f) {
     f->comment = FALSE;
     f->urls = dict_new();
-    f->lines = xarray_new('p');
+    f->lines = NULL;
+    f->nlines = 0;
+    f->alloc = 0;
+}
+
+/**
+ * @brief Append a data request line to a data request
+ *
+ * @memberof   breq_fast
+ * @ingroup    data
+ * @private
+ *
+ * @param f   data request
+ * @param x   data request line, copied
+ *
+ */
+static void
+breq_fast_append(breq_fast *f, breq_fast_line *x) {
+    if(f->nlines >= f->alloc) {
+        breq_fast_line *tmp = NULL;
+        size_t alloc = (f->alloc == 0) ? 4 : f->alloc * 2;
+        if(!(tmp = realloc(f->lines, alloc * sizeof(breq_fast_line)))) {
+            printf("Error expanding data request lines\n");
+            return;
+        }
+        f->lines = tmp;
+        f->alloc = alloc;
+    }
+    f->lines[f->nlines++] = *x;
 }
 /**
- * @brief Join a list of strings
+ * @brief Format a data request line as a line of POST data
  *
  * @memberof   breq_fast
  * @ingroup    data
  *
  * @private
  *
- * @param items  Collection of character strings to join, enclosed in a xarray
- * @param s      joining character string
+ * @param data   data request
+ * @param i      line number
+ * @param buf    output buffer
+ * @param n      size of buf
  *
- * @return list of character strings joined together
+ * @return length of the line including the newline, -1 if there is no line i
  *
- * @warning User owns the returned value and is responsible for freeing the underlying memory
- *    with free
+ * @note See \ref post_line_func, used to send the lines without joining them
  *
  */
-char *
-str_join(char **items, char *s) {
-    char *out = NULL;
-    size_t nalloc = 256;
-    size_t nn = 0;
-    size_t n = xarray_length(items);
-    for(size_t i = 0; i < n; i++) {
-        out = str_grow(out, &nalloc, nn, strlen(items[i]) + strlen(s));
-        fern_strlcat(out, items[i], nalloc);
-        fern_strlcat(out, s, nalloc);
-        nn = strlen(out);
+static int
+breq_fast_post_line(void *data, size_t i, char *buf, size_t n) {
+    size_t k = 0;
+    breq_fast *f = (breq_fast *) data;
+    if(i >= f->nlines || n < 2) {
+        return -1;
     }
-    return out;
+    k = breq_fast_line_format_to(&f->lines[i], buf, n - 1);
+    buf[k++] = '\n';
+    buf[k] = 0;
+    return (int) k;
 }
 
 /**
@@ -566,17 +636,12 @@ str_join(char **items, char *s) {
  */
 size_t
 breq_fast_size(breq_fast *f) {
-    size_t n = 0;
     size_t mem = 0;
-    if(!f || !f->lines || xarray_length(f->lines) || !f->urls) {
+    if(!f || !f->urls) {
         return 0;
     }
-    n = xarray_length(f->lines);
-    for(size_t i = 0; i < n; i++) {
-        breq_fast_line x = { .net={0}, .sta={0}, .loc={0}, .cha={0},
-                             .t1= {0,0}, .t2= {0,0} };
-        breq_fast_line_parse(f->lines[i], &x);
-        mem += breq_fast_line_size(&x);
+    for(size_t i = 0; i < f->nlines; i++) {
+        mem += breq_fast_line_size(&f->lines[i]);
     }
     return mem;
 }
@@ -596,8 +661,7 @@ void
 breq_fast_free(breq_fast *r) {
     if(r) {
         dict_free(r->urls, free);
-        xarray_free_items(r->lines, free);
-        xarray_free(r->lines);
+        FREE(r->lines);
         FREE(r);
     }
 }
@@ -620,28 +684,29 @@ breq_fast_free_void(void *p) {
 
 
 /**
- * @brief Request data from a data center and download the requested data
+ * @brief Create the request for a data request
  *
  * @memberof   breq_fast
  * @ingroup    data
  * @private
  *
- * @param f    data request
+ * @param f     data request
  *
- * @return \ref result of request
+ * @return new request, NULL on error
  *
- * @note URL to send request to is located in DATASELECTSERVICE key
+ * @note URL to send request to is located in DATASELECTSERVICE key.  The
+ *    lines are sent as POST data with breq_fast_post_line()
  *
+ * @warning User owns the request and is responsible for freeing the
+ *    underlying memory
  */
-result *
-breq_fast_send(breq_fast *f) {
+static request *
+breq_fast_request(breq_fast *f) {
     int end_slash = 0;
-    result *r = NULL;
     char *url = NULL;
     char *ds_url = NULL;
-    char *req = NULL;
-    request *fr = request_new();
-    if(!f || !f->lines || xarray_length(f->lines) == 0 || ! f->urls) {
+    request *fr = NULL;
+    if(!f || f->nlines == 0 || ! f->urls) {
         return NULL;
     }
     if(!(ds_url = dict_get(f->urls, "DATASELECTSERVICE"))) {
@@ -649,12 +714,35 @@ breq_fast_send(breq_fast *f) {
     }
     end_slash = ds_url[strlen(ds_url)-1] == '/';
     fern_asprintf(&url, "%s%squery", ds_url, (!end_slash) ? "/" : "");
+    fr = request_new();
     request_set_url(fr, url);
-    req = str_join(f->lines, "\n");
-    r = request_post(fr, req);
-
-    FREE(req);
     FREE(url);
+    return fr;
+}
+
+/**
+ * @brief Request data from a data center and download the requested data
+ *
+ * @memberof   breq_fast
+ * @ingroup    data
+ * @private
+ *
+ * @param f    data request
+ *
+ * @return \ref result of request
+ *
+ * @note URL to send request to is located in DATASELECTSERVICE key
+ *
+ */
+result *
+breq_fast_send(breq_fast *f) {
+    result *r = NULL;
+    request *fr = NULL;
+    if(!(fr = breq_fast_request(f))) {
+        return NULL;
+    }
+    r = request_post_lines(fr, breq_fast_post_line, f);
+
     REQUEST_FREE(fr);
     return r;
 }
@@ -696,14 +784,16 @@ breq_fast_copy_urls(breq_fast *dst, breq_fast *src) {
  */
 breq_fast *
 breq_fast_from_breq_fast_line(breq_fast_line *x, breq_fast *r) {
-    char *newline = NULL;
     breq_fast *fr = breq_fast_new();
     breq_fast_copy_urls(fr, r);
-    newline = breq_fast_line_format(x);
-    fr->lines = xarray_append(fr->lines, newline);
+    breq_fast_append(fr, x);
     return fr;
 }
 
+#define SPLIT_RECORD_BYTES 4096 /**< @private miniseed record downloaded by both sides of a split */
+#define SPLIT_HOUR 3600          /**< @private seconds in an hour */
+#define SPLIT_DAY  86400         /**< @private seconds in a day */
+
 /**
  * @brief Split a data request into time chunks
  *
@@ -711,41 +801,64 @@ breq_fast_from_breq_fast_line(breq_fast_line *x, breq_fast *r) {
  * @ingroup    data
  * @private
  *
- * @param      x     data request line
- * @param      r     data request
- * @param      mem1  size of  data request line
- * @param      max   max size of data requests
+ * @param      x      data request line
+ * @param      r      data request
+ * @param      mem1   size of  data request line
+ * @param      max    max size of data requests
+ * @param      align  alignment of split boundaries
  *
  * @return     collection of  data requests
+ *
+ * @note A record straddling a boundary is downloaded by both slices, so
+ *    each slice is allowed SPLIT_RECORD_BYTES less than max.  With SplitDay
+ *    or SplitHour slices are whole days or hours, the first and last clipped
+ *    to the line.  If an hour is larger than max, slices are equal lengths
  */
 breq_fast **
-breq_fast_time_split(breq_fast_line *x, breq_fast *r, size_t mem1, size_t max) {
+breq_fast_time_split(breq_fast_line *x, breq_fast *r, size_t mem1, size_t max,
+                     SplitAlign align) {
 
     breq_fast *fr = NULL;
-    //timespec64 t1 = {0,0}, t2 = {0,0};
     breq_fast **new = xarray_new('p');
-    //t1 = x->t1;
-    //t2 = x->t2;
-    double nr = ceil( (float)mem1 / (float)max );
+    timespec64 t2 = x->t2;
     int64_t ts = x->t2.tv_sec - x->t1.tv_sec;
-    //printf("%f :: %f %lld\n", (float)ts/nr, nr*ceil((float)ts/nr), ts);
-    int64_t dt = (int64_t) ceil((double) ts / nr);
-    x->t2 = x->t1;
-
-    int64_t t = 0;
-    while(t < ts) {
-        x->t2.tv_sec += dt;
-
+    int64_t unit = 0, dt = 0, next = 0;
+    size_t room = (max > 2 * SPLIT_RECORD_BYTES) ? max - SPLIT_RECORD_BYTES : max;
+    double rate = (ts > 0) ? (double) mem1 / (double) ts : 0.0;
+    double span = (rate > 0) ? (double) room / rate : (double) ts;
+
+    if(align == SplitDay && span >= SPLIT_DAY) {
+        unit = SPLIT_DAY;
+    } else if(align != SplitNone && span >= SPLIT_HOUR) {
+        unit = SPLIT_HOUR;
+    }
+    if(unit > 0) {
+        dt = ((int64_t) span / unit) * unit;
+        next = x->t1.tv_sec - (((x->t1.tv_sec % unit) + unit) % unit);
+    } else {
+        double nr = ceil( (double) mem1 / (double) room );
+        dt = (int64_t) ceil((double) ts / nr);
+        next = x->t1.tv_sec;
+    }
+    if(dt < 1) {
+        dt = 1;
+    }
+    while(timespec64_cmp(&x->t1, &t2) < 0) {
+        next += dt;
+        x->t2.tv_sec = next;
+        x->t2.tv_nsec = 0;
+        if(timespec64_cmp(&x->t2, &t2) > 0) {
+            x->t2 = t2;
+        }
         fr = breq_fast_from_breq_fast_line(x, r);
         new = xarray_append(new, fr);
-        t += dt;
         x->t1 = x->t2;
     }
     return new;
 }
 
 #define FR_APPEND(fr, new, r, mem) do {           \
-        if(xarray_length(fr->lines) > 0) {        \
+        if(fr->nlines > 0) {                      \
             new = xarray_append(new, fr);         \
             fr = breq_fast_new();               \
             breq_fast_copy_urls(fr, r);         \
@@ -789,6 +902,214 @@ void
 data_request_init(data_request *f) {
     f->pars = dict_new();
     f->reqs = xarray_new('p');
+    f->max_transfers = 4;
+    f->max_per_datacenter = 2;
+    f->split = SplitDay;
+}
+
+/**
+ * @brief Set the number of concurrent downloads
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr             data request
+ * @param      total           maximum number of concurrent downloads
+ * @param      per_datacenter  maximum number of concurrent downloads from a
+ *                             single data center
+ *
+ * @note Defaults are 4 concurrent downloads and 2 per data center.  Use 1 and 1
+ *    to download each chunk in turn
+ */
+void
+data_request_set_concurrency(data_request *fdr, int total, int per_datacenter) {
+    if(!fdr) {
+        return;
+    }
+    fdr->max_transfers = (total < 1) ? 1 : total;
+    fdr->max_per_datacenter = (per_datacenter < 1) ? 1 : per_datacenter;
+}
+
+/**
+ * @brief Set the alignment of time splits
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr    data request
+ * @param      align  SplitDay, SplitHour or SplitNone
+ *
+ * @note Request lines larger than the maximum chunk size are split in time
+ *    by data_request_chunks().  Aligned splits match data center day files and
+ *    repeat the same windows across runs, so server side caches are hit.
+ *    The default is SplitDay
+ */
+void
+data_request_set_split(data_request *fdr, SplitAlign align) {
+    if(!fdr) {
+        return;
+    }
+    fdr->split = align;
+}
+
+/**
+ * @brief Write downloaded data into an SDS archive
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr   data request
+ * @param      dir   top directory of the SDS archive, NULL to write a file
+ *                   for each chunk
+ *
+ * @note Records are appended to YEAR/NET/STA/CHA.D/NET.STA.LOC.CHA.D.YEAR.DOY
+ *    as they arrive, see sds_writer_record().  An interrupted chunk is resumed
+ *    with the data missing from its day files
+ */
+void
+data_request_set_sds(data_request *fdr, char *dir) {
+    if(!fdr) {
+        return;
+    }
+    FREE(fdr->sds);
+    if(dir) {
+        fdr->sds = strdup(dir);
+    }
+}
+
+/**
+ * @brief Set the data centers preferred for data available from more than one
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr    data request
+ * @param      list   comma separated data center names, most preferred first,
+ *                    NULL to choose by download speed alone
+ *
+ * @note See data_request_dedupe()
+ */
+void
+data_request_set_prefer(data_request *fdr, char *list) {
+    char *tmp = NULL, *p = NULL, *tok = NULL;
+    if(!fdr) {
+        return;
+    }
+    xarray_free_items(fdr->prefer, free);
+    xarray_free(fdr->prefer);
+    fdr->prefer = NULL;
+    if(!list) {
+        return;
+    }
+    fdr->prefer = xarray_new('p');
+    tmp = strdup(list);
+    p = tmp;
+    while((tok = strsep(&p, ","))) {
+        if(*tok) {
+            fdr->prefer = xarray_append(fdr->prefer, strdup(tok));
+        }
+    }
+    FREE(tmp);
+}
+
+/**
+ * @brief Share the chunks of a data request file with other processes
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr    data request
+ * @param      lease  seconds a claimed chunk is kept without progress,
+ *                    0 to download all chunks
+ *
+ * @note Processes downloading the same data request file, on one host or on a
+ *    shared filesystem, each claim a chunk before downloading it and skip
+ *    chunks claimed or completed by others, see \ref claim.  Claims are
+ *    kept in filename.claims and renewed as data arrives.  A chunk whose
+ *    process stopped is taken over once its lease expires.  Only used when
+ *    saving files with a data request filename
+ */
+void
+data_request_set_claim(data_request *fdr, int64_t lease) {
+    if(!fdr) {
+        return;
+    }
+    fdr->claim_lease = (lease < 0) ? 0 : lease;
+}
+
+/**
+ * @brief Set a function called with each channel once it is downloaded
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr   data request
+ * @param      fn    function called with each channel, NULL for none
+ * @param      data  user data passed to fn
+ *
+ * @note When unpacking data, a channel is passed to fn as soon as every chunk
+ *    requesting it has finished, while other chunks are still downloading.
+ *    fn may add transfers to the loop, which are completed before
+ *    data_request_download() returns.  Records are kept rather than unpacked,
+ *    see mseed_stream_keep_records(), and are decoded when fn converts the
+ *    channel with miniseed_trace_to_sac().  The records of a channel are
+ *    released once fn returns.  Once all channels are passed, fn is called
+ *    with a NULL channel.  Channels of chunks with wildcards are passed once all chunks
+ *    with wildcards have finished
+ */
+void
+data_request_set_trace_func(data_request *fdr, data_request_trace_func fn, void *data) {
+    if(!fdr) {
+        return;
+    }
+    fdr->trace_fn = fn;
+    fdr->trace_data = data;
+}
+
+/**
+ * @brief Limit the memory held by samples of channels not yet complete
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr    data request
+ * @param      bytes  bytes of samples, 0 for no limit
+ *
+ * @note Only used with a trace function, see data_request_set_trace_func().
+ *    New chunks are started only while the samples of channels not yet
+ *    passed to the trace function take less than bytes.  A chunk is always
+ *    started when none are downloading, so a single chunk may exceed the
+ *    limit.  Memory is then bounded by the channels being downloaded rather
+ *    than by the whole data request
+ */
+void
+data_request_set_memory(data_request *fdr, size_t bytes) {
+    if(!fdr) {
+        return;
+    }
+    fdr->memory = bytes;
+}
+
+/**
+ * @brief Set a function returning the memory held by the trace function
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr   data request
+ * @param      fn    function called with the user data of the trace
+ *                   function, NULL for none
+ *
+ * @note Channels passed to the trace function may still be held, e.g. as
+ *    sac files waiting to be written.  The bytes returned by fn count
+ *    towards the limit set with data_request_set_memory()
+ */
+void
+data_request_set_memory_func(data_request *fdr, data_request_memory_func fn) {
+    if(!fdr) {
+        return;
+    }
+    fdr->memory_fn = fn;
 }
 
 /**
@@ -804,6 +1125,9 @@ void
 data_request_free(data_request *r) {
     if(r) {
         dict_free(r->pars, free);
+        FREE(r->sds);
+        xarray_free_items(r->prefer, free);
+        xarray_free(r->prefer);
         xarray_free_items(r->reqs, breq_fast_free_void);
         xarray_free(r->reqs);
         FREE(r);
@@ -884,8 +1208,9 @@ data_request_parse(char *data) {
                 printf("          %s\n", line_orig);
             }
         } else if(state == 2) {
+            breq_fast_line_init(&x);
             if(breq_fast_line_parse(line, &x)) {
-                fd->lines = xarray_append(fd->lines, strdup(line));
+                breq_fast_append(fd, &x);
             }
         }
     }
@@ -897,118 +1222,2291 @@ data_request_parse(char *data) {
 }
 
 /**
- * @brief Download data with a data request list
+ * @brief Identify a chunk by its data center and request lines
  *
- * @memberof   data_request
+ * @memberof   breq_fast
  * @ingroup    data
+ * @private
  *
- * @param      fdr          data request
- * @param      filename     data request filename
- * @param      prefix       prefix for miniseed output files
- * @param      save_files   save data to miniseed files
- * @param      unpack_data  unpack data and place into a Miniseed Trace List
+ * @param      f   data request
  *
- * @return     miniseed trace list
+ * @return     64-bit FNV-1a hash of the data center and request lines
+ *
+ * @note The same chunk has the same identifier between runs, which is used
+ *    to find partial downloads to resume
  */
-MS3TraceList *
-data_request_download(data_request *fdr, char *filename, char *prefix,
-                           int save_files, int unpack_data) {
-    timespec64 t = {0,0};
-    // Download data
-    char date[64];
-    MS3TraceList *mst3k = NULL;
-    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
-        t = timespec64_now();
-        char *dc = NULL;
-        result *fr = NULL;
-        breq_fast *r = fdr->reqs[i];
-        if(r->comment) {
-            continue;
-        }
-        strftime64t(date, sizeof(date), "%Y.%m.%d.%H.%M.%S", &t);
-        dc = dict_get(r->urls, "DATACENTER");
-        cprintf("", "Data Center: %s\n", dc);
-        fr = breq_fast_send(r);
-        printf("\t");
-        if(result_is_ok(fr)) {
-            if(save_files) {
-                char file[2048] = {0};
-                char dcname[128] = {0};
-                char *p = NULL;
-                fern_strlcpy(dcname, dc, sizeof(dcname));
-                if((p = strchr(dcname, ','))) {
-                    *p = 0;
-                } else {
-                    dcname[0] = 0;
-                }
-                snprintf(file, sizeof(file), "%s.%s.%s.mseed",
-                         prefix, date, dcname);
-                result_write_to_file_show(fr, file);
+static uint64_t
+breq_fast_id(breq_fast *f) {
+    uint64_t h = 14695981039346656037ULL;
+    char *dc = dict_get(f->urls, "DATACENTER");
+    for(char *p = (dc) ? dc : ""; *p; p++) {
+        h = (h ^ (uint8_t) *p) * 1099511628211ULL;
+    }
+    for(size_t i = 0; i < f->nlines; i++) {
+        breq_fast_line *x = &f->lines[i];
+        int64_t v[4] = { x->t1.tv_sec, x->t1.tv_nsec, x->t2.tv_sec, x->t2.tv_nsec };
+        char *codes[4] = { x->net, x->sta, x->loc, x->cha };
+        h = (h ^ (uint8_t) '\n') * 1099511628211ULL;
+        for(size_t k = 0; k < 4; k++) {
+            for(char *p = codes[k]; *p; p++) {
+                h = (h ^ (uint8_t) *p) * 1099511628211ULL;
             }
-            if(unpack_data) {
-                if(!mst3k) {
-                    mst3k = mstl3_init(NULL);
-                }
-                read_miniseed_memory(mst3k, result_data(fr),
-                                     (uint64_t) result_len(fr));
+            h = (h ^ (uint8_t) ' ') * 1099511628211ULL;
+        }
+        for(size_t k = 0; k < 4; k++) {
+            for(size_t b = 0; b < 8; b++) {
+                h = (h ^ (uint8_t) (v[k] >> (8 * b))) * 1099511628211ULL;
             }
-        } else if (result_http_code(fr) == 204) {
-            cprintf("red,bold", "No data available\n");
-        } else if (result_http_code(fr) == 404) {
-            cprintf("red,bold", "No data available\n");
-        } else {
-            printf("%s\n", result_error_msg(fr));
         }
-        RESULT_FREE(fr);
-        r->comment = TRUE;
-        data_request_write_to_file(fdr, filename);
     }
-    return mst3k;
+    return h;
 }
 
+#define SUBTRACT_MIN_GAP 1.0 /**< @private shortest missing interval in seconds that is requested */
+
 /**
- * @brief Split a data request list into chunks
+ * @brief Convert a time to nanoseconds since the epoch
  *
- * @memberof   data_request
  * @ingroup    data
+ * @private
  *
- * @param      fdr   data request list to split
- * @param      max   maximum size of chunk
+ */
+static nstime_t
+timespec64_to_nstime(timespec64 *t) {
+    return (nstime_t) t->tv_sec * NSTMODULUS + (nstime_t) t->tv_nsec;
+}
+
+/**
+ * @brief Get the miniseed source id of a data request line
+ *
+ * @memberof   breq_fast_line
+ * @ingroup    data
+ * @private
+ *
+ * @param      x    data request line
+ * @param      sid  output source id, e.g. FDSN:IU_ANMO_00_B_H_Z
+ * @param      n    length of sid
  *
+ * @return     1 on success, 0 if the line has wildcards or cannot be converted
  */
-void
-data_request_chunks(data_request *fdr, size_t max) {
-    size_t mem = 0, mem1 = 0;
-    size_t i, j;
-    size_t n = xarray_length(fdr->reqs);
-    char *line = NULL;
-    breq_fast *r = NULL;
-    breq_fast *fr = NULL;
-    breq_fast **tsplit = NULL;
-    breq_fast_line x;
-    breq_fast_line_init(&x);
-    breq_fast **new = xarray_new('p');
-    for(i = 0; i < n; i++) {
-        r = fdr->reqs[i];
-        fr = breq_fast_new();
-        breq_fast_copy_urls(fr, r);
-        mem = 0;
-        for(j = 0; j < xarray_length(r->lines); j++) {
-            line = r->lines[j];
-            // printf("LINE: %s\n", line);
-            if(!breq_fast_line_parse(line, &x)) {
-                continue;
-            }
-            mem1 = breq_fast_line_size(&x);
-            if(mem1 > max) {
+static int
+breq_fast_line_sid(breq_fast_line *x, char *sid, size_t n) {
+    char *loc = (strcmp(x->loc, "--") == 0) ? "" : x->loc;
+    if(strpbrk(x->net, "*?") || strpbrk(x->sta, "*?") ||
+       strpbrk(loc, "*?")    || strpbrk(x->cha, "*?")) {
+        return 0;
+    }
+    return ms_nslc2sid(sid, (int) n, 0, x->net, x->sta, loc, x->cha) >= 0;
+}
+
+/**
+ * @brief Remove data already in a local archive from a data request
+ *
+ * @memberof   breq_fast
+ * @ingroup    data
+ * @private
+ *
+ * @param      r    data request, lines are replaced
+ * @param      a    index of local miniseed data
+ *
+ * @return     number of request lines shortened, split or removed
+ *
+ * @note see data_request_subtract_archive()
+ */
+static size_t
+breq_fast_subtract_archive(breq_fast *r, archive *a) {
+    size_t changed = 0;
+    breq_fast_line *lines = r->lines;
+    size_t nlines = r->nlines;
+    r->lines = NULL;
+    r->nlines = 0;
+    r->alloc = 0;
+    for(size_t j = 0; j < nlines; j++) {
+        char sid[LM_SIDLEN] = {0};
+        size_t n = 0;
+        int whole = FALSE;
+        nstime_t start = 0, end = 0;
+        nstime_t *gaps = NULL;
+        breq_fast_line x = lines[j];
+        if(!breq_fast_line_sid(&x, sid, sizeof(sid))) {
+            breq_fast_append(r, &x);
+            continue;
+        }
+        start = timespec64_to_nstime(&lines[j].t1);
+        end   = timespec64_to_nstime(&lines[j].t2);
+        gaps  = archive_missing(a, sid, start, end, &n);
+        whole = (n == 1 && gaps[0] == start && gaps[1] == end);
+        for(size_t k = 0; k < n; k++) {
+            nstime_t t1 = gaps[2 * k], t2 = gaps[2 * k + 1];
+            if(!whole && (double) (t2 - t1) / NSTMODULUS < SUBTRACT_MIN_GAP) {
+                continue;
+            }
+            t1 = (t1 / 1000000) * 1000000;
+            t2 = ((t2 + 999999) / 1000000) * 1000000;
+            x.t1.tv_sec  = t1 / NSTMODULUS;
+            x.t1.tv_nsec = t1 % NSTMODULUS;
+            x.t2.tv_sec  = t2 / NSTMODULUS;
+            x.t2.tv_nsec = t2 % NSTMODULUS;
+            if(timespec64_cmp(&x.t1, &lines[j].t1) < 0) {
+                x.t1 = lines[j].t1;
+            }
+            if(timespec64_cmp(&x.t2, &lines[j].t2) > 0) {
+                x.t2 = lines[j].t2;
+            }
+            breq_fast_append(r, &x);
+        }
+        if(!whole) {
+            changed += 1;
+        }
+        FREE(gaps);
+    }
+    FREE(lines);
+    return changed;
+}
+
+/**
+ * @brief Remove data already in a local archive from a data request list
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr   data request list
+ * @param      a     index of local miniseed data, see archive_add()
+ *
+ * @return     number of request lines shortened, split or removed
+ *
+ * @note Each line is replaced by the intervals missing from the archive,
+ *    widened to the millisecond precision of request lines.  Missing
+ *    intervals shorter than SUBTRACT_MIN_GAP are not requested, so gaps
+ *    in the data itself are not asked for again on every run.  Lines with
+ *    wildcards and commented requests are left as they are.  Call before
+ *    data_request_chunks()
+ */
+size_t
+data_request_subtract_archive(data_request *fdr, archive *a) {
+    size_t changed = 0;
+    breq_fast **new = NULL;
+    if(!fdr || !a) {
+        return 0;
+    }
+    new = xarray_new('p');
+    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+        breq_fast *r = fdr->reqs[i];
+        if(!r->comment) {
+            changed += breq_fast_subtract_archive(r, a);
+        }
+        if(r->nlines > 0 || r->comment) {
+            new = xarray_append(new, r);
+        } else {
+            breq_fast_free(r);
+        }
+    }
+    xarray_free(fdr->reqs);
+    fdr->reqs = new;
+    return changed;
+}
+
+/**
+ * @brief Get the name of the data center of a data request
+ *
+ * @memberof   breq_fast
+ * @ingroup    data
+ * @private
+ *
+ * @param      r       data request
+ * @param      dcname  output data center name, empty if not known
+ * @param      n       length of dcname
+ *
+ */
+static void
+breq_fast_dcname(breq_fast *r, char *dcname, size_t n) {
+    char *q = NULL;
+    char *dc = dict_get(r->urls, "DATACENTER");
+    fern_strlcpy(dcname, (dc) ? dc : "", n);
+    if((q = strchr(dcname, ','))) {
+        *q = 0;
+    } else {
+        dcname[0] = 0;
+    }
+}
+
+/**
+ * @brief Data center of a data request, ranked as a source of duplicated data
+ * @ingroup    data
+ * @private
+ */
+typedef struct {
+    breq_fast *r;   /**< \private data request */
+    int done;       /**< \private request is commented, its data is already downloaded */
+    size_t prefer;  /**< \private position in the preference list, after the list if not in it */
+    double speed;   /**< \private learned download speed in bytes per second, 0 if unknown */
+    size_t order;   /**< \private position in the data request list */
+} dc_rank;
+
+/**
+ * @brief Compare data centers, most preferred first
+ *
+ * @ingroup    data
+ * @private
+ *
+ */
+static int
+dc_rank_cmp(const void *pa, const void *pb) {
+    const dc_rank *a = (const dc_rank *) pa;
+    const dc_rank *b = (const dc_rank *) pb;
+    if(a->done != b->done) {
+        return (a->done) ? -1 : 1;
+    }
+    if(a->prefer != b->prefer) {
+        return (a->prefer < b->prefer) ? -1 : 1;
+    }
+    if(a->speed != b->speed) {
+        return (a->speed > b->speed) ? -1 : 1;
+    }
+    return (a->order < b->order) ? -1 : (a->order > b->order);
+}
+
+/**
+ * @brief Request duplicated data from only one data center
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr   data request list
+ *
+ * @return     number of request lines shortened, split or removed
+ *
+ * @note Mirrored networks can be routed to more than one data center.  Data
+ *    centers are ranked by data_request_set_prefer(), then by their learned
+ *    download speed, see chunk_size_speed(), then by their order in the list.
+ *    Each data center keeps only the data not already requested from a
+ *    higher ranked one, as with data_request_subtract_archive().  Data of
+ *    commented requests counts as already requested.  Lines with wildcards
+ *    are left as they are.  Call before data_request_chunks()
+ */
+size_t
+data_request_dedupe(data_request *fdr) {
+    size_t n = 0;
+    size_t changed = 0;
+    dc_rank *rank = NULL;
+    archive *seen = NULL;
+    breq_fast **new = NULL;
+    if(!fdr || (n = xarray_length(fdr->reqs)) < 2) {
+        return 0;
+    }
+    rank = calloc(n, sizeof(dc_rank));
+    for(size_t i = 0; i < n; i++) {
+        char dc[128] = {0};
+        breq_fast *r = fdr->reqs[i];
+        breq_fast_dcname(r, dc, sizeof(dc));
+        rank[i].r      = r;
+        rank[i].done   = r->comment;
+        rank[i].prefer = xarray_length(fdr->prefer);
+        for(size_t j = 0; j < xarray_length(fdr->prefer); j++) {
+            if(strcmp(fdr->prefer[j], dc) == 0) {
+                rank[i].prefer = j;
+                break;
+            }
+        }
+        rank[i].speed  = chunk_size_speed(dc);
+        rank[i].order  = i;
+    }
+    qsort(rank, n, sizeof(dc_rank), dc_rank_cmp);
+
+    seen = archive_new();
+    for(size_t i = 0; i < n; i++) {
+        breq_fast *r = rank[i].r;
+        if(!dict_get(r->urls, "DATACENTER")) {
+            continue;
+        }
+        if(!r->comment) {
+            changed += breq_fast_subtract_archive(r, seen);
+        }
+        for(size_t j = 0; j < r->nlines; j++) {
+            char sid[LM_SIDLEN] = {0};
+            if(breq_fast_line_sid(&r->lines[j], sid, sizeof(sid))) {
+                archive_add_span(seen, sid,
+                                 timespec64_to_nstime(&r->lines[j].t1),
+                                 timespec64_to_nstime(&r->lines[j].t2));
+            }
+        }
+    }
+    archive_free(seen);
+    FREE(rank);
+
+    new = xarray_new('p');
+    for(size_t i = 0; i < n; i++) {
+        breq_fast *r = fdr->reqs[i];
+        if(r->nlines > 0 || r->comment) {
+            new = xarray_append(new, r);
+        } else {
+            breq_fast_free(r);
+        }
+    }
+    xarray_free(fdr->reqs);
+    fdr->reqs = new;
+    return changed;
+}
+
+/**
+ * @brief Check if a data request line selects a miniseed source id
+ *
+ * @memberof   breq_fast_line
+ * @ingroup    data
+ * @private
+ *
+ * @param      x    data request line
+ * @param      sid  miniseed source id, e.g. FDSN:IU_ANMO_00_B_H_Z
+ *
+ * @return     1 if the line selects the source id, 0 otherwise
+ *
+ * @note Wildcards * and ? are allowed, and a location of -- matches an
+ *    empty location
+ */
+static int
+breq_fast_line_match(breq_fast_line *x, char *sid) {
+    char net[64] = {0}, sta[64] = {0}, loc[64] = {0}, cha[64] = {0};
+    char *xloc = (strcmp(x->loc, "--") == 0) ? "" : x->loc;
+    if(ms_sid2nslc(sid, net, sta, loc, cha) != 0) {
+        return 0;
+    }
+    return (fnmatch(x->net, net, 0) == 0 &&
+            fnmatch(x->sta, sta, 0) == 0 &&
+            fnmatch(xloc,   loc, 0) == 0 &&
+            fnmatch(x->cha, cha, 0) == 0);
+}
+
+/**
+ * @brief Get the short data center name of a chunk
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c       chunk being downloaded, \ref chunk_download
+ * @param      dcname  output data center name
+ * @param      n       length of dcname
+ *
+ */
+static void
+data_request_chunk_dcname(chunk_download *c, char *dcname, size_t n) {
+    breq_fast_dcname(c->r, dcname, n);
+}
+
+/**
+ * @brief Find partial data left by an earlier download of a chunk
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk being downloaded, \ref chunk_download
+ *
+ * @note Partial data is kept in prefix.id.datacenter.mseed.part, or .rpart
+ *    once data from a remainder request has been added.  An incomplete
+ *    record at the end of the file is removed
+ */
+static void
+data_request_chunk_part(chunk_download *c) {
+    char tmp[64] = {0};
+    char dcname[128] = {0};
+    char base[2048] = {0};
+    char rpart[2048] = {0};
+
+    data_request_chunk_dcname(c, dcname, sizeof(dcname));
+    snprintf(base, sizeof(base), "%s.%016" PRIx64 ".%s.mseed",
+             c->dl->prefix, breq_fast_id(c->r), dcname);
+    snprintf(c->part, sizeof(c->part), "%s.part", base);
+    snprintf(rpart, sizeof(rpart), "%s.rpart", base);
+    if(c->next) {
+        dict_free(c->next, free);
+        c->next = NULL;
+    }
+    c->offset = 0;
+    c->remainder = FALSE;
+    if(access(rpart, F_OK) == 0) {
+        fern_strlcpy(c->part, rpart, sizeof(c->part));
+        c->remainder = TRUE;
+    } else if(access(c->part, F_OK) != 0) {
+        return;
+    }
+    c->next = dict_new();
+    if((c->offset = mseed_file_scan(c->part, c->next)) < 0 ||
+       truncate(c->part, (off_t) c->offset) != 0) {
+        printf(" WARNING: Cannot resume from %s, starting over\n", c->part);
+        c->offset = 0;
+    }
+    if(c->offset == 0) {
+        unlink(c->part);
+        dict_free(c->next, free);
+        c->next = NULL;
+        c->remainder = FALSE;
+        snprintf(c->part, sizeof(c->part), "%s.part", base);
+        return;
+    }
+    printf("Resuming download from %s [%s]\n", c->part,
+           data_size(c->offset, tmp, sizeof(tmp)));
+    if(c->dl->unpack_data) {
+        read_miniseed_file(c->dl->mst3k, c->part);
+    }
+}
+
+/**
+ * @brief Find data of a chunk already in the SDS archive
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk being downloaded, \ref chunk_download
+ *
+ * @note Only the day files of the chunk's channels and times are read.  Data
+ *    found is kept in c->have and only the missing data is requested
+ */
+static void
+data_request_chunk_sds(chunk_download *c) {
+    char path[2048] = {0};
+    char sid[LM_SIDLEN] = {0};
+    for(size_t i = 0; i < c->r->nlines; i++) {
+        breq_fast_line *x = &c->r->lines[i];
+        if(!breq_fast_line_sid(x, sid, sizeof(sid))) {
+            continue;
+        }
+        for(int64_t t = x->t1.tv_sec - (x->t1.tv_sec % SPLIT_DAY);
+            t < x->t2.tv_sec; t += SPLIT_DAY) {
+            if(!sds_path(c->dl->fdr->sds, sid, (nstime_t) t * NSTMODULUS, path, sizeof(path)) ||
+               access(path, F_OK) != 0) {
+                continue;
+            }
+            if(!c->have) {
+                c->have = archive_new();
+            }
+            archive_add_file(c->have, path);
+        }
+    }
+    if(c->have) {
+        printf("Resuming download into %s [%zu day files]\n", c->dl->fdr->sds,
+               archive_files(c->have));
+    }
+}
+
+/**
+ * @brief Renew the claim on a chunk shared with other processes
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk being downloaded, \ref chunk_download
+ *
+ * @return     1 if the chunk is still claimed or not shared, 0 if another
+ *             process took it over
+ *
+ * @note Called as data arrives, the claims file is updated at most four
+ *    times per lease
+ */
+static int
+data_request_chunk_renew(chunk_download *c) {
+    char id[32] = {0};
+    time_t now = 0;
+    if(!c->claimed) {
+        return 1;
+    }
+    now = time(NULL);
+    if(now - c->renewed < claim_table_lease(c->dl->claims) / 4) {
+        return 1;
+    }
+    c->renewed = now;
+    snprintf(id, sizeof(id), "%016" PRIx64, breq_fast_id(c->r));
+    if(!claim_renew(c->dl->claims, id)) {
+        printf(" WARNING: Chunk %s was taken over by another process, stopping\n", id);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Write a record of a chunk into the SDS archive
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      msr   miniseed record
+ * @param      p     chunk being downloaded, \ref chunk_download
+ *
+ * @return     1 on success, 0 on error
+ */
+static int
+data_request_chunk_record(MS3Record *msr, void *p) {
+    chunk_download *c = (chunk_download *) p;
+    if(!data_request_chunk_renew(c)) {
+        return 0;
+    }
+    if(!sds_writer_record(msr, c->dl->sds)) {
+        return 0;
+    }
+    c->nbytes += (size_t) msr->reclen;
+    return 1;
+}
+
+/**
+ * @brief Create the request lines for data not yet received for a chunk
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk being downloaded, \ref chunk_download
+ *
+ * @return     request lines for the remaining data, NULL if all data was received
+ *
+ * @note Each line starts after the last complete record received for its
+ *    channels, but never before its original start.  Lines without any data
+ *    received, and lines with wildcards, are requested in full.  With an SDS
+ *    archive, lines are reduced to the data missing from it
+ *
+ * @warning User owns the request lines and is responsible for freeing them
+ *    with breq_fast_free()
+ */
+static breq_fast *
+data_request_chunk_remainder(chunk_download *c) {
+    char **keys = NULL;
+    breq_fast *rest = breq_fast_new();
+    if(c->have) {
+        for(size_t i = 0; i < c->r->nlines; i++) {
+            breq_fast_append(rest, &c->r->lines[i]);
+        }
+        breq_fast_subtract_archive(rest, c->have);
+        goto done;
+    }
+    keys = dict_keys(c->next);
+    for(size_t i = 0; i < c->r->nlines; i++) {
+        nstime_t *t = NULL;
+        nstime_t next = NSTERROR;
+        char sid[LM_SIDLEN] = {0};
+        breq_fast_line x = c->r->lines[i];
+        if(!breq_fast_line_sid(&x, sid, sizeof(sid))) {
+            // Matching channels that have not sent data yet are unknown
+            breq_fast_append(rest, &x);
+            continue;
+        }
+        for(size_t j = 0; keys[j]; j++) {
+            if(breq_fast_line_match(&x, keys[j]) && (t = dict_get(c->next, keys[j]))) {
+                if(next == NSTERROR || *t < next) {
+                    next = *t;
+                }
+            }
+        }
+        if(next != NSTERROR) {
+            // Round up to the millisecond precision of request lines
+            timespec64 t1 = x.t1;
+            next = ((next + 999999) / 1000000) * 1000000;
+            x.t1.tv_sec  = next / NSTMODULUS;
+            x.t1.tv_nsec = next % NSTMODULUS;
+            if(timespec64_cmp(&x.t1, &t1) < 0) {
+                x.t1 = t1;
+            }
+            if(timespec64_cmp(&x.t1, &x.t2) >= 0) {
+                continue;
+            }
+        }
+        breq_fast_append(rest, &x);
+    }
+    dict_keys_free(keys);
+ done:
+    if(rest->nlines == 0) {
+        breq_fast_free(rest);
+        return NULL;
+    }
+    return rest;
+}
+
+/**
+ * @brief Write downloaded data for a chunk to its partial miniseed file
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      data  downloaded data
+ * @param      n     length of data
+ * @param      p     chunk being downloaded, \ref chunk_download
+ *
+ * @return     number of bytes written, less than n on error
+ *
+ * @note The file is opened when the first data arrives and data is appended
+ *    to any partial data from an earlier download.  Short writes are
+ *    continued until all of data is written
+ */
+static size_t
+data_request_chunk_write(char *data, size_t n, void *p) {
+    chunk_download *c = (chunk_download *) p;
+    if(!data_request_chunk_renew(c)) {
+        return 0;
+    }
+    if(c->fd < 0) {
+        if((c->fd = open(c->part, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+            printf("Error writing data: Could not open file: %s\n", c->part);
+            return 0;
+        }
+    }
+    for(size_t k = 0; k < n; ) {
+        ssize_t nw = write(c->fd, data + k, n - k);
+        if(nw < 0 && errno == EINTR) {
+            continue;
+        }
+        if(nw <= 0) {
+            printf("Error writing data to file: %s: %s\n", c->part,
+                   (nw < 0) ? strerror(errno) : "Incomplete write");
+            c->nbytes += k;
+            return k;
+        }
+        k += (size_t) nw;
+    }
+    c->nbytes += n;
+    return n;
+}
+
+/**
+ * @brief Free a chunk download
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk to free, \ref chunk_download
+ *
+ */
+static void data_request_chunk_unclaim(chunk_download *c);
+static void data_request_pending_done(chunk_download *c);
+static int data_request_busy(data_download *dl, breq_fast *r, int delta);
+
+static void
+data_request_chunk_free(chunk_download *c) {
+    if(c) {
+        if(c->fd >= 0) {
+            close(c->fd);
+        }
+        if(c->claimed) {
+            data_request_chunk_unclaim(c);
+        }
+        if(c->fed) {
+            data_request_busy(c->dl, c->r, -1);
+            c->dl->inflight -= 1;
+        }
+        if(c->pending) {
+            data_request_pending_done(c);
+        }
+        mseed_stream_free(c->ms);
+        if(c->next) {
+            dict_free(c->next, free);
+        }
+        archive_free(c->have);
+        if(c->rest) {
+            breq_fast_free(c->rest);
+        }
+        FREE(c);
+    }
+}
+
+/**
+ * @brief Get the name of the journal of a data request file
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      filename  data request filename
+ * @param      out       output journal filename, filename.journal
+ * @param      n         length of out
+ *
+ */
+static void
+data_request_journal_name(char *filename, char *out, size_t n) {
+    snprintf(out, n, "%s.journal", filename);
+}
+
+/**
+ * @brief Mark chunks completed in an earlier download from the journal
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      fdr       data request
+ * @param      filename  data request filename
+ *
+ * @return     number of chunks marked as commented
+ *
+ * @note The journal holds one chunk identifier per line, see breq_fast_id().
+ *    A line cut short by a crash is ignored
+ */
+static size_t
+data_request_journal_replay(data_request *fdr, char *filename) {
+    FILE *fp = NULL;
+    size_t n = 0;
+    char line[64] = {0};
+    char jfile[2048] = {0};
+    dict *done = NULL;
+    data_request_journal_name(filename, jfile, sizeof(jfile));
+    if(!(fp = fopen(jfile, "r"))) {
+        return 0;
+    }
+    done = dict_new();
+    while(fgets(line, sizeof(line), fp)) {
+        if(strlen(line) == 17 && line[16] == '\n') {
+            line[16] = 0;
+            dict_put(done, line, done);
+        }
+    }
+    fclose(fp);
+    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+        breq_fast *r = fdr->reqs[i];
+        snprintf(line, sizeof(line), "%016" PRIx64, breq_fast_id(r));
+        if(!r->comment && dict_get(done, line)) {
+            r->comment = TRUE;
+            n++;
+        }
+    }
+    dict_free(done, NULL);
+    return n;
+}
+
+/**
+ * @brief Sync the journal of completed chunks to disk
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download
+ *
+ */
+static void
+data_request_journal_sync(data_download *dl) {
+    if(dl->journal >= 0 && dl->unsynced > 0) {
+        fsync(dl->journal);
+        dl->unsynced = 0;
+        dl->synced = time(NULL);
+    }
+}
+
+/**
+ * @brief Record a completed chunk in the journal
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download
+ * @param      r    completed chunk
+ *
+ * @note Entries are synced to disk every 64 entries or 5 seconds, a crash may
+ *    lose the most recent entries, whose chunks are downloaded again.  Without
+ *    a journal the whole data request file is written instead
+ */
+static void
+data_request_journal_append(data_download *dl, breq_fast *r) {
+    char line[64] = {0};
+    ssize_t n = 0;
+    if(dl->journal < 0) {
+        if(dl->filename && strlen(dl->filename) > 0) {
+            data_request_write_to_file(dl->fdr, dl->filename);
+        }
+        return;
+    }
+    n = snprintf(line, sizeof(line), "%016" PRIx64 "\n", breq_fast_id(r));
+    if(write(dl->journal, line, n) != n) {
+        printf("Error writing journal: %s\n", strerror(errno));
+        return;
+    }
+    dl->unsynced++;
+    if(dl->unsynced >= JOURNAL_SYNC_ENTRIES ||
+       time(NULL) - dl->synced >= JOURNAL_SYNC_SECONDS) {
+        data_request_journal_sync(dl);
+    }
+}
+
+/**
+ * @brief Replay and open the journal of completed chunks
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download
+ *
+ * @return     1 on success or without a data request filename, 0 if the
+ *             journal could not be opened
+ *
+ * @note Without a data request filename no journal is kept.  If the journal
+ *    cannot be opened, the data request file is written after each chunk
+ *    instead, see data_request_journal_append()
+ */
+static int
+data_request_journal_open(data_download *dl) {
+    char jfile[2048] = {0};
+    dl->journal = -1;
+    dl->unsynced = 0;
+    dl->synced = time(NULL);
+    if(!dl->filename || strlen(dl->filename) == 0) {
+        return 1;
+    }
+    data_request_journal_replay(dl->fdr, dl->filename);
+    data_request_journal_name(dl->filename, jfile, sizeof(jfile));
+    if((dl->journal = open(jfile, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        printf("Error opening journal: %s: %s\n", jfile, strerror(errno));
+        printf(" WARNING: Writing %s after each chunk instead\n", dl->filename);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Read journal entries written by other processes
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download, sharing chunks with other processes
+ *
+ * @return     1 on success, 0 if the journal was removed, i.e. another process
+ *             finished the data request
+ *
+ * @note Only entries added since the last call are read, their chunks are
+ *    marked as commented.  A line not yet completely written is read again
+ *    on the next call
+ */
+static int
+data_request_journal_refresh(data_download *dl) {
+    FILE *fp = NULL;
+    char line[64] = {0};
+    char jfile[2048] = {0};
+    data_request_journal_name(dl->filename, jfile, sizeof(jfile));
+    if(!(fp = fopen(jfile, "r"))) {
+        return 0;
+    }
+    if(fseeko(fp, dl->journal_read, SEEK_SET) != 0) {
+        fclose(fp);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), fp)) {
+        size_t n = strlen(line);
+        breq_fast *r = NULL;
+        if(line[n-1] != '\n' && feof(fp)) {
+            break;
+        }
+        dl->journal_read += (off_t) n;
+        if(n == 17 && line[16] == '\n') {
+            line[16] = 0;
+            if((r = dict_get(dl->ids, line))) {
+                r->comment = TRUE;
+            }
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+/**
+ * @brief Start sharing the chunks of a data request with other processes
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download, with its journal open
+ *
+ * @return     1 if chunks are shared, 0 if not or on error
+ */
+static int
+data_request_claims_open(data_download *dl) {
+    char cfile[2048] = {0};
+    size_t n = xarray_length(dl->fdr->reqs);
+    if(dl->fdr->claim_lease <= 0 || !dl->save_files) {
+        return 0;
+    }
+    if(dl->journal < 0) {
+        printf(" WARNING: Chunks are not shared with other processes without a journal\n");
+        return 0;
+    }
+    snprintf(cfile, sizeof(cfile), "%s.claims", dl->filename);
+    if(!(dl->claims = claim_table_open(cfile, dl->fdr->claim_lease))) {
+        return 0;
+    }
+    dl->ids = dict_new();
+    for(size_t i = 0; i < n; i++) {
+        char id[32] = {0};
+        snprintf(id, sizeof(id), "%016" PRIx64, breq_fast_id(dl->fdr->reqs[i]));
+        dict_put(dl->ids, id, dl->fdr->reqs[i]);
+    }
+    // Entries already in the journal were read when it was opened
+    dl->journal_read = lseek(dl->journal, 0, SEEK_END);
+    return 1;
+}
+
+/**
+ * @brief Stop sharing the chunks of a data request with other processes
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download
+ *
+ */
+static void
+data_request_claims_close(data_download *dl) {
+    if(!dl->claims) {
+        return;
+    }
+    claim_table_free(dl->claims);
+    dl->claims = NULL;
+    dict_free(dl->ids, NULL);
+}
+
+/**
+ * @brief Count a chunk downloading from a data center
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl     data download
+ * @param      r      chunk
+ * @param      delta  +1 when the chunk starts, -1 when it finishes
+ *
+ * @return     number of chunks downloading from the chunk's data center
+ */
+static int
+data_request_busy(data_download *dl, breq_fast *r, int delta) {
+    int *busy = NULL;
+    char *dc = dict_get(r->urls, "DATACENTER");
+    if(!dc) {
+        return 0;
+    }
+    if(!(busy = dict_get(dl->busy, dc))) {
+        busy = calloc(1, sizeof(int));
+        dict_put(dl->busy, dc, busy);
+    }
+    *busy += delta;
+    return *busy;
+}
+
+/**
+ * @brief Release the claim on a finished chunk
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk being freed, \ref chunk_download
+ *
+ * @note The journal is synced first, so a completed chunk is in the journal
+ *    before other processes may claim it
+ */
+static void
+data_request_chunk_unclaim(chunk_download *c) {
+    char id[32] = {0};
+    data_download *dl = c->dl;
+    data_request_journal_sync(dl);
+    snprintf(id, sizeof(id), "%016" PRIx64, breq_fast_id(c->r));
+    claim_release(dl->claims, id);
+    c->claimed = FALSE;
+}
+
+/**
+ * @brief Write the data request file and remove the journal
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download
+ *
+ * @note The data request file is replaced atomically, the journal is only
+ *    removed once the new file is in place.  When sharing chunks with other
+ *    processes, this is only done once all chunks are complete.  Without a
+ *    journal the data request file is still written
+ */
+static void
+data_request_journal_compact(data_download *dl) {
+    char jfile[2048] = {0};
+    char cfile[2048] = {0};
+    if(dl->journal < 0) {
+        if(dl->filename && strlen(dl->filename) > 0) {
+            data_request_write_to_file(dl->fdr, dl->filename);
+        }
+        return;
+    }
+    data_request_journal_sync(dl);
+    close(dl->journal);
+    dl->journal = -1;
+    if(dl->claims) {
+        size_t left = 0;
+        if(dl->finished || !data_request_journal_refresh(dl)) {
+            return;
+        }
+        for(size_t i = 0; i < xarray_length(dl->fdr->reqs); i++) {
+            left += (dl->fdr->reqs[i]->comment) ? 0 : 1;
+        }
+        if(left > 0) {
+            printf("%zu chunks not complete, see %s.journal\n", left, dl->filename);
+            return;
+        }
+    }
+    if(data_request_write_to_file(dl->fdr, dl->filename)) {
+        data_request_journal_name(dl->filename, jfile, sizeof(jfile));
+        unlink(jfile);
+        if(dl->claims) {
+            snprintf(cfile, sizeof(cfile), "%s.claims", dl->filename);
+            unlink(cfile);
+        }
+    }
+}
+
+/**
+ * @brief Find the shard of a data request line
+ *
+ * @memberof   breq_fast_line
+ * @ingroup    data
+ * @private
+ *
+ * @param      x    data request line
+ * @param      n    number of shards
+ *
+ * @return     shard of the line, 1 to n
+ *
+ * @note Lines are assigned by a 64-bit FNV-1a hash of network.station, so all
+ *    channels of a station are in the same shard, on every host and every run
+ */
+static int
+breq_fast_line_shard(breq_fast_line *x, int n) {
+    uint64_t h = 14695981039346656037ULL;
+    for(char *p = x->net; *p; p++) {
+        h = (h ^ (uint8_t) *p) * 1099511628211ULL;
+    }
+    h = (h ^ (uint8_t) '.') * 1099511628211ULL;
+    for(char *p = x->sta; *p; p++) {
+        h = (h ^ (uint8_t) *p) * 1099511628211ULL;
+    }
+    return (int) (h % (uint64_t) n) + 1;
+}
+
+/**
+ * @brief Get the lines of a data request in a shard
+ *
+ * @memberof   breq_fast
+ * @ingroup    data
+ * @private
+ *
+ * @param      r    data request
+ * @param      i    shard, 1 to n
+ * @param      n    number of shards
+ *
+ * @return     new data request with the lines of r in shard i, NULL if none
+ */
+static breq_fast *
+breq_fast_shard(breq_fast *r, int i, int n) {
+    breq_fast *part = NULL;
+    for(size_t j = 0; j < r->nlines; j++) {
+        if(breq_fast_line_shard(&r->lines[j], n) != i) {
+            continue;
+        }
+        if(!part) {
+            part = breq_fast_new();
+            breq_fast_copy_urls(part, r);
+            part->comment = r->comment;
+        }
+        breq_fast_append(part, &r->lines[j]);
+    }
+    return part;
+}
+
+/**
+ * @brief Get the name of the data request file of a shard
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      filename  data request filename
+ * @param      i         shard, 1 to n
+ * @param      n         number of shards
+ * @param      out       output filename, filename.shard-i-of-n
+ * @param      len       length of out
+ *
+ */
+void
+data_request_shard_name(char *filename, int i, int n, char *out, size_t len) {
+    snprintf(out, len, "%s.shard-%d-of-%d", filename, i, n);
+}
+
+/**
+ * @brief Keep only the request lines of one shard of a data request
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr   data request list
+ * @param      i     shard, 1 to n
+ * @param      n     number of shards
+ *
+ * @return     number of request lines kept
+ *
+ * @note Lines are divided between shards by a stable hash of network.station,
+ *    so n processes each downloading one shard of the same data request,
+ *    with no communication between them, download every line exactly once.
+ *    Each chunk is reduced to its lines in the shard.  Each process keeps
+ *    its progress in its own data request file, see data_request_shard_name(),
+ *    which are combined with data_request_merge_shards()
+ */
+size_t
+data_request_shard(data_request *fdr, int i, int n) {
+    size_t kept = 0;
+    breq_fast **new = NULL;
+    if(!fdr || n < 1 || i < 1 || i > n) {
+        return 0;
+    }
+    new = xarray_new('p');
+    for(size_t k = 0; k < xarray_length(fdr->reqs); k++) {
+        breq_fast *part = NULL;
+        if((part = breq_fast_shard(fdr->reqs[k], i, n))) {
+            kept += part->nlines;
+            new = xarray_append(new, part);
+        }
+        breq_fast_free(fdr->reqs[k]);
+    }
+    xarray_free(fdr->reqs);
+    fdr->reqs = new;
+    return kept;
+}
+
+/**
+ * @brief Combine the progress of shards into the data request file
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr       data request list, as divided into shards
+ * @param      filename  data request filename
+ * @param      n         number of shards
+ *
+ * @return     number of shards found, 0 on error
+ *
+ * @note Chunks completed in every shard are commented.  Chunks completed in
+ *    only some shards are replaced by their lines in each shard, so the
+ *    completed lines are not requested again.  The data request file is then
+ *    rewritten and the shard files and their journals are removed.  Run once
+ *    all processes downloading the shards have stopped
+ */
+size_t
+data_request_merge_shards(data_request *fdr, char *filename, int n) {
+    size_t found = 0;
+    dict *done = NULL;
+    breq_fast **new = NULL;
+    breq_fast **parts = NULL;
+    char id[32] = {0};
+    char sfile[2048] = {0};
+    char jfile[2048] = {0};
+    if(!fdr || !filename || n < 1) {
+        return 0;
+    }
+    done = dict_new();
+    for(int i = 1; i <= n; i++) {
+        size_t len = 0;
+        char *data = NULL;
+        data_request *s = NULL;
+        data_request_shard_name(filename, i, n, sfile, sizeof(sfile));
+        if(!(data = slurp(sfile, &len))) {
+            printf("Warning: shard %d/%d not found: %s\n", i, n, sfile);
+            continue;
+        }
+        s = data_request_parse(data);
+        FREE(data);
+        if(!s) {
+            continue;
+        }
+        data_request_journal_replay(s, sfile);
+        for(size_t k = 0; k < xarray_length(s->reqs); k++) {
+            if(s->reqs[k]->comment) {
+                snprintf(id, sizeof(id), "%016" PRIx64, breq_fast_id(s->reqs[k]));
+                dict_put(done, id, done);
+            }
+        }
+        data_request_free(s);
+        found++;
+    }
+    if(found == 0) {
+        // Keep the data request file as is, nothing to merge
+        printf("Error: no shards of %s found\n", filename);
+        dict_free(done, NULL);
+        return 0;
+    }
+    new = xarray_new('p');
+    parts = calloc((size_t) n, sizeof(breq_fast *));
+    for(size_t k = 0; k < xarray_length(fdr->reqs); k++) {
+        int split = FALSE;
+        size_t nparts = 0, ndone = 0;
+        breq_fast *r = fdr->reqs[k];
+        if(r->comment) {
+            new = xarray_append(new, r);
+            continue;
+        }
+        for(int i = 0; i < n; i++) {
+            if(!(parts[i] = breq_fast_shard(r, i + 1, n))) {
+                continue;
+            }
+            nparts++;
+            snprintf(id, sizeof(id), "%016" PRIx64, breq_fast_id(parts[i]));
+            if(dict_get(done, id)) {
+                parts[i]->comment = TRUE;
+                ndone++;
+            }
+        }
+        split = (ndone > 0 && ndone < nparts);
+        for(int i = 0; i < n; i++) {
+            if(parts[i] && split) {
+                new = xarray_append(new, parts[i]);
+            } else if(parts[i]) {
+                breq_fast_free(parts[i]);
+            }
+            parts[i] = NULL;
+        }
+        if(split) {
+            breq_fast_free(r);
+        } else {
+            r->comment = (nparts > 0 && ndone == nparts);
+            new = xarray_append(new, r);
+        }
+    }
+    FREE(parts);
+    dict_free(done, NULL);
+    xarray_free(fdr->reqs);
+    fdr->reqs = new;
+    if(!data_request_write_to_file(fdr, filename)) {
+        return 0;
+    }
+    for(int i = 1; i <= n; i++) {
+        data_request_shard_name(filename, i, n, sfile, sizeof(sfile));
+        data_request_journal_name(sfile, jfile, sizeof(jfile));
+        unlink(sfile);
+        unlink(jfile);
+    }
+    return found;
+}
+
+/**
+ * @brief Learn the size of miniseed data from a completed chunk
+ *
+ * @memberof   breq_fast
+ * @ingroup    data
+ * @private
+ *
+ * @param      f       completed chunk
+ * @param      nbytes  bytes received for the chunk
+ *
+ * @note Bytes are divided between the lines by their expected number of
+ *    samples.  Chunks with wildcards are skipped
+ */
+static void
+breq_fast_learn_size(breq_fast *f, int64_t nbytes) {
+    double total = 0.0;
+    size_t n = f->nlines;
+    double *samples = NULL;
+    breq_fast_line *x = f->lines;
+    if(n == 0 || nbytes <= 0) {
+        return;
+    }
+    samples = calloc(n, sizeof(double));
+    for(size_t i = 0; i < n; i++) {
+        if(strpbrk(x[i].net, "*?") || strpbrk(x[i].cha, "*?")) {
+            goto done;
+        }
+        samples[i] = chunk_size_sample_rate(x[i].net, x[i].sta, x[i].loc, x[i].cha) *
+            (double) (x[i].t2.tv_sec - x[i].t1.tv_sec);
+        total += samples[i];
+    }
+    for(size_t i = 0; i < n && total > 0.0; i++) {
+        chunk_size_learn(x[i].net, x[i].cha, samples[i],
+                         (int64_t) llround((double) nbytes * samples[i] / total));
+    }
+ done:
+    FREE(samples);
+}
+
+/**
+ * @brief Finish a chunk whose data has all been received
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk being downloaded, \ref chunk_download
+ *
+ * @note The partial file is renamed to prefix.date.datacenter.mseed and the
+ *    chunk is marked as commented.  With an SDS archive the data is already
+ *    in place
+ */
+static void
+data_request_chunk_complete(chunk_download *c) {
+    char tmp[64] = {0};
+    int64_t nbytes = c->offset + (int64_t) c->nbytes;
+    if(c->dl->sds && nbytes > 0) {
+        cprintf("green", "Writing data to %s [%s]\n", c->dl->fdr->sds,
+                data_size(nbytes, tmp, sizeof(tmp)));
+    } else if(c->dl->save_files && nbytes > 0) {
+        timespec64 t = timespec64_now();
+        char date[64] = {0};
+        char base[2048] = {0};
+        char dcname[128] = {0};
+        strftime64t(date, sizeof(date), "%Y.%m.%d.%H.%M.%S", &t);
+        data_request_chunk_dcname(c, dcname, sizeof(dcname));
+        snprintf(base, sizeof(base), "%s.%s.%s.mseed", c->dl->prefix, date, dcname);
+        find_unique_filename(base, c->file, sizeof(c->file));
+        if(rename(c->part, c->file) != 0) {
+            printf("Error writing data: Could not rename %s to %s\n", c->part, c->file);
+            return;
+        }
+        cprintf("green", "Writing data to %s [%s]\n", c->file,
+                data_size(nbytes, tmp, sizeof(tmp)));
+    }
+    if(c->ms) {
+        mseed_stream_finish(c->ms);
+    }
+    c->r->comment = TRUE;
+}
+
+static void data_request_chunk_done(result *fr, void *data);
+
+/**
+ * @brief Start downloading a chunk
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk to download, \ref chunk_download
+ *
+ * @return     1 if the chunk was handled, 0 on error
+ *
+ * @note With partial data from an earlier download the data is requested from
+ *    where it stopped, with a Range if possible, otherwise with a remainder
+ *    request.  If no data remains the chunk is completed and freed here
+ */
+static int
+data_request_chunk_submit(chunk_download *c) {
+    int retval = 0;
+    request *fr = NULL;
+    if(!(fr = breq_fast_request(c->r))) {
+        return 0;
+    }
+    if(c->rest) {
+        breq_fast_free(c->rest);
+        c->rest = NULL;
+    }
+    c->nbytes = 0;
+    c->range = (c->offset > 0 && !c->remainder);
+    if(c->range) {
+        request_set_range_from(fr, c->offset);
+    } else if(c->offset > 0 || c->have) {
+        if(!(c->rest = data_request_chunk_remainder(c))) {
+            cprintf("", "Data Center: %s\n", (char *) dict_get(c->r->urls, "DATACENTER"));
+            printf("\t");
+            data_request_chunk_complete(c);
+            if(c->r->comment) {
+                data_request_journal_append(c->dl, c->r);
+            }
+            data_request_chunk_free(c);
+            REQUEST_FREE(fr);
+            return 1;
+        }
+    }
+    if(c->dl->save_files && !c->dl->sds) {
+        request_add_sink(fr, data_request_chunk_write, c);
+    }
+    if(c->ms) {
+        request_add_sink(fr, mseed_stream_write, c->ms);
+    }
+    request_set_keep_data(fr, FALSE);
+    retval = fern_loop_add_lines(c->dl->loop, fr, breq_fast_post_line,
+                                 (c->rest) ? c->rest : c->r,
+                                 dict_get(c->r->urls, "DATACENTER"),
+                                 data_request_chunk_done, c);
+    REQUEST_FREE(fr);
+    return retval;
+}
+
+/**
+ * @brief Pass a downloaded channel to the trace function
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download
+ * @param      t    channel, all of its data has been downloaded
+ *
+ * @note The segments and their records are released afterwards, the
+ *    channel is kept in the trace list without segments
+ */
+static void
+data_request_trace_emit(data_download *dl, MS3TraceID *t) {
+    dl->fdr->trace_fn(dl->loop, t, dl->fdr->trace_data);
+    miniseed_trace_release(t);
+}
+
+/**
+ * @brief Pass channels with no chunks left to the trace function
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl    data download
+ * @param      all   pass all remaining channels, once the download is done
+ *
+ */
+static void
+data_request_trace_flush(data_download *dl, int all) {
+    MS3TraceID *t = NULL;
+    if(!dl->pending || !dl->mst3k || (dl->wild > 0 && !all)) {
+        return;
+    }
+    t = dl->mst3k->traces;
+    for(uint32_t i = 0; t && i < dl->mst3k->numtraces; i++, t = t->next) {
+        int *n = dict_get(dl->pending, t->sid);
+        if(n && *n < 0) {
+            continue;
+        }
+        if(all || !n || *n == 0) {
+            data_request_trace_emit(dl, t);
+            if(!n) {
+                n = calloc(1, sizeof(int));
+                dict_put(dl->pending, t->sid, n);
+            }
+            *n = -1;
+        }
+    }
+}
+
+/**
+ * @brief Count the chunks still to be downloaded of each channel
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download, unpacking data with a trace function
+ *
+ */
+static void
+data_request_pending_init(data_download *dl) {
+    dl->pending = dict_new();
+    dl->wild = 0;
+    for(size_t i = 0; i < xarray_length(dl->fdr->reqs); i++) {
+        breq_fast *r = dl->fdr->reqs[i];
+        int wild = FALSE;
+        if(r->comment) {
+            continue;
+        }
+        for(size_t j = 0; j < r->nlines; j++) {
+            int *n = NULL;
+            char sid[LM_SIDLEN] = {0};
+            if(!breq_fast_line_sid(&r->lines[j], sid, sizeof(sid))) {
+                wild = TRUE;
+                continue;
+            }
+            if(!(n = dict_get(dl->pending, sid))) {
+                n = calloc(1, sizeof(int));
+                dict_put(dl->pending, sid, n);
+            }
+            *n += 1;
+        }
+        dl->wild += (wild) ? 1 : 0;
+    }
+}
+
+/**
+ * @brief Count a finished chunk and pass channels with no chunks left
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      c    chunk being freed, \ref chunk_download
+ *
+ * @note A chunk that failed is counted as well, no more of its data arrives
+ */
+static void
+data_request_pending_done(chunk_download *c) {
+    int wild = FALSE;
+    data_download *dl = c->dl;
+    c->pending = FALSE;
+    for(size_t j = 0; j < c->r->nlines; j++) {
+        int *n = NULL;
+        char sid[LM_SIDLEN] = {0};
+        if(!breq_fast_line_sid(&c->r->lines[j], sid, sizeof(sid))) {
+            wild = TRUE;
+        } else if((n = dict_get(dl->pending, sid)) && *n > 0) {
+            *n -= 1;
+        }
+    }
+    if(wild && dl->wild > 0) {
+        dl->wild -= 1;
+    }
+    data_request_trace_flush(dl, FALSE);
+}
+
+/**
+ * @brief Set up a chunk and start its download
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl       data download
+ * @param      r        chunk
+ * @param      claimed  chunk is claimed from a shared request file
+ *
+ * @note Chunks started as transfers free up are counted, see
+ *    data_request_feed()
+ */
+static void
+data_request_chunk_start(data_download *dl, breq_fast *r, int claimed) {
+    chunk_download *c = calloc(1, sizeof(chunk_download));
+    c->dl = dl;
+    c->r = r;
+    c->fd = -1;
+    c->pending = (dl->pending != NULL);
+    if(claimed) {
+        c->claimed = TRUE;
+        c->renewed = time(NULL);
+    }
+    if(dl->started) {
+        c->fed = TRUE;
+        dl->inflight += 1;
+        data_request_busy(dl, r, 1);
+    }
+    if(dl->unpack_data || dl->sds) {
+        c->ms = mseed_stream_new(dl->mst3k);
+        if(dl->pending) {
+            // Records are decoded straight into sac files by the trace function
+            mseed_stream_keep_records(c->ms);
+        }
+    }
+    if(dl->sds) {
+        mseed_stream_set_record_func(c->ms, data_request_chunk_record, c);
+        data_request_chunk_sds(c);
+    } else if(dl->save_files) {
+        data_request_chunk_part(c);
+    }
+    if(!data_request_chunk_submit(c)) {
+        data_request_chunk_free(c);
+    }
+}
+
+/**
+ * @brief Bytes of samples held for channels not yet complete
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download
+ *
+ * @return     bytes of samples in the trace list and held by the trace
+ *             function
+ *
+ * @note Complete channels have already been passed to the trace function
+ *    and hold no samples in the trace list, see
+ *    data_request_set_memory_func()
+ */
+static size_t
+data_request_memory(data_download *dl) {
+    size_t n = 0;
+    data_request *fdr = dl->fdr;
+    if(fdr->memory_fn) {
+        n += fdr->memory_fn(fdr->trace_data);
+    }
+    MS3TraceID *t = (dl->mst3k) ? dl->mst3k->traces : NULL;
+    for(uint32_t i = 0; t && i < dl->mst3k->numtraces; i++, t = t->next) {
+        for(MS3TraceSeg *seg = t->first; seg; seg = seg->next) {
+            // Kept records become floats once decoded
+            n += (seg->datasamples) ? (size_t) seg->datasize :
+                (size_t) seg->samplecnt * sizeof(float);
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Start chunks as transfers become free
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download
+ *
+ * @note Used when sharing chunks with other processes, see
+ *    data_request_set_claim(), and with a memory limit, see
+ *    data_request_set_memory().  Shared chunks are claimed only as they are
+ *    started, so chunks not yet started remain available to other processes.
+ *    Chunks claimed by another process are tried again once its claim
+ *    expires.  With a memory limit no chunk is started while the limit is
+ *    exceeded, unless none are downloading
+ */
+static void
+data_request_feed(data_download *dl) {
+    int64_t now = (int64_t) time(NULL);
+    data_request *fdr = dl->fdr;
+    if(dl->claims && (dl->finished || !data_request_journal_refresh(dl))) {
+        dl->finished = TRUE;
+        return;
+    }
+    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+        char id[32] = {0};
+        int *busy = NULL;
+        breq_fast *r = fdr->reqs[i];
+        if(fdr->max_transfers > 0 && dl->inflight >= (size_t) fdr->max_transfers) {
+            break;
+        }
+        if(dl->pending && fdr->memory > 0 && dl->inflight > 0 &&
+           data_request_memory(dl) >= fdr->memory) {
+            break;
+        }
+        if(r->comment || dl->started[i] || dl->retry_at[i] > now) {
+            continue;
+        }
+        busy = (dict_get(r->urls, "DATACENTER")) ?
+            dict_get(dl->busy, dict_get(r->urls, "DATACENTER")) : NULL;
+        if(busy && fdr->max_per_datacenter > 0 && *busy >= fdr->max_per_datacenter) {
+            continue;
+        }
+        if(dl->claims) {
+            snprintf(id, sizeof(id), "%016" PRIx64, breq_fast_id(r));
+            if(!claim_take(dl->claims, id, &dl->retry_at[i])) {
+                continue;
+            }
+            // Another process may have completed the chunk before it was claimed
+            data_request_journal_refresh(dl);
+            if(r->comment) {
+                claim_release(dl->claims, id);
+                continue;
+            }
+        }
+        dl->started[i] = TRUE;
+        data_request_chunk_start(dl, r, dl->claims != NULL);
+    }
+}
+
+/**
+ * @brief Count chunks not yet complete nor started by this process
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      dl   data download, sharing chunks with other processes
+ *
+ * @return     number of chunks left, 0 if another process finished the data
+ *             request
+ */
+static size_t
+data_request_claims_left(data_download *dl) {
+    size_t left = 0;
+    for(size_t i = 0; !dl->finished && i < xarray_length(dl->fdr->reqs); i++) {
+        if(!dl->fdr->reqs[i]->comment && !dl->started[i]) {
+            left++;
+        }
+    }
+    return left;
+}
+
+/**
+ * @brief Handle a completed chunk download
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      fr    result of the chunk download
+ * @param      data  chunk being downloaded, \ref chunk_download
+ *
+ * @note The chunk is marked as commented and recorded in the journal if all
+ *    data was received or no data is available.
+ *    Otherwise the chunk is left uncommented and any partial data is kept to
+ *    be resumed on the next run
+ */
+static void
+data_request_chunk_done(result *fr, void *data) {
+    char tmp[64] = {0};
+    chunk_download *c = (chunk_download *) data;
+    data_download *dl = c->dl;
+    breq_fast *r = c->r;
+    int64_t nbytes = 0;
+
+    if(c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+    if(c->range && !result_is_ok(fr) &&
+       (result_http_code(fr) == 200 || result_http_code(fr) == 416)) {
+        // Range not supported, request the data not yet received instead
+        char rpart[2048] = {0};
+        fern_strlcpy(rpart, c->part, sizeof(rpart));
+        rpart[strlen(rpart) - strlen("part")] = 0;
+        fern_strlcat(rpart, "rpart", sizeof(rpart));
+        if(rename(c->part, rpart) == 0) {
+            fern_strlcpy(c->part, rpart, sizeof(c->part));
+            c->remainder = TRUE;
+            RESULT_FREE(fr);
+            if(data_request_chunk_submit(c)) {
+                return;
+            }
+            fr = result_error(667, "Error constructing remainder request");
+        }
+    }
+    nbytes = c->offset + (int64_t) c->nbytes;
+
+    cprintf("", "Data Center: %s\n", (char *) dict_get(r->urls, "DATACENTER"));
+    printf("\t");
+    if(result_is_ok(fr)) {
+        char dc[128] = {0};
+        data_request_chunk_complete(c);
+        breq_fast_learn_size(r, (dl->save_files) ? nbytes :
+                             result_timing(fr)->bytes_down);
+        breq_fast_dcname(r, dc, sizeof(dc));
+        chunk_size_learn_speed(dc, result_timing(fr)->bytes_down,
+                               result_timing(fr)->total);
+    } else if(result_is_empty(fr) && nbytes > 0) {
+        // Remaining data is not available, keep what was received
+        data_request_chunk_complete(c);
+    } else if(result_is_empty(fr)) {
+        cprintf("red,bold", "No data available\n");
+        r->comment = TRUE;
+    } else {
+        char *msg = result_error_msg(fr);
+        printf("%s\n", msg);
+        FREE(msg);
+        if(dl->save_files && nbytes > 0) {
+            printf("\tPartial data kept in %s [%s], run again to resume\n",
+                   (dl->sds) ? dl->fdr->sds : c->part,
+                   data_size(nbytes, tmp, sizeof(tmp)));
+        }
+    }
+    RESULT_FREE(fr);
+    if(r->comment) {
+        data_request_journal_append(dl, r);
+    }
+    data_request_chunk_free(c);
+    if(dl->started) {
+        data_request_feed(dl);
+    }
+}
+
+/**
+ * @brief Download data with a data request list
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr          data request
+ * @param      filename     data request filename
+ * @param      prefix       prefix for miniseed output files
+ * @param      save_files   save data to miniseed files
+ * @param      unpack_data  unpack data and place into a Miniseed Trace List
+ *
+ * @return     miniseed trace list
+ *
+ * @note Chunks are downloaded concurrently, see data_request_set_concurrency().
+ *    Each chunk is written to its own file, or into an SDS archive, see
+ *    data_request_set_sds(), and is recorded in a journal,
+ *    filename.journal, once it completes.  The data request file is rewritten
+ *    with completed chunks commented when the download finishes.  After an
+ *    interruption the journal is replayed on the next run, and a chunk that
+ *    failed part way keeps its partial data, which is resumed.
+ *    Several processes may download the same data request file, see
+ *    data_request_set_claim().  Channels may be processed as soon as they
+ *    are downloaded, see data_request_set_trace_func()
+ */
+MS3TraceList *
+data_request_download(data_request *fdr, char *filename, char *prefix,
+                           int save_files, int unpack_data) {
+    data_download dl = { .fdr = fdr, .filename = filename, .prefix = prefix,
+                         .save_files = save_files, .unpack_data = unpack_data,
+                         .mst3k = NULL, .sds = NULL, .loop = NULL };
+    data_request_journal_open(&dl);
+    dl.loop = fern_loop_new();
+    if(unpack_data) {
+        dl.mst3k = mstl3_init(NULL);
+    }
+    if(save_files && fdr->sds) {
+        dl.sds = sds_writer_new(fdr->sds);
+    }
+    fern_loop_set_max_transfers(dl.loop, fdr->max_transfers);
+    fern_loop_set_max_per_group(dl.loop, fdr->max_per_datacenter);
+    if(dl.mst3k && fdr->trace_fn) {
+        data_request_pending_init(&dl);
+    }
+    if(data_request_claims_open(&dl) || (dl.pending && fdr->memory > 0)) {
+        // Chunks are started as transfers free up. Wait for chunks claimed
+        // by other processes, they are taken over if their claims expire
+        size_t n = xarray_length(fdr->reqs);
+        dl.busy = dict_new();
+        dl.started = calloc(n + 1, sizeof(int));
+        dl.retry_at = calloc(n + 1, sizeof(int64_t));
+        for(;;) {
+            data_request_feed(&dl);
+            if(dl.inflight > 0) {
+                fern_loop_run(dl.loop);
+            } else if(dl.claims && data_request_claims_left(&dl) > 0) {
+                sleep(1);
+            } else {
+                break;
+            }
+        }
+    } else {
+        for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+            if(!fdr->reqs[i]->comment) {
+                data_request_chunk_start(&dl, fdr->reqs[i], FALSE);
+            }
+        }
+        fern_loop_run(dl.loop);
+    }
+    if(dl.pending) {
+        // Pass the remaining channels and finish their transfers
+        data_request_trace_flush(&dl, TRUE);
+        fdr->trace_fn(dl.loop, NULL, fdr->trace_data);
+        fern_loop_run(dl.loop);
+        dict_free(dl.pending, free);
+    }
+    fern_loop_free(dl.loop);
+    if(sds_writer_skipped(dl.sds) > 0) {
+        printf("Skipped %" PRId64 " records already in %s\n",
+               sds_writer_skipped(dl.sds), fdr->sds);
+    }
+    sds_writer_free(dl.sds);
+    data_request_journal_compact(&dl);
+    data_request_claims_close(&dl);
+    if(dl.started) {
+        dict_free(dl.busy, free);
+        FREE(dl.started);
+        FREE(dl.retry_at);
+    }
+    chunk_size_save();
+    if(dl.mst3k && dl.mst3k->numtraces == 0) {
+        mstl3_free(&dl.mst3k, 0);
+    }
+    return dl.mst3k;
+}
+
+/**
+ * @brief Sort request lines by network, station, location, channel and start
+ *
+ * @memberof   breq_fast_line
+ * @ingroup    data
+ * @private
+ *
+ * @param      a   first line
+ * @param      b   second line
+ *
+ * @return     0 if equal, -1 if a < b, +1 if a > b
+ */
+static int
+breq_fast_line_sort(const void *a, const void *b) {
+    int n = 0;
+    const breq_fast_line *pa = (const breq_fast_line *) a;
+    const breq_fast_line *pb = (const breq_fast_line *) b;
+    if((n = strcmp(pa->net, pb->net)) != 0 ||
+       (n = strcmp(pa->sta, pb->sta)) != 0 ||
+       (n = strcmp(pa->loc, pb->loc)) != 0 ||
+       (n = strcmp(pa->cha, pb->cha)) != 0) {
+        return n;
+    }
+    return timespec64_cmp((timespec64 *) &pa->t1, (timespec64 *) &pb->t1);
+}
+
+/**
+ * @brief Merge overlapping and duplicate request lines within a data center
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param      fdr        data request list
+ * @param      dc         data center to merge
+ * @param      tolerance  largest gap in seconds between lines that are merged
+ * @param      new        merged requests, appended to
+ *
+ * @return     merged requests
+ */
+static breq_fast **
+data_request_coalesce_dc(data_request *fdr, char *dc, double tolerance, breq_fast **new) {
+    size_t n = 0;
+    breq_fast *fr = NULL;
+    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+        breq_fast *r = fdr->reqs[i];
+        char *rdc = (r) ? dict_get(r->urls, "DATACENTER") : NULL;
+        if(!rdc || r->comment || strcmp(rdc, dc) != 0) {
+            continue;
+        }
+        if(!fr) {
+            fr = breq_fast_new();
+            breq_fast_copy_urls(fr, r);
+        }
+        for(size_t j = 0; j < r->nlines; j++) {
+            breq_fast_append(fr, &r->lines[j]);
+        }
+    }
+    if(!fr) {
+        return new;
+    }
+    qsort(fr->lines, fr->nlines, sizeof(breq_fast_line), breq_fast_line_sort);
+    for(size_t i = 0; i < fr->nlines; i++) {
+        breq_fast_line *c = &fr->lines[i];
+        breq_fast_line *last = (n > 0) ? &fr->lines[n-1] : NULL;
+        if(last && strcmp(last->net, c->net) == 0 && strcmp(last->sta, c->sta) == 0 &&
+           strcmp(last->loc, c->loc) == 0 && strcmp(last->cha, c->cha) == 0) {
+            // Same channel, starting at or after the last line
+            double gap = (double) (c->t1.tv_sec - last->t2.tv_sec) +
+                (double) (c->t1.tv_nsec - last->t2.tv_nsec) * 1e-9;
+            if(gap <= tolerance) {
+                if(timespec64_cmp(&c->t2, &last->t2) > 0) {
+                    last->t2 = c->t2;
+                }
+                continue;
+            }
+        }
+        fr->lines[n++] = *c;
+    }
+    fr->nlines = n;
+    return xarray_append(new, fr);
+}
+
+/**
+ * @brief Move the requests of one data request list into another
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      dst   data request list to add requests to
+ * @param      src   data request list to take requests from, left empty
+ *
+ * @note Requests to the same data center can then be combined with
+ *    data_request_coalesce()
+ */
+void
+data_request_merge(data_request *dst, data_request *src) {
+    if(!dst || !src) {
+        return;
+    }
+    for(size_t i = 0; i < xarray_length(src->reqs); i++) {
+        dst->reqs = xarray_append(dst->reqs, src->reqs[i]);
+    }
+    xarray_clear(src->reqs);
+}
+
+/**
+ * @brief Check if a data request selects a miniseed source id
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr   data request list
+ * @param      sid   miniseed source id, e.g. FDSN:IU_ANMO_00_B_H_Z
+ *
+ * @return     1 if any request line selects the source id, 0 otherwise
+ *
+ * @note Times are not compared, commented requests are included
+ */
+int
+data_request_selects(data_request *fdr, char *sid) {
+    for(size_t i = 0; fdr && sid && i < xarray_length(fdr->reqs); i++) {
+        breq_fast *r = fdr->reqs[i];
+        for(size_t j = 0; j < r->nlines; j++) {
+            if(breq_fast_line_match(&r->lines[j], sid)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Merge overlapping and duplicate request lines
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr        data request list
+ * @param      tolerance  largest gap in seconds between lines that are merged
+ *
+ * @return     number of request lines removed
+ *
+ * @note Lines for the same network, station, location and channel from the
+ *    same data center are sorted by start time.  Duplicate lines are dropped
+ *    and lines that overlap or are within tolerance of each other are merged.
+ *    Requests to the same data center are combined into one, in the place
+ *    of the first.  Commented requests are left as they are and where they
+ *    are.  Wildcards are compared as written.  Run before
+ *    data_request_chunks(), which does not merge lines
+ */
+size_t
+data_request_coalesce(data_request *fdr, double tolerance) {
+    size_t before = 0, after = 0;
+    breq_fast **new = NULL;
+    dict *seen = NULL;
+    if(!fdr) {
+        return 0;
+    }
+    new = xarray_new('p');
+    seen = dict_new();
+    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+        breq_fast *r = fdr->reqs[i];
+        if(!r->comment && dict_get(r->urls, "DATACENTER")) {
+            before += r->nlines;
+        }
+    }
+    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+        breq_fast *r = fdr->reqs[i];
+        char *dc = dict_get(r->urls, "DATACENTER");
+        if(r->comment || !dc) {
+            new = xarray_append(new, r);
+            fdr->reqs[i] = NULL;
+        } else if(!dict_get(seen, dc)) {
+            dict_put(seen, dc, fdr);
+            new = data_request_coalesce_dc(fdr, dc, tolerance, new);
+        }
+    }
+    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+        breq_fast_free(fdr->reqs[i]);
+    }
+    xarray_free(fdr->reqs);
+    fdr->reqs = new;
+    for(size_t i = 0; i < xarray_length(new); i++) {
+        if(!new[i]->comment && dict_get(new[i]->urls, "DATACENTER")) {
+            after += new[i]->nlines;
+        }
+    }
+    dict_free(seen, NULL);
+    return (before > after) ? before - after : 0;
+}
+
+/**
+ * @brief Format a line of a channel metadata request for a data request
+ *
+ * @memberof   breq_fast
+ * @ingroup    data
+ * @private
+ *
+ * @param data   data request
+ * @param i      line number, the first line sets the level
+ * @param buf    output buffer
+ * @param n      size of buf
+ *
+ * @return length of the line, -1 if there is no line i
+ *
+ * @note See \ref post_line_func
+ */
+static int
+breq_fast_channel_post_line(void *data, size_t i, char *buf, size_t n) {
+    if(i == 0) {
+        return (int) fern_strlcpy(buf, "level=channel\n", n);
+    }
+    return breq_fast_post_line(data, i - 1, buf, n);
+}
+
+/**
+ * @brief Keep the result of a channel metadata request
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ * @private
+ *
+ * @param r     result of the station request
+ * @param data  results, enclosed in an \ref xarray
+ *
+ */
+static void
+data_request_station_done(result *r, void *data) {
+    result ***out = (result ***) data;
+    *out = xarray_append(*out, r);
+}
+
+/**
+ * @brief Request channel metadata for the channels of a data request
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr      data request list
+ * @param      verbose  be verbose
+ *
+ * @return     station xml of all channels, NULL if none was found
+ *
+ * @note Each channel is requested once from the STATIONSERVICE of its data
+ *    center, over the union of its time windows, so a request split into
+ *    many chunks or events costs a single request per data center.  Data
+ *    centers are requested all at once and the results are merged
+ *
+ * @warning User owns the xml and is responsible for freeing it with xml_free()
+ */
+xml *
+data_request_station_xml(data_request *fdr, int verbose) {
+    xml *x = NULL;
+    char **keys = NULL;
+    result **res = NULL;
+    fern_loop *loop = NULL;
+    dict *by_url = NULL, *index = NULL;
+    if(!fdr) {
+        return NULL;
+    }
+    by_url = dict_new();
+    index = dict_new();
+    for(size_t i = 0; i < xarray_length(fdr->reqs); i++) {
+        breq_fast *r = fdr->reqs[i];
+        breq_fast *q = NULL;
+        char *st_url = (r->urls) ? dict_get(r->urls, "STATIONSERVICE") : NULL;
+        if(!st_url || strlen(st_url) == 0) {
+            continue;
+        }
+        if(!(q = dict_get(by_url, st_url))) {
+            q = breq_fast_new();
+            dict_put(by_url, st_url, q);
+        }
+        for(size_t j = 0; j < r->nlines; j++) {
+            char key[2048] = {0};
+            size_t *k = NULL;
+            breq_fast_line *x = &r->lines[j];
+            snprintf(key, sizeof(key), "%s %s.%s.%s.%s", st_url, x->net, x->sta, x->loc, x->cha);
+            if(!(k = dict_get(index, key))) {
+                k = calloc(1, sizeof(size_t));
+                *k = q->nlines;
+                dict_put(index, key, k);
+                breq_fast_append(q, x);
+                continue;
+            }
+            if(timespec64_cmp(&x->t1, &q->lines[*k].t1) < 0) {
+                q->lines[*k].t1 = x->t1;
+            }
+            if(timespec64_cmp(&x->t2, &q->lines[*k].t2) > 0) {
+                q->lines[*k].t2 = x->t2;
+            }
+        }
+    }
+    loop = fern_loop_new();
+    fern_loop_set_max_transfers(loop, fdr->max_transfers);
+    res = xarray_new('p');
+    keys = dict_keys(by_url);
+    for(size_t i = 0; keys && keys[i]; i++) {
+        int end_slash = keys[i][strlen(keys[i])-1] == '/';
+        char *url = NULL;
+        request *sr = request_new();
+        fern_asprintf(&url, "%s%squery", keys[i], (!end_slash) ? "/" : "");
+        request_set_url(sr, url);
+        request_set_verbose(sr, verbose);
+        fern_loop_add_lines(loop, sr, breq_fast_channel_post_line,
+                            dict_get(by_url, keys[i]), NULL,
+                            data_request_station_done, &res);
+        REQUEST_FREE(sr);
+        FREE(url);
+    }
+    fern_loop_run(loop);
+    fern_loop_free(loop);
+    for(size_t i = 0; i < xarray_length(res); i++) {
+        xml *xi = NULL;
+        if(result_is_ok(res[i]) && (xi = xml_new(result_data(res[i]), result_len(res[i])))) {
+            if(!x) {
+                x = xi;
+            } else {
+                xml_merge(x, xi, "//s:Network");
+                xml_free(xi);
+            }
+        }
+        RESULT_FREE(res[i]);
+    }
+    xarray_free(res);
+    dict_keys_free(keys);
+    dict_free(by_url, breq_fast_free_void);
+    dict_free(index, free);
+    return x;
+}
+
+/**
+ * @brief Get the sample rates of the channels in a data request
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr      data request list
+ * @param      x        station xml of the channels, see data_request_station_xml()
+ * @param      verbose  be verbose
+ *
+ * @return     number of channels with metadata
+ *
+ * @note Size estimates then use the actual sample rates, see
+ *    chunk_size_set_sample_rate().  Call before data_request_chunks().  The
+ *    station xml is not freed and can be used to fill sac meta data later
+ */
+size_t
+data_request_sample_rates(data_request *fdr, xml *x, int verbose) {
+    size_t n = 0;
+    station **s = NULL;
+    if(fdr && x && (s = channel_xml_parse(x, FALSE))) {
+        chunk_size_add_channels(s);
+        n = xarray_length(s);
+        xarray_free_items(s, (void (*)(void *)) station_free);
+        xarray_free(s);
+    }
+    if(verbose) {
+        printf("Sample rates: %zu channels from station metadata\n", n);
+    }
+    return n;
+}
+
+/**
+ * @brief Split a data request list into chunks
+ *
+ * @memberof   data_request
+ * @ingroup    data
+ *
+ * @param      fdr   data request list to split
+ * @param      max   maximum size of chunk
+ *
+ * @note Lines are kept as they are, overlapping and duplicate lines can be
+ *    merged before with data_request_coalesce().  Lines larger than max are
+ *    split in time on day or hour boundaries, see data_request_set_split()
+ */
+void
+data_request_chunks(data_request *fdr, size_t max) {
+    size_t mem = 0, mem1 = 0;
+    size_t i, j;
+    size_t n = xarray_length(fdr->reqs);
+    breq_fast *r = NULL;
+    breq_fast *fr = NULL;
+    breq_fast **tsplit = NULL;
+    breq_fast_line x;
+    breq_fast **new = xarray_new('p');
+    for(i = 0; i < n; i++) {
+        r = fdr->reqs[i];
+        fr = breq_fast_new();
+        breq_fast_copy_urls(fr, r);
+        mem = 0;
+        for(j = 0; j < r->nlines; j++) {
+            x = r->lines[j];
+            mem1 = breq_fast_line_size(&x);
+            if(mem1 > max) {
                 FR_APPEND(fr, new, r, mem);
                 //printf("Splitting by time: mem: %zu max: %zu\n", mem1, max);
                 // Need to split the request by time, rather than lines
-                tsplit = breq_fast_time_split(&x, r, mem1, max);
+                tsplit = breq_fast_time_split(&x, r, mem1, max, fdr->split);
                 FR_EXTEND(tsplit, new);
             } else {
                 // Append to Current Request
-                fr->lines = xarray_append(fr->lines, strdup(line));
+                breq_fast_append(fr, &x);
                 mem += mem1;
                 // Make a new Request if current one is too bug
                 if(mem > max) {
@@ -1016,8 +3514,10 @@ data_request_chunks(data_request *fdr, size_t max) {
                 }
             }
         }
-        if(xarray_length(fr->lines) > 0) {
+        if(fr->nlines > 0) {
             new = xarray_append(new, fr);
+        } else {
+            breq_fast_free(fr);
         }
     }
     xarray_free_items(fdr->reqs, breq_fast_free_void);
@@ -1036,15 +3536,37 @@ data_request_chunks(data_request *fdr, size_t max) {
  * @param      fdr       data request
  * @param      filename file to write to
  *
+ * @return     1 on success, 0 on error
+ *
+ * @note The file is written to filename.tmp and renamed, so an interrupted
+ *    write leaves the previous file in place
  */
-void
+int
 data_request_write_to_file(data_request *fdr, char *filename) {
     FILE *fp = NULL;
-    if(!(fp = fopen(filename, "w"))) {
-        return ;
+    char tmp[2048] = {0};
+    if(!filename || strlen(filename) == 0) {
+        return 0;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    if(!(fp = fopen(tmp, "w"))) {
+        printf("Error writing data request: %s: %s\n", tmp, strerror(errno));
+        return 0;
     }
     data_request_write(fdr, fp);
+    if(fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        printf("Error writing data request: %s: %s\n", tmp, strerror(errno));
+        fclose(fp);
+        unlink(tmp);
+        return 0;
+    }
     fclose(fp);
+    if(rename(tmp, filename) != 0) {
+        printf("Error writing data request: %s: %s\n", filename, strerror(errno));
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
 }
 /**
  * @brief Write / print a data request_list
@@ -1087,10 +3609,12 @@ data_request_write(data_request *fdr, FILE *fp) {
             }
             for(j = 0; keys[j]; j++) { FREE(keys[j]); } FREE(keys);
         }
-        m = xarray_length(r->lines);
+        m = r->nlines;
         for(j = 0; j < m; j++) {
+            char line[256] = {0};
+            breq_fast_line_format_to(&r->lines[j], line, sizeof(line));
             COMMENT(r,fp);
-            fprintf(fp, "%s\n", r->lines[j]);
+            fprintf(fp, "%s\n", line);
         }
         fprintf(fp, "\n");
     }
@@ -1242,18 +3766,15 @@ breq_fast_line_parse(char *line, breq_fast_line *x) {
  *
  * @return estimated size of request in bytes
  *
- * @note Assumptions:
- *    - 4 bytes per data point (floating point)
- *    - approximate samples per second from channel
+ * @note Sample rates come from channel metadata if known, otherwise from the
+ *    band code, and bytes per sample are learned from earlier downloads, see
+ *    chunk_size_estimate()
  *
  */
 size_t
 breq_fast_line_size(breq_fast_line *x) {
-    double sps   = 0.0;
-    int64_t sec = 0.0;
-    sec = x->t2.tv_sec - x->t1.tv_sec;
-    sps = band_to_sps(x->cha[0]);
-    return (size_t) ceil(sps * sec) * sizeof(float);
+    int64_t sec = x->t2.tv_sec - x->t1.tv_sec;
+    return chunk_size_estimate(x->net, x->sta, x->loc, x->cha, sec);
 }
 /**
  * @brief Format a data request line
@@ -1268,12 +3789,35 @@ breq_fast_line_size(breq_fast_line *x) {
  */
 char *
 breq_fast_line_format(breq_fast_line *x) {
+    char tmp[256] = {0};
+    breq_fast_line_format_to(x, tmp, sizeof(tmp));
+    return strdup(tmp);
+}
+
+/**
+ * @brief Format a data request line into a buffer
+ *
+ * @memberof   breq_fast_line
+ * @ingroup    data
+ * @private
+ *
+ * @param      x    data request line
+ * @param      dst  output buffer
+ * @param      n    length of dst
+ *
+ * @return     length of the formatted line, truncated to fit in dst
+ */
+static size_t
+breq_fast_line_format_to(breq_fast_line *x, char *dst, size_t n) {
+    int k = 0;
     char tmp1[64] = {0}, tmp2[64] = {0};
-    char *newline = NULL;
     strftime64t(tmp1, sizeof(tmp1), "%FT%T.%3f", &x->t1);
     strftime64t(tmp2, sizeof(tmp2), "%FT%T.%3f", &x->t2);
-    fern_asprintf(&newline, "%s %s %s %s %s %s",
-             x->net, x->sta, x->loc, x->cha, tmp1, tmp2);
-    return newline;
+    k = snprintf(dst, n, "%s %s %s %s %s %s",
+                 x->net, x->sta, x->loc, x->cha, tmp1, tmp2);
+    if(k < 0) {
+        return 0;
+    }
+    return ((size_t) k < n) ? (size_t) k : n - 1;
 }
 
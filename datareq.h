@@ -12,6 +12,8 @@
 
 #include "request.h"
 #include "chash.h"
+#include "archive.h"
+#include "xml.h"
 
 
 typedef enum Quality Quality;
@@ -36,8 +38,34 @@ enum Quality {
     QualityAll      = 9, /**< All  '*' */
 };
 
+typedef enum SplitAlign SplitAlign;
+/**
+ * @brief Alignment of time splits of oversized request lines
+ * @public
+ *
+ * @memberof data_request
+ * @ingroup data
+ */
+enum SplitAlign {
+    SplitNone = 0, /**< Equal slices at arbitrary seconds @ingroup data */
+    SplitHour = 1, /**< Slices start and end on UTC hours */
+    SplitDay  = 2, /**< Slices start and end on UTC days, hours if a day is too large */
+};
+
 typedef struct data_request data_request;
 
+/**
+ * Function called with each channel of a data request once it is downloaded,
+ * see data_request_set_trace_func()
+ */
+typedef void (*data_request_trace_func)(fern_loop *loop, MS3TraceID *t, void *data);
+
+/**
+ * Function returning the bytes held by the user data of the trace function,
+ * see data_request_set_memory_func()
+ */
+typedef size_t (*data_request_memory_func)(void *data);
+
 
 // Data Requests
 request *data_avail_new();
@@ -55,16 +83,42 @@ void     data_avail_set_radius(request *r, double minr, double maxr);
 void     data_avail_set_region(request *r, double minlon, double maxlon,
                              double minlat, double maxlat);
 
+data_request * data_request_new();
 data_request * data_request_parse(char *data);
 void           data_request_chunks(data_request *fdr, size_t max);
+size_t         data_request_sample_rates(data_request *fdr, xml *x, int verbose);
+xml *          data_request_station_xml(data_request *fdr, int verbose);
+size_t         data_request_coalesce(data_request *fdr, double tolerance);
+void           data_request_merge(data_request *dst, data_request *src);
+int            data_request_selects(data_request *fdr, char *sid);
+size_t         data_request_subtract_archive(data_request *fdr, archive *a);
+size_t         data_request_dedupe(data_request *fdr);
+size_t         data_request_shard(data_request *fdr, int i, int n);
+void           data_request_shard_name(char *filename, int i, int n,
+                                       char *out, size_t len);
+size_t         data_request_merge_shards(data_request *fdr, char *filename,
+                                         int n);
 void           data_request_write(data_request *fdr, FILE *fp);
 MS3TraceList * data_request_download(data_request *fdr,
                                                char *filename,
                                                char *prefix,
                                                int to_mseed,
                                                int to_sac);
-void           data_request_write_to_file(data_request *fdr,
+int            data_request_write_to_file(data_request *fdr,
                                           char *filename);
+void           data_request_set_concurrency(data_request *fdr,
+                                            int total,
+                                            int per_datacenter);
+void           data_request_set_split(data_request *fdr, SplitAlign align);
+void           data_request_set_sds(data_request *fdr, char *dir);
+void           data_request_set_prefer(data_request *fdr, char *list);
+void           data_request_set_claim(data_request *fdr, int64_t lease);
+void           data_request_set_trace_func(data_request *fdr,
+                                           data_request_trace_func fn,
+                                           void *data);
+void           data_request_set_memory(data_request *fdr, size_t bytes);
+void           data_request_set_memory_func(data_request *fdr,
+                                            data_request_memory_func fn);
 
 void           data_request_free(data_request *r);
 
@@ -26,6 +26,7 @@
 #include "defs.h"
 #include "strip.h"
 #include "urls.h"
+#include "slurp.h"
 
 Event **quake_xml_parse(char *data, size_t data_len, int verbose, char *cat);
 
@@ -193,6 +194,68 @@ events_write_to_file(Event **ev, char *file) {
     return 1;
 }
 
+/**
+ * Read events written by events_write()
+ *
+ * @memberof Event
+ * @ingroup events
+ *
+ * @param file  file to read, e.g. the output of fern -E
+ *
+ * @return events in an \ref xarray, NULL if the file cannot be read
+ *
+ * @note Lines are origin, latitude, longitude, depth, magnitude, an optional
+ *    magnitude type, author/magnitude author, catalog and event id.  The
+ *    header and lines that do not start with a time are skipped
+ *
+ * @warning User owns the events and is responsible for freeing them
+ */
+Event **
+events_read(char *file) {
+    size_t n = 0;
+    char *data = NULL, *p = NULL, *line = NULL;
+    Event **ev = NULL;
+    if(!(data = slurp(file, &n))) {
+        return NULL;
+    }
+    ev = xarray_new('p');
+    p = data;
+    while((line = strsep(&p, "\n")) != NULL) {
+        char *tok[16] = {0};
+        char *q = NULL, *w = NULL;
+        size_t k = 0;
+        timespec64 t = {0,0};
+        Event *e = NULL;
+        while(k < 16 && (w = strsep(&line, " \t")) != NULL) {
+            if(*w) {
+                tok[k++] = w;
+            }
+        }
+        if(k < 8 || k > 9 || !timespec64_parse(tok[0], &t)) {
+            continue;
+        }
+        e = event_new();
+        event_set_time(e, &t);
+        event_set_latitude(e, atof(tok[1]));
+        event_set_longitude(e, atof(tok[2]));
+        event_set_depth(e, atof(tok[3]));
+        event_set_mag(e, atof(tok[4]));
+        if(k == 9) {
+            event_set_magtype(e, tok[5]);
+        }
+        if((q = strchr(tok[k-3], '/'))) {
+            *q = 0;
+            event_set_magauthor(e, q + 1);
+        }
+        event_set_author(e, tok[k-3]);
+        event_set_catalog(e, tok[k-2]);
+        event_set_id(e, tok[k-1]);
+        ev = xarray_append(ev, e);
+    }
+    FREE(data);
+    return ev;
+}
+
 /**
  * Free an event
  *
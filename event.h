@@ -18,6 +18,7 @@ void       event_free(Event *e);
 void       event_print(Event *e, FILE *fp);
 void       events_write(Event **ev, FILE *fp);
 int        events_write_to_file(Event **ev, char *file);
+Event   ** events_read(char *file);
 char     * event_id(Event *e);
 timespec64 event_time(Event *e);
 double     event_lat(Event *e);
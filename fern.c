@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <unistd.h>
 
 #include <sacio/timespec.h>
 #include <libmseed/libmseed.h>
@@ -47,10 +48,30 @@ usage(char *prog) {
            "       -y --epochs \n"
            "       -w --show-time \n"
            "       -e --event catalog:eventid \n"
+           "       -b --events file of events, as written by -E, to request data for together \n"
            "       -d --duration duration \n"
            "       -M --max size of miniseed download in MB [200] \n"
+           "       -a --archive directory or file of miniseed already downloaded, only missing data is requested, may be repeated \n"
+           "       -A --align day | hour | none boundaries of requests split in time [day] \n"
+           "       -P --prefer list,of,datacenters for data available from more than one, all to keep duplicates [fastest] \n"
+           "       -Q --coalesce seconds merge request lines of a channel at most seconds apart, off to keep lines as they are [1] \n"
+           "       -Z --sizes file of miniseed sizes learned from downloads [~/.fern_chunk_sizes] \n"
+           "       -j --jobs number of concurrent downloads [4] \n"
+           "       -J --jobs-per-datacenter number of concurrent downloads per data center [2] \n"
+           "       -H --shard i/N download only shard i of N of the request lines, divided by network.station, requires -i \n"
+           "       -G --merge-shards N combine the progress of N shards into the request file \n"
+           "       -U --memory MB of samples held while converting to sac, new downloads wait above it [unlimited] \n"
+           "       -K --claim seconds share the request file with other fern processes, claims expire after seconds without progress \n"
+           "       -C --cache directory to cache event, station and catalog responses in \n"
+           "       -T --retries number of retries of failed requests [3] \n"
+           "       -L --rate maximum requests per second to a single host [unlimited] \n"
+           "       -N --net-log file to log each request and its timing to, as JSON lines \n"
+           "       -B --bandwidth maximum download rate of all transfers in MB/s [unlimited] \n"
+           "       -W --weight datacenter=weight share of the bandwidth, may be repeated [1] \n"
+           "       -F --bandwidth-file file to share the bandwidth with other processes, e.g. /dev/shm/fern \n"
            "       -O --origin lon/lat \n"
            "       -p --prefix prefix_for_miniseed_file \n"
+           "       -X --sds directory of an SDS archive to write miniseed into, instead of a file per request \n"
            "       -i --input input_request_files \n"
            "       -o --output output_request_file \n"
            "       -v --verbose \n"
@@ -85,10 +106,25 @@ main(int argc, char *argv[]) {
     timespec64 t1, t2;
     data_request *fdr = NULL;
     char prefix[1024] = {0};
+    char sds[1024] = {0};
     char request_file[2048] = {0};
+    char events_file[2048] = {0};
+    char batch_file[2048] = {0};
+    event_batch *batch = NULL;
     char output[2048] = {0};
     char cat[16] = {0};
     size_t chunk_size = 200 * 1024 * 1024 ; // Request size in MB
+    int jobs = 4;
+    int jobs_per_dc = 2;
+    int64_t claim = 0;
+    int shard = 0, nshards = 0, merge_shards = 0;
+    double memory = 0.0;
+    char shard_file[2048] = {0};
+    SplitAlign split = SplitDay;
+    char *prefer = NULL;
+    double coalesce = 1.0;
+    archive *local = NULL;
+    xml *meta = NULL;
     fern_strlcat(prefix, "fdsnws", sizeof(prefix));
 
 
@@ -108,10 +144,30 @@ main(int argc, char *argv[]) {
         {"epochs",          no_argument, NULL, 'y'},
         {"show-time",       no_argument, NULL, 'w'},
         {"event",     required_argument, NULL, 'e'},
+        {"events",    required_argument, NULL, 'b'},
         {"duration",  required_argument, NULL, 'd'},
         {"max",       required_argument, NULL, 'M'},
+        {"archive",   required_argument, NULL, 'a'},
+        {"align",     required_argument, NULL, 'A'},
+        {"prefer",    required_argument, NULL, 'P'},
+        {"coalesce",  required_argument, NULL, 'Q'},
+        {"sizes",     required_argument, NULL, 'Z'},
+        {"jobs",      required_argument, NULL, 'j'},
+        {"jobs-per-datacenter", required_argument, NULL, 'J'},
+        {"claim",     required_argument, NULL, 'K'},
+        {"shard",     required_argument, NULL, 'H'},
+        {"merge-shards", required_argument, NULL, 'G'},
+        {"memory",    required_argument, NULL, 'U'},
+        {"cache",     required_argument, NULL, 'C'},
+        {"retries",   required_argument, NULL, 'T'},
+        {"rate",      required_argument, NULL, 'L'},
+        {"net-log",   required_argument, NULL, 'N'},
+        {"bandwidth", required_argument, NULL, 'B'},
+        {"weight",    required_argument, NULL, 'W'},
+        {"bandwidth-file", required_argument, NULL, 'F'},
         {"origin",    required_argument, NULL, 'O'},
         {"prefix",    required_argument, NULL, 'p'},
+        {"sds",       required_argument, NULL, 'X'},
         {"input",     required_argument, NULL, 'i'},
         {"output",    required_argument, NULL, 'o'},
         {"quiet",           no_argument, NULL, 'q'},
@@ -120,7 +176,7 @@ main(int argc, char *argv[]) {
     };
     r = request_new();
 
-    while((ch = getopt_long(argc, argv, "ESD:m:t:R:r:z:vn:s:l:c:e:d:M:O:ywp:i:o:", longopts, NULL)) != -1) {
+    while((ch = getopt_long(argc, argv, "ESD:m:t:R:r:z:vn:s:l:c:e:b:d:M:a:A:P:Q:Z:j:J:K:H:G:U:C:T:L:N:B:W:F:O:ywp:X:i:o:", longopts, NULL)) != -1) {
         switch(ch) {
         case 'v':
             request_set_verbose(r, 1);
@@ -159,6 +215,9 @@ main(int argc, char *argv[]) {
                 error(argv[1],"error: expected event id, got %s\n", optarg);
             }
             break;
+        case 'b':
+            fern_strlcpy(events_file, optarg, sizeof(events_file));
+            break;
         case 'r':
             sscanf(optarg, "%lf/%lf", &v1, &v2);
             request_set_arg(r, "minradius", arg_double_new(v1));
@@ -186,9 +245,115 @@ main(int argc, char *argv[]) {
         case 'p':
             fern_strlcpy(prefix, optarg, sizeof(prefix));
             break;
+        case 'X':
+            fern_strlcpy(sds, optarg, sizeof(sds));
+            break;
         case 'M':
             chunk_size = (size_t)(atof(optarg) * 1024 * 1024);
             break;
+        case 'a':
+            if(!local) {
+                local = archive_new();
+            }
+            if(!archive_add(local, optarg)) {
+                exit(-1);
+            }
+            break;
+        case 'A':
+            if(strcmp(optarg, "day") == 0) {
+                split = SplitDay;
+            } else if(strcmp(optarg, "hour") == 0) {
+                split = SplitHour;
+            } else if(strcmp(optarg, "none") == 0) {
+                split = SplitNone;
+            } else {
+                error(argv[1], "error: expected alignment day, hour or none, found %s\n", optarg);
+            }
+            break;
+        case 'P':
+            prefer = optarg;
+            break;
+        case 'Q':
+            if(strcmp(optarg, "off") == 0) {
+                coalesce = -1.0;
+            } else if(sscanf(optarg, "%lf", &coalesce) != 1 || coalesce < 0.0) {
+                error(argv[1], "error: expected seconds >= 0 or off, found %s\n", optarg);
+            }
+            break;
+        case 'Z':
+            chunk_size_set_file(optarg);
+            break;
+        case 'j':
+            if((jobs = atoi(optarg)) < 1) {
+                error(argv[1], "error: expected number of jobs > 0, found %s\n", optarg);
+            }
+            break;
+        case 'J':
+            if((jobs_per_dc = atoi(optarg)) < 1) {
+                error(argv[1], "error: expected number of jobs > 0, found %s\n", optarg);
+            }
+            break;
+        case 'H':
+            if(sscanf(optarg, "%d/%d", &shard, &nshards) != 2 ||
+               nshards < 1 || shard < 1 || shard > nshards) {
+                error(argv[1], "error: expected shard i/N with 1 <= i <= N, found %s\n", optarg);
+            }
+            break;
+        case 'G':
+            if((merge_shards = atoi(optarg)) < 1) {
+                error(argv[1], "error: expected number of shards > 0, found %s\n", optarg);
+            }
+            break;
+        case 'U':
+            if((memory = atof(optarg)) <= 0) {
+                error(argv[1], "error: expected memory in MB > 0, found %s\n", optarg);
+            }
+            break;
+        case 'K':
+            if((claim = atoll(optarg)) < 1) {
+                error(argv[1], "error: expected claim lease in seconds > 0, found %s\n", optarg);
+            }
+            break;
+        case 'C':
+            cache_set_dir(optarg);
+            break;
+        case 'T':
+            if((v1 = atof(optarg)) < 0) {
+                error(argv[1], "error: expected number of retries >= 0, found %s\n", optarg);
+            }
+            request_set_retry((int) v1, 1.0, 60.0);
+            break;
+        case 'L':
+            if((v1 = atof(optarg)) <= 0) {
+                error(argv[1], "error: expected request rate > 0, found %s\n", optarg);
+            }
+            request_set_rate_limit(v1, 1);
+            break;
+        case 'N':
+            if(!request_set_log(optarg)) {
+                error(argv[1], "error: cannot open request log %s\n", optarg);
+            }
+            break;
+        case 'B':
+            if((v1 = atof(optarg)) <= 0) {
+                error(argv[1], "error: expected bandwidth > 0, found %s\n", optarg);
+            }
+            request_set_bandwidth(v1 * 1024 * 1024);
+            break;
+        case 'W': {
+            char *eq = strchr(optarg, '=');
+            if(!eq || eq == optarg || (v1 = atof(eq + 1)) <= 0) {
+                error(argv[1], "error: expected datacenter=weight > 0, found %s\n", optarg);
+            }
+            *eq = 0;
+            request_set_bandwidth_weight(optarg, v1);
+            break;
+        }
+        case 'F':
+            if(!request_set_bandwidth_shared(optarg)) {
+                error(argv[1], "error: cannot share bandwidth through %s\n", optarg);
+            }
+            break;
         case 'n':
             request_set_arg(r, "net", arg_string_new(optarg));
             break;
@@ -251,6 +416,10 @@ main(int argc, char *argv[]) {
     if(act == ActionNone) {
         error(argv[1],"Error: Must specify a type of request\n");
     }
+    if(nshards > 0 && strlen(request_file) == 0) {
+        // Every process must divide the same request lines
+        error(argv[1], "error: --shard requires a request file from --input\n");
+    }
     if(act & ActionEvent && e) {
         duration d = {0,0};
         timespec64 t1 = {0,0}, t2 = {0,0};
@@ -276,10 +445,27 @@ main(int argc, char *argv[]) {
     if(act & ActionRequest && dur.type != Duration_None) {
         data_avail_use_duration(r, &dur);
     }
+    if(strlen(events_file) > 0) {
+        if(!(act & ActionRequest) || dur.type == Duration_None) {
+            error(argv[1], "error: --events requires --data-query and --duration\n");
+        }
+        if(!(ev = events_read(events_file)) || xarray_length(ev) == 0) {
+            error(argv[1], "error: no events found in %s\n", events_file);
+        }
+        if(memory > 0) {
+            error(argv[1], "error: --memory cannot be used with --events, each event's sac files are cut once all data is downloaded\n");
+        }
+        batch = event_batch_new(r, ev, &dur);
+        snprintf(batch_file, sizeof(batch_file), "%s.request", events_file);
+    }
     //
     // Request
     //
-    if(strlen(request_file) == 0) {
+    if(batch && strlen(request_file) == 0) {
+        if(!event_batch_query(batch, jobs)) {
+            printf("Warning: data availability is missing for some events\n");
+        }
+    } else if(strlen(request_file) == 0) {
         res = request_get(r);
         if(!result_is_ok(res)) {
             printf("%s\n", result_error_msg(res));
@@ -307,7 +493,34 @@ main(int argc, char *argv[]) {
     // Create Request using Data Request List
     if(act & ActionRequest) {
         if(strlen(request_file) == 0) {
-            fdr = data_request_parse(result_data(res));
+            fdr = (batch) ? event_batch_data_request(batch) : data_request_parse(result_data(res));
+            if(!prefer || strcmp(prefer, "all") != 0) {
+                data_request_set_prefer(fdr, prefer);
+                size_t n = data_request_dedupe(fdr);
+                if(verbose) {
+                    printf("Duplicates: %zu request lines reduced\n", n);
+                }
+            }
+            if(local) {
+                size_t n = data_request_subtract_archive(fdr, local);
+                if(verbose) {
+                    printf("Archive: %zu files, %zu records, %zu request lines reduced\n",
+                           archive_files(local), archive_records(local), n);
+                }
+            }
+            if(coalesce >= 0.0) {
+                size_t n = data_request_coalesce(fdr, coalesce);
+                if(verbose) {
+                    printf("Coalesce: %zu request lines merged\n", n);
+                }
+            }
+            // Size chunks with the actual sample rates of the channels,
+            //   only needed when the chunks are downloaded
+            if((act & ActionMiniseed || act & ActionSac) && merge_shards == 0) {
+                meta = data_request_station_xml(fdr, verbose);
+                data_request_sample_rates(fdr, meta, verbose);
+            }
+            data_request_set_split(fdr, split);
             data_request_chunks(fdr, (size_t) chunk_size);
             if(ActionAvailable || verbose) {
                 data_request_write(fdr, stdout);
@@ -324,34 +537,104 @@ main(int argc, char *argv[]) {
         if(strlen(output) > 0) {
             data_request_write_to_file(fdr, output);
         }
+        if(merge_shards > 0) {
+            char *canonical = (strlen(output) > 0) ? output : request_file;
+            size_t n = 0;
+            if(strlen(canonical) == 0) {
+                error(argv[1], "error: --merge-shards requires --input or --output\n");
+            }
+            if(!(n = data_request_merge_shards(fdr, canonical, merge_shards))) {
+                exit(-1);
+            }
+            printf("Merged %zu of %d shards into %s\n", n, merge_shards, canonical);
+            request_cleanup();
+            return 0;
+        }
     }
     if(act & ActionMiniseed || act & ActionSac) {
         MS3TraceList *mst3k = NULL;
+        sac_pipeline *pipe = NULL;
         char *filename = NULL;
         if(strlen(output) > 0) {
             filename = output;
         } else if(strlen(request_file) > 0) {
             filename = request_file;
+        } else if(batch) {
+            filename = batch_file;
         } else {
             filename = result_filename(res);
         }
+        if(nshards > 0) {
+            // Progress of the shard is kept in its own request file
+            size_t n = 0;
+            char *data = NULL;
+            data_request_shard_name(filename, shard, nshards, shard_file, sizeof(shard_file));
+            if(access(shard_file, F_OK) == 0 && (data = slurp(shard_file, &n))) {
+                data_request_free(fdr);
+                fdr = data_request_parse(data);
+                FREE(data);
+            } else {
+                n = data_request_shard(fdr, shard, nshards);
+                data_request_write_to_file(fdr, shard_file);
+                if(verbose) {
+                    printf("Shard %d/%d: %zu request lines\n", shard, nshards, n);
+                }
+            }
+            filename = shard_file;
+        }
+        data_request_set_concurrency(fdr, jobs, jobs_per_dc);
+        data_request_set_claim(fdr, claim);
+        if(strlen(sds) > 0) {
+            data_request_set_sds(fdr, sds);
+        }
+        if(act & ActionSac && !batch) {
+            // Write each channel while the remaining data downloads
+            pipe = sac_pipeline_new(e, verbose);
+            data_request_set_trace_func(fdr, sac_pipeline_trace, pipe);
+            data_request_set_memory(fdr, (size_t) (memory * 1024 * 1024));
+            data_request_set_memory_func(fdr, sac_pipeline_memory);
+        }
         mst3k = data_request_download(fdr, filename, prefix,
                                            act == ActionMiniseed,
                                            act == ActionSac);
-        if(act & ActionSac && mst3k) {
+        if(act & ActionSac && mst3k && batch && !meta) {
+            // Station meta data of all events at once, unless already
+            //   requested for the sample rates
+            meta = data_request_station_xml(fdr, verbose);
+        }
+        for(size_t k = 0; act & ActionSac && mst3k && batch && k < event_batch_length(batch); k++) {
             int nerr = 0;
             char tmp[128] = {0};
-            sac **out;
-            out = miniseed_trace_list_to_sac(mst3k);
-            sac_array_fill_meta_data(out, verbose, FALSE);
-            sac_array_fill_meta_data_from_event(out, e, verbose);
+            sac **out = NULL;
+            if(!(out = event_batch_sac(batch, mst3k, k, verbose))) {
+                continue;
+            }
+            if(meta) {
+                sac_fill_meta_data_from_xml(out, meta, verbose);
+            } else {
+                sac_array_fill_meta_data(out, verbose, FALSE);
+            }
             for(size_t i = 0; i < xarray_length(out); i++) {
                 update_distaz(out[i]);
                 cprintf("green", "\tWriting data to %s [%s]\n",
                         out[i]->m->filename, data_size((int64_t) sac_size(out[i]),tmp,sizeof(tmp)));
                 sac_write(out[i], out[i]->m->filename, &nerr);
+                sac_free(out[i]);
+            }
+            xarray_free(out);
+        }
+        if(pipe) {
+            printf("Wrote %zu sac files\n", sac_pipeline_written(pipe));
+            sac_pipeline_free(pipe);
+            if(mst3k) {
+                // Channels were written as they completed, no samples remain
+                mstl3_free(&mst3k, 0);
             }
         }
     }
+    xml_free(meta);
+    archive_free(local);
+    event_batch_free(batch);
+    request_cleanup();
     return 0;
 }
@@ -1,6 +1,9 @@
 
 #include "array.h"
 #include "request.h"
+#include "cache.h"
+#include "chunksize.h"
+#include "archive.h"
 #include "event.h"
 #include "station.h"
 #include "stationreq.h"
@@ -8,4 +11,8 @@
 #include "datareq.h"
 #include "meta.h"
 #include "miniseed_sac.h"
+#include "sds.h"
+#include "batch.h"
+#include "claim.h"
+#include "pipeline.h"
 #include "cprint.h"
@@ -380,11 +380,10 @@ sac_matches_time(timespec64 *sb, timespec64 *se, meta_data *m) {
  *
  * @memberof meta_data
  * @ingroup  meta
- * @private
  *
  * @param files    sac files, must be wrapped in an \ref xarray
- * @param data     xml meta data
- * @param ndata    length of data
+ * @param x        station xml meta data, level = channel, e.g. from
+ *                 data_request_station_xml()
  * @param verbose  be verbose while parsing and setting
  *
  * @return 1 on success, 0 on error
@@ -723,6 +722,60 @@ xml_merge_results(result *r1, result *r2, char *path) {
     return x1;
 }
 
+/**
+ * @brief Format a line of a station request for a collection of sac files
+ *
+ * @memberof meta_data
+ * @ingroup  meta
+ * @private
+ *
+ * @param data   sac files to request, enclosed in a \ref xarray
+ * @param i      line number, the first line sets the level
+ * @param buf    output buffer
+ * @param n      size of buf
+ *
+ * @return length of the line, -1 if there is no line i
+ *
+ * @note See \ref post_line_func
+ */
+static int
+sac_array_post_line(void *data, size_t i, char *buf, size_t n) {
+    sac **files = (sac **) data;
+    if(i == 0) {
+        return (int) fern_strlcpy(buf, "level=channel\n", n);
+    }
+    if(i - 1 >= xarray_length(files)) {
+        return -1;
+    }
+    sac_fmt(buf, n, "%R\n", files[i-1]);
+    return (int) strlen(buf);
+}
+
+/**
+ * @brief Select the sac files meta data can be requested for
+ *
+ * @memberof meta_data
+ * @ingroup  meta
+ * @private
+ *
+ * @param files    collection of sac files, must be enclosed in a \ref xarray
+ *
+ * @return sac files with a network, station and channel, enclosed in a
+ *    \ref xarray, the files are not copied
+ */
+static sac **
+sac_array_meta_want(sac **files) {
+    sac **want = xarray_new('p');
+    for(size_t i = 0; i < xarray_length(files); i++) {
+        if(! sac_hdr_defined(files[i], SAC_NET, SAC_STA, SAC_CHA, NULL) ) {
+            printf("Insufficient net,sta,cha,time to retrieve station meta data\n");
+            continue;
+        }
+        want = xarray_append(want, files[i]);
+    }
+    return want;
+}
+
 /**
  * @brief Fill meta data for a collection of sac files by request
  *
@@ -740,39 +793,24 @@ xml_merge_results(result *r1, result *r2, char *path) {
  */
 int
 sac_array_fill_meta_data(sac **files, int verbose, int ph5) {
-    sac *s = NULL;
     request *sm = NULL;
     result *r[2] = {NULL,NULL};
-    char *data = NULL;
-    size_t nalloc = 2048;
-    size_t n = 0;
-    char line[2048] = {0};
+    sac **want = NULL;
     xml *x = NULL;
 
-    // Station Meta Request Build
-    data = str_grow(data, &nalloc, n, strlen("level=channel\n"));
-    n = fern_strlcat(data, "level=channel\n", nalloc);
-    for(size_t i = 0; i < xarray_length(files); i++) {
-        s = files[i];
-        if(! sac_hdr_defined(s, SAC_NET, SAC_STA, SAC_CHA, NULL) ) {
-            printf("Insufficient net,sta,cha,time to retrieve station meta data\n");
-            continue;
-        }
-        sac_fmt(line, sizeof(line), "%R\n", s);
-        data = str_grow(data, &nalloc, n, strlen(line));
-        n = fern_strlcat(data, line, nalloc);
-    }
+    // Station Meta Request Build, lines are formatted as they are sent
+    want = sac_array_meta_want(files);
 
     // Request Station Meta Data
     sm = request_new();
     request_set_verbose(sm, verbose);
 
     request_set_url(sm, STATION_IRIS);
-    r[0] = request_post(sm, data);
+    r[0] = request_post_lines(sm, sac_array_post_line, want);
 
     if(ph5) {
         request_set_url(sm, STATION_IRIS_PH5);
-        r[1] = request_post(sm, data);
+        r[1] = request_post_lines(sm, sac_array_post_line, want);
     }
 
     if(!(x = xml_merge_results(r[0], r[1], "//s:Network"))) {
@@ -786,10 +824,92 @@ sac_array_fill_meta_data(sac **files, int verbose, int ph5) {
     RESULT_FREE(r[0]);
     RESULT_FREE(r[1]);
     REQUEST_FREE(sm);
-    FREE(data);
+    xarray_free(want);
     return 1;
 }
 
+/**
+ * @brief Meta data request in progress for a collection of sac files
+ * @ingroup meta
+ * @private
+ */
+typedef struct {
+    sac **files;            /**< @private sac files to fill */
+    sac **want;             /**< @private sac files requested, lines are formatted from these */
+    int verbose;            /**< @private be verbose when setting meta data */
+    sac_array_meta_func fn; /**< @private function called once meta data is filled */
+    void *data;             /**< @private user data passed to fn */
+} meta_fetch;
+
+/**
+ * @brief Fill meta data from a completed station request
+ *
+ * @memberof meta_data
+ * @ingroup  meta
+ * @private
+ *
+ * @param r     result of the station request
+ * @param data  request in progress, \ref meta_fetch
+ *
+ */
+static void
+sac_array_meta_done(result *r, void *data) {
+    xml *x = NULL;
+    meta_fetch *m = (meta_fetch *) data;
+    if((x = xml_merge_results(r, NULL, "//s:Network"))) {
+        sac_fill_meta_data_from_xml(m->files, x, m->verbose);
+        xml_free(x);
+    }
+    RESULT_FREE(r);
+    m->fn(m->files, m->data);
+    xarray_free(m->want);
+    FREE(m);
+}
+
+/**
+ * @brief Fill meta data for a collection of sac files by request, in a loop
+ *
+ * @memberof meta_data
+ * @ingroup  meta
+ *
+ * @param loop     loop the station request is made in
+ * @param files    collection of sac files, must be enclosed in a \ref xarray
+ * @param verbose  be verbose when setting meta data
+ * @param fn       function called with files once meta data is filled
+ * @param data     user data passed to fn
+ *
+ * @return 1 if the request was added, 0 on error, fn is called right away
+ *
+ * @note Same as sac_array_fill_meta_data(), without the ph5 web service.  The
+ *    request is made while the loop runs, alongside any other transfers.
+ *    files must remain valid until fn is called
+ */
+int
+sac_array_fill_meta_data_async(fern_loop *loop, sac **files, int verbose,
+                               sac_array_meta_func fn, void *data) {
+    int retval = 0;
+    request *sm = NULL;
+    meta_fetch *m = calloc(1, sizeof(meta_fetch));
+    m->files = files;
+    m->want = sac_array_meta_want(files);
+    m->verbose = verbose;
+    m->fn = fn;
+    m->data = data;
+
+    sm = request_new();
+    request_set_verbose(sm, verbose);
+    request_set_url(sm, STATION_IRIS);
+    if(!(retval = fern_loop_add_lines(loop, sm, sac_array_post_line, m->want,
+                                      "station", sac_array_meta_done, m))) {
+        printf("Error requesting station meta data\n");
+        fn(files, data);
+        xarray_free(m->want);
+        FREE(m);
+    }
+    REQUEST_FREE(sm);
+    return retval;
+}
+
 /**
  * @brief Fill meta data associated with an event in multiple sac file
  *
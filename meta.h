@@ -6,9 +6,20 @@
 #include <sacio/timespec.h>
 
 #include "event.h"
+#include "request.h"
+#include "xml.h"
+
+/**
+ * Function called with sac files once their meta data is filled, see
+ * sac_array_fill_meta_data_async()
+ */
+typedef void (*sac_array_meta_func)(sac **files, void *data);
 
 int  sac_array_fill_meta_data(sac **files, int verbose, int ph5);
+int  sac_array_fill_meta_data_async(fern_loop *loop, sac **files, int verbose,
+                                    sac_array_meta_func fn, void *data);
 void sac_array_fill_meta_data_from_event(sac **s, Event *ev, int verbose);
 void sac_array_fill_meta_data_from_file(sac **files, int verbose, char *file);
+int  sac_fill_meta_data_from_xml(sac **files, xml *x, int verbose);
 void sac_fill_meta_data_from_event(sac *s, Event *ev, int verbose);
 #endif /* _META_H_ */
@@ -1,5 +1,6 @@
 
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include <sacio/sacio.h>
@@ -8,6 +9,7 @@
 #include <libmseed/libmseed.h>
 
 #include "miniseed_sac.h"
+#include "request.h"
 #include "event.h"
 #include "array.h"
 #include "cprint.h"
@@ -84,6 +86,731 @@ read_miniseed_memory(MS3TraceList *mst3k, char *buffer, uint64_t len) {
     return retcode;
 }
 
+/**
+ * @brief Incremental miniseed decoder
+ * @ingroup miniseed
+ *
+ * @details Data is fed in as it arrives with mseed_stream_write(), complete
+ *          records are decoded into the Miniseed Trace List and a partial
+ *          record at the end is held until the rest of it arrives
+ *
+ * @code
+ *   mseed_stream *ms = mseed_stream_new(mst3k);
+ *   request_add_sink(r, mseed_stream_write, ms);
+ *   request_set_keep_data(r, 0);
+ *   res = request_post(r, post);
+ *   mseed_stream_finish(ms);
+ *   mseed_stream_free(ms);
+ * @endcode
+ */
+struct mseed_stream {
+    MS3TraceList *mst3k; /**< @private Miniseed Trace List to decode into */
+    char *buf;           /**< @private partial record carried between writes */
+    size_t n;            /**< @private length of buf in use */
+    size_t nalloc;       /**< @private allocated length of buf */
+    int64_t nrecords;    /**< @private number of records decoded */
+    uint32_t flags;      /**< @private libmseed parsing flags */
+    mseed_record_func fn; /**< @private function called with each record, may be NULL */
+    void *fn_data;       /**< @private user data passed to fn */
+    int keep;            /**< @private keep records rather than unpacking them */
+};
+
+/**
+ * @brief      Create a new incremental miniseed decoder
+ *
+ * @memberof   mseed_stream
+ * @ingroup    miniseed
+ *
+ * @param      mst3k   Miniseed Trace List to decode records into, NULL
+ *                     to only pass records to mseed_stream_set_record_func()
+ *
+ * @return     new decoder
+ *
+ * @warning    User owns the decoder and must free it with mseed_stream_free(),
+ *             the Miniseed Trace List is not owned by the decoder
+ */
+mseed_stream *
+mseed_stream_new(MS3TraceList *mst3k) {
+    mseed_stream *s = calloc(1, sizeof(mseed_stream));
+    s->mst3k  = mst3k;
+    s->buf    = NULL;
+    s->n      = 0;
+    s->nalloc = 0;
+    s->nrecords = 0;
+    s->flags  = MSF_SKIPNOTDATA | MSF_VALIDATECRC;
+    if(mst3k) {
+        s->flags |= MSF_UNPACKDATA;
+    }
+    return s;
+}
+
+/**
+ * @brief      Set a function called with each complete record
+ *
+ * @memberof   mseed_stream
+ * @ingroup    miniseed
+ *
+ * @param      s     decoder
+ * @param      fn    function called with each record, before it is added to
+ *                   the Miniseed Trace List
+ * @param      data  user data passed to fn
+ *
+ * @note If fn returns 0 the data is not accepted, see mseed_stream_write()
+ */
+void
+mseed_stream_set_record_func(mseed_stream *s, mseed_record_func fn, void *data) {
+    s->fn = fn;
+    s->fn_data = data;
+}
+
+/**
+ * @brief      Keep records in the Miniseed Trace List rather than their samples
+ *
+ * @memberof   mseed_stream
+ * @ingroup    miniseed
+ *
+ * @details    Records are not unpacked as they arrive.  A copy of each record
+ *             is kept in the record list of its segment, which holds the
+ *             number of samples but no samples.  The records are decoded
+ *             directly into the sac files by miniseed_trace_to_sac(), so
+ *             samples are never held in both their miniseed sample type
+ *             and as floats
+ *
+ * @param      s     decoder, with a Miniseed Trace List
+ *
+ * @warning    Kept records are not freed by mstl3_free(), release each trace
+ *             with miniseed_trace_release() first
+ */
+void
+mseed_stream_keep_records(mseed_stream *s) {
+    if(!s->mst3k) {
+        return;
+    }
+    s->keep = TRUE;
+    s->flags &= ~((uint32_t) MSF_UNPACKDATA);
+    s->flags |= MSF_RECORDLIST;
+}
+
+/**
+ * @brief      Free an incremental miniseed decoder
+ *
+ * @memberof   mseed_stream
+ * @ingroup    miniseed
+ *
+ * @param      s   decoder to free
+ *
+ */
+void
+mseed_stream_free(mseed_stream *s) {
+    if(s) {
+        FREE(s->buf);
+        FREE(s);
+    }
+}
+
+#define MSEED_RECORD_HEADER 8 /**< @private bytes ahead of a kept record holding its length */
+
+/**
+ * @brief      Copy a record to be kept in a record list
+ *
+ * @ingroup    miniseed
+ * @private
+ *
+ * @param      rec   record
+ * @param      len   length of the record
+ *
+ * @return     copy of the record, free with mseed_record_free()
+ *
+ * @note The length is stored ahead of the copy so it can be parsed again
+ */
+static char *
+mseed_record_copy(const char *rec, int32_t len) {
+    char *p = malloc(MSEED_RECORD_HEADER + (size_t) len);
+    memcpy(p, &len, sizeof(int32_t));
+    memcpy(p + MSEED_RECORD_HEADER, rec, (size_t) len);
+    return p + MSEED_RECORD_HEADER;
+}
+
+/**
+ * @brief      Length of a kept record
+ *
+ * @ingroup    miniseed
+ * @private
+ *
+ * @param      rec   record from mseed_record_copy()
+ *
+ * @return     length of the record
+ */
+static int32_t
+mseed_record_len(const char *rec) {
+    int32_t len = 0;
+    memcpy(&len, rec - MSEED_RECORD_HEADER, sizeof(int32_t));
+    return len;
+}
+
+/**
+ * @brief      Free a kept record
+ *
+ * @ingroup    miniseed
+ * @private
+ *
+ * @param      rec   record from mseed_record_copy(), may be NULL
+ *
+ */
+static void
+mseed_record_free(const char *rec) {
+    if(rec) {
+        free((char *) rec - MSEED_RECORD_HEADER);
+    }
+}
+
+/**
+ * @brief      Decode complete records from a buffer
+ *
+ * @memberof   mseed_stream
+ * @ingroup    miniseed
+ * @private
+ *
+ * @param      s     decoder
+ * @param      buf   buffer containing miniseed data
+ * @param      len   length of buf
+ * @param      ok    output, set to 0 if the record function failed
+ *
+ * @return     number of bytes used from buf, a partial record remains
+ */
+static size_t
+mseed_stream_parse(mseed_stream *s, char *buf, size_t len, int *ok) {
+    int8_t verbose = 0;
+    int retcode = 0;
+    size_t off = 0;
+    MS3Record *msr = NULL;
+    MS3Tolerance tolerance;
+    tolerance.time     = NULL; // time_tolerance_func;
+    tolerance.samprate = NULL; // samprate_tolerance_func;
+    while(len - off >= MINRECLEN) {
+        retcode = msr3_parse(buf + off, (uint64_t) (len - off), &msr, s->flags, verbose);
+        if(retcode > 0) {
+            // Partial record, wait for more data
+            break;
+        }
+        if(retcode < 0) {
+            if(retcode != MS_NOTSEED || !(s->flags & MSF_SKIPNOTDATA)) {
+                printf("Error reading from stream: %s\n", ms_errorstr(retcode));
+            }
+            off += 1;
+            continue;
+        }
+        if(s->fn && !s->fn(msr, s->fn_data)) {
+            *ok = 0;
+        }
+        if(s->mst3k && s->keep) {
+            MS3RecordPtr *rp = NULL;
+            if(mstl3_addmsr_recordptr(s->mst3k, msr, &rp, 0, 1, s->flags, &tolerance) && rp) {
+                rp->bufferptr = mseed_record_copy(buf + off, msr->reclen);
+            }
+        } else if(s->mst3k) {
+            mstl3_addmsr(s->mst3k, msr, 0, 1, s->flags, &tolerance);
+        }
+        off += (size_t) msr->reclen;
+        s->nrecords++;
+    }
+    msr3_free(&msr);
+    return off;
+}
+
+/**
+ * @brief      Feed miniseed data into an incremental decoder
+ *
+ * @memberof   mseed_stream
+ * @ingroup    miniseed
+ *
+ * @param      data   miniseed data, possibly starting or ending mid-record
+ * @param      n      length of data
+ * @param      p      decoder, \ref mseed_stream
+ *
+ * @return     n, all data is accepted, or 0 if the record function failed
+ *
+ * @note  Matches \ref request_sink so it can be attached to a request with
+ *        request_add_sink()
+ */
+size_t
+mseed_stream_write(char *data, size_t n, void *p) {
+    size_t off = 0;
+    int ok = 1;
+    mseed_stream *s = (mseed_stream *) p;
+    if(s->n == 0) {
+        // Decode directly from the incoming data, hold onto the remainder
+        off = mseed_stream_parse(s, data, n, &ok);
+        if(off < n) {
+            s->buf = str_grow(s->buf, &s->nalloc, 0, n - off);
+            memcpy(s->buf, data + off, n - off);
+            s->n = n - off;
+        }
+        return (ok) ? n : 0;
+    }
+    // Complete the partial record held from before
+    s->buf = str_grow(s->buf, &s->nalloc, s->n, n);
+    memcpy(s->buf + s->n, data, n);
+    s->n += n;
+    off = mseed_stream_parse(s, s->buf, s->n, &ok);
+    memmove(s->buf, s->buf + off, s->n - off);
+    s->n -= off;
+    return (ok) ? n : 0;
+}
+
+/**
+ * @brief      Finish decoding after all data has been fed in
+ *
+ * @memberof   mseed_stream
+ * @ingroup    miniseed
+ *
+ * @param      s   decoder
+ *
+ * @return     number of records decoded
+ *
+ * @note       A warning is shown if an incomplete record remains
+ */
+int64_t
+mseed_stream_finish(mseed_stream *s) {
+    if(s->n > 0) {
+        printf(" WARNING: Discarding %zu bytes of incomplete miniseed data\n", s->n);
+        s->n = 0;
+    }
+    return s->nrecords;
+}
+
+#define MSEED_SCAN_BLOCK 1048576 /**< @private bytes read at a time by mseed_file_records() */
+
+/**
+ * @brief      Parse each record of a possibly incomplete miniseed file
+ *
+ * @ingroup    miniseed
+ *
+ * @details    Records are parsed, but not unpacked, and passed to a
+ *             function.  Bytes that are not part of a record are skipped
+ *
+ * @param      file   miniseed file to parse
+ * @param      fn     function called with each record, may be NULL
+ * @param      data   user data passed to fn
+ *
+ * @return     length of the file up to the end of the last complete
+ *             record, -1 if the file could not be read or fn returned 0
+ */
+int64_t
+mseed_file_records(char *file, mseed_record_func fn, void *data) {
+    int retcode = 0;
+    int eof = 0;
+    FILE *fp = NULL;
+    char *buf = NULL;
+    size_t nalloc = 0, n = 0, off = 0, nr = 0;
+    int64_t pos = 0, valid = 0;
+    MS3Record *msr = NULL;
+    uint32_t flags = MSF_VALIDATECRC;
+
+    if(!(fp = fopen(file, "rb"))) {
+        return -1;
+    }
+    while(1) {
+        buf = str_grow(buf, &nalloc, n, MSEED_SCAN_BLOCK);
+        nr = fread(buf + n, 1, MSEED_SCAN_BLOCK, fp);
+        n += nr;
+        eof = (nr < MSEED_SCAN_BLOCK);
+        off = 0;
+        while(n - off >= MINRECLEN) {
+            retcode = msr3_parse(buf + off, (uint64_t) (n - off), &msr, flags, 0);
+            if(retcode > 0) {
+                break;
+            }
+            if(retcode < 0) {
+                off += 1;
+                continue;
+            }
+            if(fn && !fn(msr, data)) {
+                valid = -1;
+                break;
+            }
+            off += (size_t) msr->reclen;
+            valid = pos + (int64_t) off;
+        }
+        if(eof || valid < 0) {
+            break;
+        }
+        memmove(buf, buf + off, n - off);
+        n -= off;
+        pos += (int64_t) off;
+    }
+    msr3_free(&msr);
+    FREE(buf);
+    fclose(fp);
+    return valid;
+}
+
+/**
+ * @brief      Time of the sample following a record
+ *
+ * @ingroup    miniseed
+ *
+ * @param      msr   miniseed record
+ *
+ * @return     end time of the record plus one sample period
+ */
+nstime_t
+mseed_record_next(MS3Record *msr) {
+    nstime_t end = msr3_endtime(msr);
+    if(msr->samprate > 0.0) {
+        end += (nstime_t) ((double) NSTMODULUS / msr->samprate);
+    }
+    return end;
+}
+
+/**
+ * @brief      Keep the latest end time of each source id
+ *
+ * @ingroup    miniseed
+ * @private
+ *
+ * @param      msr   miniseed record
+ * @param      data  dictionary of nstime_t by source id
+ *
+ * @return     1
+ */
+static int
+mseed_file_scan_record(MS3Record *msr, void *data) {
+    dict *next = (dict *) data;
+    nstime_t *t = dict_get(next, msr->sid);
+    nstime_t end = mseed_record_next(msr);
+    if(!t) {
+        t = calloc(1, sizeof(nstime_t));
+        *t = end;
+        dict_put(next, msr->sid, t);
+    } else if(end > *t) {
+        *t = end;
+    }
+    return 1;
+}
+
+/**
+ * @brief      Scan a possibly incomplete miniseed file
+ *
+ * @ingroup    miniseed
+ *
+ * @details    Records are parsed, but not unpacked, to find where the last
+ *             complete record ends and when each channel's data ends
+ *
+ * @param      file   miniseed file to scan
+ * @param      next   output, time of the sample following the last record
+ *                    for each source id, as a nstime_t, may be NULL
+ *
+ * @return     length of the file up to the end of the last complete
+ *             record, -1 if the file could not be read
+ *
+ * @note Values placed in next are allocated and owned by the dictionary,
+ *    free with dict_free(next, free)
+ */
+int64_t
+mseed_file_scan(char *file, dict *next) {
+    if(!next) {
+        return mseed_file_records(file, NULL, NULL);
+    }
+    return mseed_file_records(file, mseed_file_scan_record, next);
+}
+
+/**
+ * @brief      Convert samples to floats
+ *
+ * @ingroup    miniseed
+ * @private
+ *
+ * @param      data   samples
+ * @param      type   sample type, 'f', 'd' or 'i'
+ * @param      i0     first sample to convert
+ * @param      y      output, n floats
+ * @param      n      number of samples to convert
+ *
+ * @return     1 on success, 0 for an unknown sample type
+ */
+static int
+miniseed_samples_to_float(void *data, char type, int64_t i0, float *y, int64_t n) {
+    switch(type) {
+    case 'f': memcpy(y, (float *) data + i0, sizeof(float) * (size_t) n); break;
+    case 'd': {
+        double *d = (double *) data + i0;
+        for(int64_t j = 0; j < n; j++) {
+            y[j] = (float) d[j];
+        }
+    }
+        break;
+    case 'i': {
+        int *d = (int *) data + i0;
+        for(int64_t j = 0; j < n; j++) {
+            y[j] = (float) d[j];
+        }
+    }
+        break;
+    default:
+        cprintf("red,bold", " WARNING: Unknown sample type: %c\n", type);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief      Decode the kept records of a segment into floats
+ *
+ * @ingroup    miniseed
+ * @private
+ *
+ * @details    Each record overlapping the samples is unpacked on its own and
+ *             converted into place, so only a single record of samples is
+ *             held in its miniseed sample type at a time
+ *
+ * @param      seg   segment with kept records, see mseed_stream_keep_records()
+ * @param      i0    first sample to decode
+ * @param      y     output, n floats
+ * @param      n     number of samples to decode
+ *
+ */
+static void
+miniseed_records_to_float(MS3TraceSeg *seg, int64_t i0, float *y, int64_t n) {
+    MS3Record *msr = NULL;
+    double dt = (double) NSTMODULUS / seg->samprate;
+    nstime_t t0 = seg->starttime + (nstime_t) llround((double) i0 * dt);
+    for(MS3RecordPtr *rp = seg->recordlist->first; rp; rp = rp->next) {
+        int64_t k = 0, j0 = 0, j1 = 0;
+        if(!rp->bufferptr || rp->endtime < t0) {
+            continue;
+        }
+        if(msr3_parse(rp->bufferptr, (uint64_t) mseed_record_len(rp->bufferptr),
+                      &msr, 0, 0) != MS_NOERROR) {
+            continue;
+        }
+        k = llround((double) (msr->starttime - seg->starttime) / dt) - i0;
+        if(k >= n) {
+            continue;
+        }
+        if(msr3_unpack_data(msr, 0) < 0) {
+            printf(" WARNING: Error unpacking record of %s\n", msr->sid);
+            continue;
+        }
+        j0 = (k < 0) ? -k : 0;
+        j1 = (k + msr->numsamples > n) ? n - k : msr->numsamples;
+        if(j1 > j0 &&
+           !miniseed_samples_to_float(msr->datasamples, msr->sampletype, j0, y + k + j0, j1 - j0)) {
+            break;
+        }
+    }
+    msr3_free(&msr);
+}
+
+/**
+ * @brief      Convert part of a Miniseed Trace Segment to a sac file
+ *
+ * @ingroup    miniseed
+ * @private
+ *
+ * @param      t    trace the segment belongs to
+ * @param      seg  segment with unpacked data or kept records
+ * @param      i0   first sample to convert
+ * @param      i1   one past the last sample to convert
+ *
+ * @return     sac file
+ */
+static sac *
+miniseed_segment_to_sac(MS3TraceID *t, MS3TraceSeg *seg, int64_t i0, int64_t i1) {
+    char qual[6] = " RDQM";
+    sac *s;
+    uint16_t year, doy;
+    uint8_t hour, min, sec;
+    uint32_t nsec;
+    nstime_t start = seg->starttime;
+    year = doy = 0;
+    hour = min = sec = 0;
+    nsec = 0;
+
+    if(i0 > 0) {
+        start += (nstime_t) llround((double) i0 * (double) NSTMODULUS / seg->samprate);
+    }
+    s = sac_new();
+    sac_set_float(s, SAC_DELTA, 1.0 / seg->samprate);
+    s->h->npts = (int) (i1 - i0);
+    s->h->leven = TRUE;
+    s->h->iftype = ITIME;
+
+    ms_sid2nslc(t->sid, s->h->knetwk, s->h->kstnm, s->h->khole, s->h->kcmpnm);
+
+    ms_nstime2time(start, &year, &doy, &hour, &min, &sec, &nsec);
+    s->h->nzyear = year;
+    s->h->nzjday = doy;
+    s->h->nzhour = hour;
+    s->h->nzmin  = min;
+    s->h->nzsec  = sec;
+    s->h->nzmsec = nsec / 1000000;
+
+    nstime_t dt = start - ms_time2nstime(s->h->nzyear, s->h->nzjday,
+                                         s->h->nzhour, s->h->nzmin,
+                                         s->h->nzsec,
+                                         (uint32_t) s->h->nzmsec * 1000000);
+    sac_set_float(s, SAC_B, (double) dt / (double)NSTMODULUS);
+
+    fern_asprintf(&s->m->filename,
+             "%s.%s.%s.%s.%c.%04d.%03d.%02d%02d%02d.sac",
+             s->h->knetwk, s->h->kstnm, s->h->khole, s->h->kcmpnm,
+             qual[t->pubversion], s->h->nzyear, s->h->nzjday,
+             s->h->nzhour, s->h->nzmin, s->h->nzsec);
+
+    // Data
+    s->y = calloc((size_t) s->h->npts, sizeof(float));
+    if(!seg->datasamples && seg->recordlist) {
+        miniseed_records_to_float(seg, i0, s->y, s->h->npts);
+    } else {
+        miniseed_samples_to_float(seg->datasamples, seg->sampletype, i0, s->y, s->h->npts);
+    }
+    sac_extrema(s);
+    sac_be(s);
+    return s;
+}
+
+/**
+ * @brief      Number of samples available from a segment
+ *
+ * @ingroup    miniseed
+ * @private
+ *
+ * @param      seg   segment
+ *
+ * @return     unpacked samples, or the samples in its kept records
+ */
+static int64_t
+miniseed_segment_samples(MS3TraceSeg *seg) {
+    if(!seg->datasamples && seg->recordlist) {
+        return seg->samplecnt;
+    }
+    return seg->numsamples;
+}
+
+/**
+ * @brief      Convert a time window of a single trace to a set of sac files
+ *
+ * @ingroup    miniseed
+ *
+ * @param      t     trace
+ * @param      t1    start of the window, NSTERROR for the start of the data
+ * @param      t2    end of the window, NSTERROR for the end of the data
+ * @param      out   sac files to append to, enclosed in an \ref xarray
+ *
+ * @return     out with a sac file for each segment overlapping the window
+ */
+sac **
+miniseed_trace_to_sac_window(MS3TraceID *t, nstime_t t1, nstime_t t2, sac **out) {
+    for(MS3TraceSeg *seg = t->first; seg; seg = seg->next) {
+        int64_t i0 = 0, i1 = miniseed_segment_samples(seg);
+        int64_t ns = i1;
+        if(seg->samprate == 0.0 || ns <= 0) {
+            continue;
+        }
+        if(t1 != NSTERROR) {
+            double n = (double) (t1 - seg->starttime) * seg->samprate / NSTMODULUS;
+            i0 = (n > 0.0) ? (int64_t) ceil(n - 1e-6) : 0;
+        }
+        if(t2 != NSTERROR) {
+            double n = (double) (t2 - seg->starttime) * seg->samprate / NSTMODULUS;
+            i1 = (int64_t) floor(n + 1e-6) + 1;
+            if(i1 > ns) {
+                i1 = ns;
+            }
+        }
+        if(i1 > i0) {
+            out = xarray_append(out, miniseed_segment_to_sac(t, seg, i0, i1));
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief      Convert a single trace to a set of sac files
+ *
+ * @details    Each segment of the trace becomes a sac file, see
+ *             miniseed_trace_list_to_sac()
+ *
+ * @ingroup    miniseed
+ *
+ * @param      t    trace, e.g. from a Miniseed Trace List
+ *
+ * @return     arary of pointers to sac files enclosed in an \ref xarray
+ */
+sac **
+miniseed_trace_to_sac(MS3TraceID *t) {
+    return miniseed_trace_to_sac_window(t, NSTERROR, NSTERROR, xarray_new('p'));
+}
+
+/**
+ * @brief      Release the segments of a trace
+ *
+ * @details    Samples and records kept by mseed_stream_keep_records() are
+ *             freed along with the segments, the trace itself remains in its
+ *             Miniseed Trace List
+ *
+ * @ingroup    miniseed
+ *
+ * @param      t    trace
+ *
+ */
+void
+miniseed_trace_release(MS3TraceID *t) {
+    MS3TraceSeg *seg = t->first;
+    while(seg) {
+        MS3TraceSeg *next = seg->next;
+        if(seg->recordlist) {
+            MS3RecordPtr *rp = seg->recordlist->first;
+            while(rp) {
+                MS3RecordPtr *rnext = rp->next;
+                mseed_record_free(rp->bufferptr);
+                if(rp->msr) {
+                    msr3_free(&rp->msr);
+                }
+                FREE(rp);
+                rp = rnext;
+            }
+            FREE(seg->recordlist);
+        }
+        FREE(seg->datasamples);
+        FREE(seg);
+        seg = next;
+    }
+    t->first = NULL;
+    t->last = NULL;
+    t->numsegments = 0;
+}
+
+/**
+ * @brief      Convert a time window of a Miniseed Trace List to a set of sac files
+ *
+ * @details    Each segment overlapping the window is cut to the samples
+ *             within it, see miniseed_trace_list_to_sac()
+ *
+ * @ingroup    miniseed
+ *
+ * @param      mst3k   Miniseed Trace List
+ * @param      t1      start of the window
+ * @param      t2      end of the window
+ *
+ * @return     arary of pointers to sac files enclosed in an \ref xarray
+ */
+sac **
+miniseed_trace_list_to_sac_window(MS3TraceList *mst3k, nstime_t t1, nstime_t t2) {
+    sac **out = NULL;
+    if(!mst3k || mst3k->numtraces == 0) {
+        return NULL;
+    }
+    out = xarray_new('p');
+    MS3TraceID *t = mst3k->traces;
+    for(uint32_t i = 0; i < mst3k->numtraces; i++) {
+        out = miniseed_trace_to_sac_window(t, t1, t2, out);
+        t = t->next;
+    }
+    return out;
+}
+
 /**
  * @brief      Convert a Miniseed Trace List to a set of sac files
  *
@@ -104,92 +831,12 @@ sac **
 miniseed_trace_list_to_sac(MS3TraceList *mst3k) {
     int8_t verbose = 0;
     int8_t gaps = 1;
-    sac **out = NULL;
     if(mst3k->numtraces == 0) {
         return NULL;
     }
     // Show the result of reading in all the files
-
     mstl3_printtracelist (mst3k, ISOMONTHDAY , verbose, gaps);
-    //clrmsg();
-    // Convert the TraceList to SAC Files 
-    //int n = 0;
-    out = xarray_new('p');
-    MS3TraceID *t = mst3k->traces;
-    for(uint32_t i = 0; i < mst3k->numtraces; i++) {
-        MS3TraceSeg *seg = t->first;
-        while(seg) {
-            if(seg->samprate != 0.0 && seg->numsamples > 0) {
-                char qual[6] = " RDQM";
-                sac *s;
-                uint16_t year, doy;
-                uint8_t hour, min, sec;
-                uint32_t nsec;
-                year = doy = 0;
-                hour = min = sec = 0;
-                nsec = 0;
-
-                s = sac_new();
-                sac_set_float(s, SAC_DELTA, 1.0 / seg->samprate);
-                s->h->npts = (int) seg->numsamples;
-                s->h->leven = TRUE;
-                s->h->iftype = ITIME;
-
-                ms_sid2nslc(t->sid, s->h->knetwk, s->h->kstnm, s->h->khole, s->h->kcmpnm);
-
-                ms_nstime2time(seg->starttime, &year, &doy, &hour, &min, &sec, &nsec);
-                s->h->nzyear = year;
-                s->h->nzjday = doy;
-                s->h->nzhour = hour;
-                s->h->nzmin  = min;
-                s->h->nzsec  = sec;
-                s->h->nzmsec = nsec / 1000000;
-
-                nstime_t dt = seg->starttime - ms_time2nstime(s->h->nzyear, s->h->nzjday,
-                                                              s->h->nzhour, s->h->nzmin,
-                                                              s->h->nzsec,
-                                                              (uint32_t) s->h->nzmsec * 1000000);
-                sac_set_float(s, SAC_B, (double) dt / (double)NSTMODULUS);
-
-                fern_asprintf(&s->m->filename,
-                         "%s.%s.%s.%s.%c.%04d.%03d.%02d%02d%02d.sac",
-                         s->h->knetwk, s->h->kstnm, s->h->khole, s->h->kcmpnm,
-                         qual[t->pubversion], s->h->nzyear, s->h->nzjday,
-                         s->h->nzhour, s->h->nzmin, s->h->nzsec);
-
-                // Data
-                s->y = calloc((size_t) s->h->npts, sizeof(float));
-                switch(seg->sampletype) {
-                case 'f': memcpy(s->y, seg->datasamples, sizeof(float) * (size_t) s->h->npts); break;
-                case 'd': {
-                    double *data = (double *) seg->datasamples;
-                    for(int j = 0; j < seg->numsamples; j++) {
-                        s->y[j] = (float) data[j];
-                    }
-                }
-                    break;
-                case 'i': {
-                    int *data = (int *) seg->datasamples;
-                    for(int j = 0; j < seg->numsamples; j++) {
-                        s->y[j] = (float) data[j];
-                    }
-                }
-                    break;
-                default:
-                    cprintf("red,bold", " WARNING: Unknown sample type: %c\n", seg->sampletype);
-                    break;
-                }
-                sac_extrema(s);
-                sac_be(s);
-                //sacput(s);
-                out = xarray_append(out, s);
-                //n++;
-            }
-            seg = seg->next;
-        }
-        t = t->next;
-    }
-    return out;
+    return miniseed_trace_list_to_sac_window(mst3k, NSTERROR, NSTERROR);
 }
 
 
@@ -6,11 +6,39 @@
 #include <libmseed/libmseed.h>
 
 #include "event.h"
+#include "chash.h"
 
 int64_t read_miniseed_memory(MS3TraceList *mst3k, char *buffer, uint64_t len);
 sac ** miniseed_trace_list_to_sac(MS3TraceList *mst3k);
+sac ** miniseed_trace_list_to_sac_window(MS3TraceList *mst3k, nstime_t t1, nstime_t t2);
+sac ** miniseed_trace_to_sac(MS3TraceID *t);
+sac ** miniseed_trace_to_sac_window(MS3TraceID *t, nstime_t t1, nstime_t t2, sac **out);
+void miniseed_trace_release(MS3TraceID *t);
 int read_miniseed_file(MS3TraceList *mst3k, char *file);
 
+/**
+ * Function called with each record of a miniseed file or stream, returns 0
+ * on error
+ */
+typedef int (*mseed_record_func)(MS3Record *msr, void *data);
+
+/**
+ * Incremental miniseed decoder
+ */
+typedef struct mseed_stream mseed_stream;
+
+mseed_stream * mseed_stream_new(MS3TraceList *mst3k);
+void           mseed_stream_free(mseed_stream *s);
+size_t         mseed_stream_write(char *data, size_t n, void *p);
+void           mseed_stream_set_record_func(mseed_stream *s,
+                                            mseed_record_func fn, void *data);
+void           mseed_stream_keep_records(mseed_stream *s);
+int64_t        mseed_stream_finish(mseed_stream *s);
+
+int64_t        mseed_file_records(char *file, mseed_record_func fn, void *data);
+int64_t        mseed_file_scan(char *file, dict *next);
+nstime_t       mseed_record_next(MS3Record *msr);
+
 
 
 #endif /* _MINISEED_SAC_H_ */
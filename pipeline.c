@@ -0,0 +1,232 @@
+/**
+ * @file
+ * @brief Sac files written as channels are downloaded
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sacio/sacio.h>
+#include <libmseed/libmseed.h>
+
+#include "pipeline.h"
+#include "miniseed_sac.h"
+#include "meta.h"
+#include "cprint.h"
+#include "array.h"
+#include "defs.h"
+
+/**
+ * @defgroup pipeline pipeline
+ * @brief Sac files written as channels are downloaded
+ *
+ * @details Each channel is converted to sac as soon as all of its data has
+ *    arrived, see data_request_set_trace_func().  Files are collected into
+ *    batches and their meta data is requested in the same loop as the
+ *    remaining downloads.  A batch is written once its meta data arrives.
+ *    Only a few batches wait for meta data at once, beyond that meta data is
+ *    requested right away, which holds up the downloads until the batch is
+ *    written
+ *
+ * @code
+ *   sac_pipeline *p = sac_pipeline_new(event, verbose);
+ *   data_request_set_trace_func(fdr, sac_pipeline_trace, p);
+ *   mst3k = data_request_download(fdr, file, prefix, FALSE, TRUE);
+ *   sac_pipeline_free(p);
+ * @endcode
+ */
+
+#define SAC_PIPELINE_BATCH    64 /**< @private sac files in a meta data request */
+#define SAC_PIPELINE_INFLIGHT 4  /**< @private meta data requests in progress at once */
+
+/**
+ * @brief Sac files written as channels are downloaded
+ * @ingroup pipeline
+ */
+struct sac_pipeline {
+    Event *e;         /**< @private event to fill, NULL for none */
+    int verbose;      /**< @private be verbose when setting meta data */
+    sac **queue;      /**< @private sac files waiting for a meta data request */
+    size_t inflight;  /**< @private meta data requests in progress */
+    size_t written;   /**< @private sac files written */
+    size_t bytes;     /**< @private size of sac files queued or waiting for meta data */
+};
+
+/**
+ * @brief Create a pipeline writing sac files
+ *
+ * @memberof   sac_pipeline
+ * @ingroup    pipeline
+ *
+ * @param      e        event to fill the sac files with, may be NULL
+ * @param      verbose  be verbose when setting meta data
+ *
+ * @return     new pipeline
+ */
+sac_pipeline *
+sac_pipeline_new(Event *e, int verbose) {
+    sac_pipeline *p = calloc(1, sizeof(sac_pipeline));
+    p->e = e;
+    p->verbose = verbose;
+    p->queue = xarray_new('p');
+    return p;
+}
+
+/**
+ * @brief Fill event data into and write a batch of sac files
+ *
+ * @memberof   sac_pipeline
+ * @ingroup    pipeline
+ * @private
+ *
+ * @param      files  sac files with meta data filled, enclosed in an \ref xarray
+ * @param      data   pipeline, \ref sac_pipeline
+ *
+ * @note The sac files are freed
+ */
+static void
+sac_pipeline_write(sac **files, void *data) {
+    int nerr = 0;
+    char tmp[128] = {0};
+    sac_pipeline *p = (sac_pipeline *) data;
+    sac_array_fill_meta_data_from_event(files, p->e, p->verbose);
+    for(size_t i = 0; i < xarray_length(files); i++) {
+        update_distaz(files[i]);
+        cprintf("green", "\tWriting data to %s [%s]\n",
+                files[i]->m->filename, data_size((int64_t) sac_size(files[i]), tmp, sizeof(tmp)));
+        sac_write(files[i], files[i]->m->filename, &nerr);
+        p->written += (nerr == 0) ? 1 : 0;
+        p->bytes -= (sac_size(files[i]) < p->bytes) ? sac_size(files[i]) : p->bytes;
+        sac_free(files[i]);
+    }
+    xarray_free(files);
+}
+
+/**
+ * @brief Handle a batch of sac files once its meta data is filled
+ *
+ * @memberof   sac_pipeline
+ * @ingroup    pipeline
+ * @private
+ *
+ * @param      files  sac files with meta data filled, enclosed in an \ref xarray
+ * @param      data   pipeline, \ref sac_pipeline
+ *
+ */
+static void
+sac_pipeline_meta_done(sac **files, void *data) {
+    sac_pipeline *p = (sac_pipeline *) data;
+    p->inflight -= 1;
+    sac_pipeline_write(files, p);
+}
+
+/**
+ * @brief Request meta data for the queued sac files
+ *
+ * @memberof   sac_pipeline
+ * @ingroup    pipeline
+ * @private
+ *
+ * @param      p     pipeline
+ * @param      loop  loop the remaining downloads are made in
+ *
+ */
+static void
+sac_pipeline_flush(sac_pipeline *p, fern_loop *loop) {
+    sac **files = p->queue;
+    if(xarray_length(files) == 0) {
+        return;
+    }
+    p->queue = xarray_new('p');
+    if(p->inflight >= SAC_PIPELINE_INFLIGHT) {
+        sac_array_fill_meta_data(files, p->verbose, FALSE);
+        sac_pipeline_write(files, p);
+        return;
+    }
+    p->inflight += 1;
+    sac_array_fill_meta_data_async(loop, files, p->verbose, sac_pipeline_meta_done, p);
+}
+
+/**
+ * @brief Convert a downloaded channel to sac files
+ *
+ * @memberof   sac_pipeline
+ * @ingroup    pipeline
+ *
+ * @param      loop  loop the remaining downloads are made in
+ * @param      t     channel, NULL once all channels are downloaded
+ * @param      data  pipeline, \ref sac_pipeline
+ *
+ * @note Matches \ref data_request_trace_func, see data_request_set_trace_func()
+ */
+void
+sac_pipeline_trace(fern_loop *loop, MS3TraceID *t, void *data) {
+    sac **out = NULL;
+    sac_pipeline *p = (sac_pipeline *) data;
+    if(!t) {
+        sac_pipeline_flush(p, loop);
+        return;
+    }
+    out = miniseed_trace_to_sac(t);
+    for(size_t i = 0; i < xarray_length(out); i++) {
+        p->queue = xarray_append(p->queue, out[i]);
+        p->bytes += sac_size(out[i]);
+    }
+    xarray_free(out);
+    if(xarray_length(p->queue) >= SAC_PIPELINE_BATCH) {
+        sac_pipeline_flush(p, loop);
+    }
+}
+
+/**
+ * @brief Get the number of sac files written
+ *
+ * @memberof   sac_pipeline
+ * @ingroup    pipeline
+ *
+ * @param      p    pipeline
+ *
+ * @return     number of sac files written
+ */
+size_t
+sac_pipeline_written(sac_pipeline *p) {
+    return (p) ? p->written : 0;
+}
+
+/**
+ * @brief Get the size of sac files held by the pipeline
+ *
+ * @memberof   sac_pipeline
+ * @ingroup    pipeline
+ *
+ * @param      data  pipeline, \ref sac_pipeline
+ *
+ * @return     bytes of sac files queued or waiting for meta data
+ *
+ * @note Matches \ref data_request_memory_func, see
+ *    data_request_set_memory_func().  At most SAC_PIPELINE_INFLIGHT batches
+ *    wait for meta data, in addition to the queued batch
+ */
+size_t
+sac_pipeline_memory(void *data) {
+    sac_pipeline *p = (sac_pipeline *) data;
+    return (p) ? p->bytes : 0;
+}
+
+/**
+ * @brief Free a pipeline
+ *
+ * @memberof   sac_pipeline
+ * @ingroup    pipeline
+ *
+ * @param      p    pipeline
+ *
+ * @note Sac files still queued are not written
+ */
+void
+sac_pipeline_free(sac_pipeline *p) {
+    if(p) {
+        xarray_free_items(p->queue, (void (*)(void *)) sac_free);
+        xarray_free(p->queue);
+        FREE(p);
+    }
+}
@@ -0,0 +1,26 @@
+/**
+ * @file
+ * @brief Sac files written as channels are downloaded
+ */
+
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include <libmseed/libmseed.h>
+
+#include "request.h"
+#include "event.h"
+
+/**
+ * Sac files converted, filled with meta data and written as channels are
+ * downloaded
+ */
+typedef struct sac_pipeline sac_pipeline;
+
+sac_pipeline * sac_pipeline_new(Event *e, int verbose);
+void           sac_pipeline_trace(fern_loop *loop, MS3TraceID *t, void *data);
+size_t         sac_pipeline_written(sac_pipeline *p);
+size_t         sac_pipeline_memory(void *data);
+void           sac_pipeline_free(sac_pipeline *p);
+
+#endif /* _PIPELINE_H_ */
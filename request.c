@@ -8,16 +8,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 #include <math.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
 
 #include <curl/curl.h>
 
 #include <sacio/timespec.h>
 
 #include "request.h"
+#include "cache.h"
+#include "cJSON.h"
+#include "array.h"
 #include "cprint.h"
 
 #include "chash.h"
@@ -31,6 +39,9 @@
  */
 typedef struct {
     char        remote_fname[4096];
+    char        etag[256];          /**< \private ETag header, for the cache */
+    char        last_modified[128]; /**< \private Last-Modified header, for the cache */
+    char        retry_after[128];   /**< \private Retry-After header, for retries */
 } dnld_params_t;
 
 #ifndef CURL_VERSION_BITS
@@ -76,9 +87,12 @@ struct myprogress {
 };
 
 
+typedef struct transfer transfer; /**< \private */
+typedef struct sink sink; /**< \private */
+
 void result_from_curl(result *r, int code, char *data, size_t n);
 size_t dnld_header_parse(void *hdr, size_t size, size_t nmemb, void *userdata);
-static size_t memory_callback(void *contents, size_t size, size_t nmemb, void *userp);
+static size_t transfer_write(void *contents, size_t size, size_t nmemb, void *userp);
 static int xferinfo(void *p,
                     curl_off_t dltotal, curl_off_t dlnow,
                     curl_off_t ultotal, curl_off_t ulnow);
@@ -127,7 +141,6 @@ zarray_grow(zarray *a, size_t n) {
     tmp = realloc(a->data, a->alloc);
     if(tmp) {
         a->data = tmp;
-        memset(a->data + a->n, 0, a->alloc - a->n);
     } else {
         fprintf(stderr, "array: error while expanding\n");
     }
@@ -139,6 +152,7 @@ zarray_append(zarray *a, char *data, size_t n) {
     zarray_grow(a, a->n + n);
     memcpy(a->data + a->n, data, n);
     a->n = a->n + n;
+    a->data[a->n] = 0;
 }
 
 /**
@@ -177,6 +191,19 @@ struct request {
     dict *args;  /**< \private  Key-Values pairs */
     int verbose; /**< \private  Display details about the request */
     int progress; /**< \private Show progress bar during download */
+    sink **sinks; /**< \private Consumers of returned data */
+    int keep_data; /**< \private Keep returned data in memory */
+    int64_t range_from; /**< \private Byte offset to start the returned data at */
+};
+
+/**
+ * @brief Consumer of returned data from a \ref request
+ * @ingroup request
+ * @private
+ */
+struct sink {
+    request_sink func; /**< \private function called with data as it arrives */
+    void *data;        /**< \private data passed to func */
 };
 
 /**
@@ -191,6 +218,7 @@ struct result {
     char *data;        /**< \private Returned data */
     size_t n;          /**< \private Length of data */
     char *filename;    /**< \private Possible filename returned from request */
+    request_timing timing; /**< \private Network timing of the request */
 };
 
 /**
@@ -229,6 +257,9 @@ request_new() {
     r->args = dict_new();
     r->verbose = 0;
     r->progress = 1;
+    r->sinks = xarray_new('p');
+    r->keep_data = 1;
+    r->range_from = 0;
     return r;
 }
 
@@ -246,6 +277,8 @@ request_free(request *r) {
     if(r) {
         FREE(r->url);
         dict_free(r->args, arg_free);
+        xarray_free_items(r->sinks, free);
+        xarray_free(r->sinks);
         FREE(r);
     }
 }
@@ -279,6 +312,118 @@ request_set_progress(request *r, int progress) {
     r->progress = progress;
 }
 
+/**
+ * Add a consumer for data returned by the request
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r     Request to add the consumer to
+ * @param func  function called with each piece of data as it arrives,
+ *              returning the number of bytes handled
+ * @param data  data passed to func
+ *
+ * @note Consumers only receive the data of successful (2xx) responses, error
+ *    responses are kept in memory for result_error_msg().  A consumer handling
+ *    fewer bytes than it was given aborts the transfer
+ *
+ * @note Data is also kept in memory unless request_set_keep_data() is off
+ */
+void
+request_add_sink(request *r, request_sink func, void *data) {
+    sink *k = NULL;
+    if(!r || !func) {
+        return;
+    }
+    k = calloc(1, sizeof(sink));
+    k->func = func;
+    k->data = data;
+    r->sinks = xarray_append(r->sinks, k);
+}
+
+/**
+ * Write data returned by a request to a file descriptor
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param data  returned data
+ * @param n     length of data
+ * @param p     file descriptor
+ *
+ * @return number of bytes written, less than n on error
+ */
+static size_t
+request_sink_fd(char *data, size_t n, void *p) {
+    int fd = (int) (intptr_t) p;
+    size_t k = 0;
+    while(k < n) {
+        ssize_t nw = write(fd, data + k, n - k);
+        if(nw <= 0) {
+            return k;
+        }
+        k += (size_t) nw;
+    }
+    return n;
+}
+
+/**
+ * Stream data returned by the request to a file descriptor
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r   Request to stream
+ * @param fd  open file descriptor to write data to
+ *
+ * @note The file descriptor is not closed by the request
+ * @note See request_add_sink()
+ */
+void
+request_add_sink_fd(request *r, int fd) {
+    request_add_sink(r, request_sink_fd, (void *) (intptr_t) fd);
+}
+
+/**
+ * Set if the data returned by the request is kept in memory
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r     Request to change
+ * @param keep  1 to keep data in memory (default), 0 to only pass data to consumers
+ *
+ * @note Turn this off when streaming large responses to a file, see
+ *    request_add_sink_fd().  Error responses are always kept in memory
+ */
+void
+request_set_keep_data(request *r, int keep) {
+    if(r) {
+        r->keep_data = keep;
+    }
+}
+
+/**
+ * Request the returned data starting at a byte offset, using an HTTP Range
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r       Request to change
+ * @param offset  byte offset to start at, 0 for all data (default)
+ *
+ * @note Used to resume a partial download.  Servers are not required to honor
+ *    a range; if the whole body is returned instead (HTTP 200) the transfer is
+ *    stopped before any data reaches the consumers and the result is not ok
+ *    with an HTTP code of 200.  A server honoring the range returns HTTP 206
+ */
+void
+request_set_range_from(request *r, int64_t offset) {
+    if(r) {
+        r->range_from = (offset < 0) ? 0 : offset;
+    }
+}
+
 /**
  * Grow a character string if necessary
  *
@@ -307,168 +452,2175 @@ str_grow(char *s, size_t *nalloc, size_t n, size_t nadd) {
         while(n + nadd + 1 > *nalloc) {
             *nalloc *= 2;
         }
-        if(!(tmp = realloc(s, *nalloc))) {
-            printf("Error reallocating space for string\n");
-            return NULL;
+        if(!(tmp = realloc(s, *nalloc))) {
+            printf("Error reallocating space for string\n");
+            return NULL;
+        }
+        s = tmp;
+    }
+    return s;
+}
+
+/**
+ * Convert a request to a URL
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @private
+ *
+ * @param r  request to convert to a URL
+ *
+ * @return URL character string
+ *
+ * @warning The output character string is owned by the user and it is the user's 
+ *    responsibility to free the underlying memory with \ref free
+ */
+char *
+request_to_url(request *r) {
+    /// Data request would be from
+    ///   - Reading a station file and eventid (time) + duration
+    ///   - Taking a station search parameter and eventid (time + location)
+    ///       - Make the stations request
+    ///       - Make the availability request
+    ///   - After avail request, then the data request
+    ///   - How to restart a data download after stopping?
+    ///     - Chunk up request and save
+    char *out = NULL;
+    size_t nalloc = 256;
+    size_t n = 0;
+    char tmp[128];
+
+    if(!r->url) {
+        return NULL;
+    }
+    out = str_grow(out, &nalloc, n, strlen(r->url));
+    fern_strlcat(out, r->url, nalloc);
+    n = strlen(out);
+    char **keys = dict_keys(r->args);
+    for(size_t i = 0; keys[i]; i++) {
+        arg_to_string(dict_get(r->args, keys[i]), tmp, sizeof(tmp));
+        out = str_grow(out, &nalloc, n, strlen(tmp) + strlen(keys[i] + 2) );
+        snprintf(out+n, nalloc-n, "%s=%s&", keys[i], tmp);
+        n = strlen(out);
+    }
+    dict_keys_free(keys);
+
+    if(out[strlen(out)-1] == '&') {
+        out[strlen(out)-1] = 0;
+    }
+
+
+    return out;
+}
+
+
+/**
+ * Set the URL for the request
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r        Request to modify
+ * @param url      URL of the request
+ *
+ * @note If the request does not exist, nothing is done
+ *
+ */
+void
+request_set_url(request *r, char *url) {
+    if(!r) {
+        return;
+    }
+    FREE(r->url);
+    r->url = strdup(url);
+}
+/**
+ * Get the URL for the request
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r        Request to get the URL from
+ *
+ * If the request or the URL does not exist, NULL is returned
+ *
+ * @warning The URL is owned by the request and should not be modified
+ */
+char *
+request_get_url(request *r) {
+    if(!r) {
+        return NULL;
+    }
+    return r->url;
+}
+
+/**
+ * Set an argument for the request
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r     Request to add the argument to
+ * @param key   Name of the argument
+ * @param a     Value of the Argument
+ *
+ * @note Undefined requests, keys, or argument results in nothing 
+ */
+void
+request_set_arg(request *r, char *key, Arg *a) {
+    if(!r || !r->args || !key || !a) {
+        return;
+    }
+    dict_put(r->args, key, a);
+}
+
+/**
+ * Get an argument for the request
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r     Request to get the argument from
+ * @param key   Name of the argument
+ *
+ * @note Undefined requests, keys, or unknown keys results in nothing
+ * @warning Arugment is owned by the request and must not be modified
+ */
+Arg *
+request_get_arg(request *r, char *key) {
+    if(!r || !r->args || !key) {
+        return NULL;
+    }
+    return dict_get(r->args, key);
+}
+
+/**
+ * Remove an argument for the request
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r   Request to remove the argument from
+ * @param key Name of the argument to remove
+ *
+ * @return 1 if successful, 0 if not successful
+ */
+int
+request_del_arg(request *r, char *key) {
+    if(!r || !r->args || !key) {
+        return 0;
+    }
+    return dict_remove(r->args, key, arg_free);
+}
+
+
+enum {
+    ROUTE_UNKNOWN = 0, /**< \private response code not yet checked */
+    ROUTE_SINKS   = 1, /**< \private successful response, data to consumers */
+    ROUTE_MEMORY  = 2, /**< \private error response, data to memory */
+    ROUTE_ABORT   = 3, /**< \private range ignored by the server, stop the transfer */
+};
+
+/**
+ * @brief Single HTTP transfer, owned by a \ref fern_loop
+ * @private
+ * @ingroup request
+ */
+struct transfer {
+    CURL *curl;                /**< \private curl easy handle */
+    struct curl_slist *list;   /**< \private HTTP headers */
+    struct myprogress prog;    /**< \private progress bar state */
+    dnld_params_t dnld_params; /**< \private remote filename */
+    zarray data;               /**< \private returned data */
+    char *url;                 /**< \private URL to request */
+    char *post_data;           /**< \private POST data, NULL for GET */
+    post_line_func post_fn;    /**< \private POST data line by line, NULL if not streamed */
+    void *post_fn_data;        /**< \private data passed to post_fn */
+    char *post_key;            /**< \private identifies streamed POST data in the cache */
+    char *post_buf;            /**< \private current line of streamed POST data */
+    size_t post_line;          /**< \private next line of streamed POST data */
+    size_t post_off;           /**< \private bytes of post_buf already sent */
+    size_t post_len;           /**< \private length of post_buf */
+    char *group;               /**< \private group for limiting transfers, e.g. data center */
+    int progress;              /**< \private show a progress bar */
+    request_callback done;     /**< \private completion callback */
+    void *userdata;            /**< \private completion callback data */
+    sink **sinks;              /**< \private consumers of returned data */
+    int keep_data;             /**< \private keep returned data in memory */
+    int route;                 /**< \private where returned data goes, see \ref transfer_write */
+    int64_t range_from;        /**< \private byte offset requested with a Range, 0 for none */
+    cache_entry *cached;       /**< \private cached response, may need revalidation */
+    char *host;                /**< \private host name, for rate limiting */
+    int attempts;              /**< \private number of attempts made */
+    double not_before;         /**< \private earliest time to start, see now_seconds() */
+    size_t delivered;          /**< \private bytes passed to the consumers */
+    int64_t bw_bytes;          /**< \private bytes received when the share was last set */
+    double bw_since;           /**< \private time the share was last set */
+    double bw_cap;             /**< \private receive speed allowed in bytes per second, 0 for none */
+    double bw_tokens;          /**< \private bytes that may be received now */
+    double bw_last;            /**< \private time tokens were last added */
+    int paused;                /**< \private waiting for bandwidth, see bandwidth_take() */
+};
+
+/**
+ * @brief Collection of concurrent HTTP transfers
+ * @ingroup request
+ *
+ * Transfers are queued with fern_loop_add() and run with fern_loop_run().
+ * At most max_transfers run at once, and at most max_per_group run at once
+ * within the same group.  Remaining transfers wait in the order added.
+ *
+ * @code
+ *   fern_loop *loop = fern_loop_new();
+ *   fern_loop_set_max_transfers(loop, 8);
+ *   fern_loop_set_max_per_group(loop, 2);
+ *   fern_loop_add(loop, r1, NULL, "IRISDMC", done, data1);
+ *   fern_loop_add(loop, r2, post, "GEOFON", done, data2);
+ *   fern_loop_run(loop);
+ *   fern_loop_free(loop);
+ * @endcode
+ */
+struct fern_loop {
+    CURLM *multi;        /**< \private curl multi handle */
+    int max_transfers;   /**< \private maximum concurrent transfers */
+    int max_per_group;   /**< \private maximum concurrent transfers per group */
+    transfer **pending;  /**< \private transfers waiting to start */
+    transfer **active;   /**< \private transfers in flight */
+};
+
+#define HANDLE_POOL_MAX 16 /**< @private maximum number of idle curl handles kept */
+#define POST_LINE_MAX 2048 /**< @private longest line of streamed POST data */
+
+static CURLSH *_SHARE = NULL;  /**< @private shared DNS, TLS session and connection cache */
+static CURL  **_HANDLES = NULL; /**< @private idle curl handles available for reuse */
+
+static int    _RETRY_MAX   = 3;    /**< @private maximum number of retries of a transfer */
+static double _RETRY_BASE  = 1.0;  /**< @private first retry delay in seconds */
+static double _RETRY_LIMIT = 60.0; /**< @private maximum retry delay in seconds */
+static double _RATE        = 0.0;  /**< @private requests per second per host, 0 for no limit */
+static double _RATE_BURST  = 1.0;  /**< @private requests allowed at once per host */
+static dict  *_BUCKETS     = NULL; /**< @private token buckets by host */
+static FILE  *_LOG         = NULL; /**< @private JSON lines log of requests */
+static double _BANDWIDTH   = 0.0;  /**< @private bytes per second for all transfers, 0 for no limit */
+static dict  *_WEIGHTS     = NULL; /**< @private bandwidth weights by group */
+static transfer **_FLOWING = NULL; /**< @private transfers in flight in all loops */
+static double _SHARED_AT   = 0.0;  /**< @private time the bandwidth shares were last set */
+
+#define BANDWIDTH_SLOTS    64  /**< @private processes sharing a bandwidth budget */
+#define BANDWIDTH_INTERVAL 1.0 /**< @private seconds between bandwidth share updates */
+#define BANDWIDTH_STALE    5.0 /**< @private seconds before a process is ignored */
+#define BANDWIDTH_MIN      1024.0 /**< @private minimum bytes per second for a transfer */
+#define BANDWIDTH_BURST    0.25   /**< @private seconds of bandwidth a transfer may save up */
+
+/**
+ * @brief Bandwidth use of a process sharing a budget
+ * @private
+ * @ingroup request
+ */
+typedef struct {
+    int32_t pid;     /**< \private process id, 0 if unused */
+    int32_t unused;  /**< \private padding */
+    double weight;   /**< \private total weight of transfers in flight */
+    double updated;  /**< \private wall clock time of the last update */
+} bandwidth_slot;
+
+/**
+ * @brief Shared memory segment coordinating the bandwidth of processes
+ * @private
+ * @ingroup request
+ */
+typedef struct {
+    bandwidth_slot slot[BANDWIDTH_SLOTS]; /**< \private one slot per process */
+} bandwidth_shm;
+
+static bandwidth_shm *_SHM = NULL; /**< @private bandwidth shared between processes */
+
+/**
+ * @brief Token bucket limiting the request rate to a host
+ * @private
+ * @ingroup request
+ */
+typedef struct {
+    double tokens; /**< \private requests currently allowed */
+    double last;   /**< \private time tokens were last added */
+} token_bucket;
+
+/**
+ * Set the retry policy for failed transfers
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param max_retries  maximum number of retries, 0 to not retry [3]
+ * @param base_delay   delay before the first retry in seconds [1]
+ * @param max_delay    maximum delay between retries in seconds [60]
+ *
+ * @note Transfers are retried after HTTP 429, 502, 503 and 504 responses and
+ *    after connection errors, as long as no data has been passed to the
+ *    consumers.  The delay doubles with each retry, with a random jitter,
+ *    unless the server sends a Retry-After header, which is honored
+ */
+void
+request_set_retry(int max_retries, double base_delay, double max_delay) {
+    _RETRY_MAX   = (max_retries < 0) ? 0 : max_retries;
+    _RETRY_BASE  = (base_delay < 0.0) ? 0.0 : base_delay;
+    _RETRY_LIMIT = (max_delay < _RETRY_BASE) ? _RETRY_BASE : max_delay;
+}
+
+/**
+ * Limit the rate of requests made to each host
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param per_second  requests per second allowed to a single host, 0 for no limit [0]
+ * @param burst       requests allowed at once before the rate applies, minimum of 1
+ *
+ * @note The limit applies to all transfers, including retries, across all
+ *    \ref fern_loop
+ */
+void
+request_set_rate_limit(double per_second, int burst) {
+    _RATE = (per_second < 0.0) ? 0.0 : per_second;
+    _RATE_BURST = (burst < 1) ? 1.0 : (double) burst;
+    if(_BUCKETS) {
+        dict_free(_BUCKETS, free);
+        _BUCKETS = NULL;
+    }
+}
+
+/**
+ * Log every request made to a file
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param file  file to append to, NULL to stop logging
+ *
+ * @return 1 on success, 0 if the file could not be opened
+ *
+ * @note Each request, including retries and responses from the cache, adds
+ *    one JSON object on its own line with the URL, host, status, sizes and
+ *    the timing of the request in seconds, see \ref request_timing
+ */
+int
+request_set_log(char *file) {
+    if(_LOG) {
+        fclose(_LOG);
+        _LOG = NULL;
+    }
+    if(!file) {
+        return 1;
+    }
+    if(!(_LOG = fopen(file, "a"))) {
+        printf("Error opening request log: %s\n", file);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Get the current time for scheduling transfers
+ *
+ * @private
+ * @ingroup request
+ *
+ * @return monotonic time in seconds
+ */
+static double
+now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Get the host name from a URL
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param url  URL, e.g. https://service.iris.edu/fdsnws/station/1/query
+ *
+ * @return host name, e.g. service.iris.edu
+ *
+ * @warning User owns the host name and is responsible for freeing it
+ */
+static char *
+url_host(char *url) {
+    char *p = NULL;
+    char *host = NULL;
+    if((p = strstr(url, "://"))) {
+        url = p + 3;
+    }
+    host = strdup(url);
+    host[strcspn(host, "/?#")] = 0;
+    if((p = strrchr(host, '@'))) {
+        memmove(host, p + 1, strlen(p + 1) + 1);
+    }
+    return host;
+}
+
+/**
+ * Take a token from the rate limit of a host
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param host  host name
+ * @param now   current time, see now_seconds()
+ *
+ * @return 0 if a request may be made now, otherwise the time in seconds to
+ *    wait for the next token
+ */
+static double
+host_take_token(char *host, double now) {
+    token_bucket *b = NULL;
+    if(_RATE <= 0.0 || !host) {
+        return 0.0;
+    }
+    if(!_BUCKETS) {
+        _BUCKETS = dict_new();
+    }
+    if(!(b = dict_get(_BUCKETS, host))) {
+        b = calloc(1, sizeof(token_bucket));
+        b->tokens = _RATE_BURST;
+        b->last = now;
+        dict_put(_BUCKETS, host, b);
+    }
+    b->tokens += (now - b->last) * _RATE;
+    if(b->tokens > _RATE_BURST) {
+        b->tokens = _RATE_BURST;
+    }
+    b->last = now;
+    if(b->tokens >= 1.0) {
+        b->tokens -= 1.0;
+        return 0.0;
+    }
+    return (1.0 - b->tokens) / _RATE;
+}
+
+#if TIME_IN_US
+#define TIMING_INFO(curl, info, dst) do {            \
+        curl_off_t v_ = 0;                           \
+        curl_easy_getinfo(curl, info##_T, &v_);      \
+        dst = (double) v_ / 1e6;                     \
+    } while(0)
+#define TIMING_SIZE(curl, info, dst) do {            \
+        curl_off_t v_ = 0;                           \
+        curl_easy_getinfo(curl, info##_T, &v_);      \
+        dst = (int64_t) v_;                          \
+    } while(0)
+#else
+#define TIMING_INFO(curl, info, dst) do {            \
+        double v_ = 0.0;                             \
+        curl_easy_getinfo(curl, info, &v_);          \
+        dst = v_;                                    \
+    } while(0)
+#define TIMING_SIZE(curl, info, dst) do {            \
+        double v_ = 0.0;                             \
+        curl_easy_getinfo(curl, info, &v_);          \
+        dst = (int64_t) v_;                          \
+    } while(0)
+#endif
+
+/**
+ * Limit the total bandwidth used by all transfers
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param bytes_per_second  bytes per second received by all transfers, 0 for no limit [0]
+ *
+ * @note The bandwidth is divided between the transfers in flight across all
+ *    \ref fern_loop in proportion to their weight, see
+ *    request_set_bandwidth_weight().  Bandwidth a transfer does not use, e.g.
+ *    from a slow server, is given to the other transfers.  Shares are
+ *    updated about once a second
+ */
+void
+request_set_bandwidth(double bytes_per_second) {
+    _BANDWIDTH = (bytes_per_second < 0.0) ? 0.0 : bytes_per_second;
+    _SHARED_AT = 0.0;
+    for(size_t i = 0; i < xarray_length(_FLOWING); i++) {
+        _FLOWING[i]->bw_cap = 0.0;
+    }
+}
+
+/**
+ * Set the share of the bandwidth given to a group of transfers
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param group   group name, e.g. data center, as given to fern_loop_add()
+ * @param weight  relative weight of each transfer in the group [1]
+ *
+ * @note Transfers without a group have a weight of 1
+ */
+void
+request_set_bandwidth_weight(char *group, double weight) {
+    double *w = NULL;
+    if(!group || weight <= 0.0) {
+        return;
+    }
+    if(!_WEIGHTS) {
+        _WEIGHTS = dict_new();
+    }
+    if(!(w = dict_get(_WEIGHTS, group))) {
+        w = calloc(1, sizeof(double));
+        dict_put(_WEIGHTS, group, w);
+    }
+    *w = weight;
+    _SHARED_AT = 0.0;
+}
+
+/**
+ * Share the bandwidth limit with other processes
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param file  file mapped as shared memory, e.g. /dev/shm/fern-bandwidth,
+ *              NULL to stop sharing
+ *
+ * @return 1 on success, 0 if the file could not be mapped
+ *
+ * @note Processes using the same file and the same limit, see
+ *    request_set_bandwidth(), divide the limit between them in proportion to
+ *    the weight of their transfers in flight.  Up to 64 processes may share
+ *    a file, processes that exit or stop updating are ignored after 5 seconds
+ */
+int
+request_set_bandwidth_shared(char *file) {
+    int fd = -1;
+    void *p = NULL;
+    if(_SHM) {
+        pid_t pid = getpid();
+        for(int i = 0; i < BANDWIDTH_SLOTS; i++) {
+            __sync_bool_compare_and_swap(&_SHM->slot[i].pid, pid, 0);
+        }
+        munmap(_SHM, sizeof(bandwidth_shm));
+        _SHM = NULL;
+    }
+    if(!file) {
+        return 1;
+    }
+    if((fd = open(file, O_RDWR | O_CREAT, 0644)) < 0) {
+        printf("Error opening bandwidth file: %s: %s\n", file, strerror(errno));
+        return 0;
+    }
+    if(ftruncate(fd, sizeof(bandwidth_shm)) != 0) {
+        printf("Error sizing bandwidth file: %s: %s\n", file, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    p = mmap(NULL, sizeof(bandwidth_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        printf("Error mapping bandwidth file: %s: %s\n", file, strerror(errno));
+        return 0;
+    }
+    _SHM = (bandwidth_shm *) p;
+    _SHARED_AT = 0.0;
+    return 1;
+}
+
+/**
+ * Get the bandwidth weight of a transfer
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer
+ *
+ * @return weight of the transfer's group, 1 by default
+ *
+ * @note Groups of the form NAME,URL, e.g. from the federated catalog, also
+ *    match a weight set for NAME
+ */
+static double
+bandwidth_weight(transfer *t) {
+    double *w = NULL;
+    char name[128] = {0};
+    if(!t->group || !_WEIGHTS) {
+        return 1.0;
+    }
+    if((w = dict_get(_WEIGHTS, t->group))) {
+        return *w;
+    }
+    fern_strlcpy(name, t->group, sizeof(name));
+    name[strcspn(name, ",")] = 0;
+    if((w = dict_get(_WEIGHTS, name))) {
+        return *w;
+    }
+    return 1.0;
+}
+
+/**
+ * Publish the weight of this process and get the weight of all processes
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param weight  total weight of the transfers in flight in this process
+ *
+ * @return total weight of the transfers in flight in all processes sharing
+ *    the bandwidth, weight if not shared
+ *
+ * @note Slots are claimed without a lock, each process only writes its own
+ */
+static double
+bandwidth_publish(double weight) {
+    struct timespec ts;
+    double now = 0.0;
+    double total = 0.0;
+    bandwidth_slot *mine = NULL;
+    pid_t pid = getpid();
+    if(!_SHM) {
+        return weight;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+    for(int i = 0; i < BANDWIDTH_SLOTS && !mine; i++) {
+        if(_SHM->slot[i].pid == pid) {
+            mine = &_SHM->slot[i];
+        }
+    }
+    for(int i = 0; i < BANDWIDTH_SLOTS && !mine; i++) {
+        bandwidth_slot *s = &_SHM->slot[i];
+        int32_t old = s->pid;
+        if((old == 0 || now - s->updated > BANDWIDTH_STALE ||
+            (kill(old, 0) != 0 && errno == ESRCH)) &&
+           __sync_bool_compare_and_swap(&s->pid, old, pid)) {
+            mine = s;
+        }
+    }
+    if(mine) {
+        mine->weight = weight;
+        mine->updated = now;
+    }
+    for(int i = 0; i < BANDWIDTH_SLOTS; i++) {
+        bandwidth_slot *s = &_SHM->slot[i];
+        if(s->pid != 0 && s != mine && now - s->updated <= BANDWIDTH_STALE) {
+            total += s->weight;
+        }
+    }
+    return total + weight;
+}
+
+/**
+ * Divide the bandwidth limit between the transfers in flight
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param force  update now, otherwise only once a second
+ *
+ * @note Each transfer is given a share in proportion to its weight.  A
+ *    transfer that used less than 80% of its share since the last update is
+ *    limited to a little more than it used and the remainder is divided
+ *    between the others.  Shares are enforced by bandwidth_take()
+ */
+static void
+bandwidth_share(int force) {
+    size_t n = xarray_length(_FLOWING);
+    double now = now_seconds();
+    double weight = 0.0;
+    double total = 0.0;
+    double budget = 0.0;
+    double *want = NULL;
+    int *fixed = NULL;
+    int changed = TRUE;
+    if(_BANDWIDTH <= 0.0 || (!force && now - _SHARED_AT < BANDWIDTH_INTERVAL)) {
+        return;
+    }
+    _SHARED_AT = now;
+    for(size_t i = 0; i < n; i++) {
+        weight += bandwidth_weight(_FLOWING[i]);
+    }
+    total = bandwidth_publish(weight);
+    if(n == 0) {
+        return;
+    }
+    budget = _BANDWIDTH * weight / total;
+    want  = calloc(n, sizeof(double));
+    fixed = calloc(n, sizeof(int));
+    // Measure what each transfer used of its last share
+    for(size_t i = 0; i < n; i++) {
+        transfer *t = _FLOWING[i];
+        int64_t bytes = 0;
+        double dt = now - t->bw_since;
+        want[i] = -1.0;
+        TIMING_SIZE(t->curl, CURLINFO_SIZE_DOWNLOAD, bytes);
+        if(t->bw_cap > 0.0 && dt >= BANDWIDTH_INTERVAL) {
+            double rate = (double) (bytes - t->bw_bytes) / dt;
+            if(rate < 0.8 * t->bw_cap) {
+                want[i] = fmax(1.25 * rate, BANDWIDTH_MIN);
+            }
+        }
+        if(t->bw_cap <= 0.0 || dt >= BANDWIDTH_INTERVAL) {
+            t->bw_bytes = bytes;
+            t->bw_since = now;
+        }
+    }
+    // Weighted water filling: satisfy small demands, divide the rest
+    while(changed) {
+        changed = FALSE;
+        double left = budget;
+        double w = 0.0;
+        for(size_t i = 0; i < n; i++) {
+            if(fixed[i]) {
+                left -= want[i];
+            } else {
+                w += bandwidth_weight(_FLOWING[i]);
+            }
+        }
+        for(size_t i = 0; i < n && w > 0.0; i++) {
+            double share = left * bandwidth_weight(_FLOWING[i]) / w;
+            if(!fixed[i] && want[i] >= 0.0 && want[i] < share) {
+                fixed[i] = TRUE;
+                changed = TRUE;
+            }
+        }
+        if(!changed) {
+            for(size_t i = 0; i < n; i++) {
+                if(!fixed[i]) {
+                    want[i] = left * bandwidth_weight(_FLOWING[i]) / w;
+                }
+            }
+        }
+    }
+    for(size_t i = 0; i < n; i++) {
+        transfer *t = _FLOWING[i];
+        if(t->bw_cap <= 0.0) {
+            t->bw_last = now;
+            t->bw_tokens = fmax(want[i], BANDWIDTH_MIN) * BANDWIDTH_BURST;
+        }
+        t->bw_cap = fmax(want[i], BANDWIDTH_MIN);
+    }
+    FREE(want);
+    FREE(fixed);
+}
+
+/**
+ * Add or remove a transfer from the bandwidth shares
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t        transfer starting or stopping
+ * @param flowing  TRUE if the transfer is starting, FALSE if stopping
+ *
+ */
+static void
+bandwidth_flowing(transfer *t, int flowing) {
+    if(flowing) {
+        if(!_FLOWING) {
+            _FLOWING = xarray_new('p');
+        }
+        t->bw_cap = 0.0;
+        t->paused = FALSE;
+        _FLOWING = xarray_append(_FLOWING, t);
+    } else {
+        for(size_t i = 0; i < xarray_length(_FLOWING); i++) {
+            if(_FLOWING[i] == t) {
+                xarray_delete(_FLOWING, (int) i);
+                break;
+            }
+        }
+    }
+    bandwidth_share(TRUE);
+}
+
+/**
+ * Add the tokens a transfer gained since they were last added
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t    transfer
+ * @param now  current time, see now_seconds()
+ *
+ */
+static void
+bandwidth_refill(transfer *t, double now) {
+    t->bw_tokens += (now - t->bw_last) * t->bw_cap;
+    if(t->bw_tokens > t->bw_cap * BANDWIDTH_BURST) {
+        t->bw_tokens = t->bw_cap * BANDWIDTH_BURST;
+    }
+    t->bw_last = now;
+}
+
+/**
+ * Take bandwidth for data received by a transfer
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer
+ * @param n  number of bytes received
+ *
+ * @return TRUE if the data may be accepted, FALSE if the transfer must pause
+ *
+ * @note Data is accepted while the transfer has tokens left, which may then
+ *    go negative.  Paused transfers are resumed by bandwidth_resume()
+ */
+static int
+bandwidth_take(transfer *t, size_t n) {
+    if(t->bw_cap <= 0.0) {
+        return TRUE;
+    }
+    bandwidth_refill(t, now_seconds());
+    if(t->bw_tokens <= 0.0) {
+        t->paused = TRUE;
+        return FALSE;
+    }
+    t->bw_tokens -= (double) n;
+    return TRUE;
+}
+
+/**
+ * Resume paused transfers that have bandwidth available again
+ *
+ * @private
+ * @ingroup request
+ *
+ * @note Resuming a transfer delivers the data held while it was paused
+ */
+static void
+bandwidth_resume() {
+    double now = now_seconds();
+    for(size_t i = 0; i < xarray_length(_FLOWING); i++) {
+        transfer *t = _FLOWING[i];
+        if(!t->paused) {
+            continue;
+        }
+        if(t->bw_cap > 0.0) {
+            bandwidth_refill(t, now);
+        }
+        if(t->bw_cap <= 0.0 || t->bw_tokens > 0.0) {
+            t->paused = FALSE;
+            curl_easy_pause(t->curl, CURLPAUSE_CONT);
+        }
+    }
+}
+
+/**
+ * Get the time until a paused transfer may resume
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param wait  longest time to wait in seconds
+ *
+ * @return time in seconds until the next paused transfer may resume, at most wait
+ */
+static double
+bandwidth_wait(double wait) {
+    double now = now_seconds();
+    for(size_t i = 0; i < xarray_length(_FLOWING); i++) {
+        transfer *t = _FLOWING[i];
+        if(t->paused && t->bw_cap > 0.0) {
+            double dt = -(t->bw_tokens + (now - t->bw_last) * t->bw_cap) / t->bw_cap;
+            wait = fmin(wait, fmax(dt, 0.0));
+        }
+    }
+    return wait;
+}
+
+/**
+ * Get the process wide share for DNS, TLS sessions and connections
+ *
+ * @private
+ * @ingroup request
+ *
+ * @return curl share handle
+ *
+ * @note Sharing connections requires libcurl 7.57.0 or newer, otherwise only
+ *    DNS and TLS sessions are shared
+ */
+static CURLSH *
+request_share() {
+    if(!_SHARE) {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        if(!(_SHARE = curl_share_init())) {
+            return NULL;
+        }
+        curl_share_setopt(_SHARE, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+#if CURL_AT_LEAST_VERSION(7,23,0)
+        curl_share_setopt(_SHARE, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#endif
+#if CURL_AT_LEAST_VERSION(7,57,0)
+        curl_share_setopt(_SHARE, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+    }
+    return _SHARE;
+}
+
+/**
+ * Get a curl handle, reusing an idle handle if available
+ *
+ * @private
+ * @ingroup request
+ *
+ * @return curl easy handle attached to the shared cache, NULL on error
+ *
+ * @note Return the handle with curl_handle_put() when done
+ */
+static CURL *
+curl_handle_get() {
+    CURL *curl = NULL;
+    size_t n = xarray_length(_HANDLES);
+    if(n > 0) {
+        curl = _HANDLES[n-1];
+        xarray_pop(_HANDLES);
+    } else if(!(curl = curl_easy_init())) {
+        return NULL;
+    }
+    curl_easy_setopt(curl, CURLOPT_SHARE, request_share());
+#if CURL_AT_LEAST_VERSION(7,25,0)
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+    return curl;
+}
+
+/**
+ * Return a curl handle for reuse
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param curl  curl easy handle from curl_handle_get()
+ *
+ * @note Options are reset, the connection, DNS and TLS session caches are kept
+ */
+static void
+curl_handle_put(CURL *curl) {
+    if(!curl) {
+        return;
+    }
+    if(!_HANDLES) {
+        _HANDLES = xarray_new('p');
+    }
+    if(xarray_length(_HANDLES) >= HANDLE_POOL_MAX) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+    curl_easy_reset(curl);
+    _HANDLES = xarray_append(_HANDLES, curl);
+}
+
+/**
+ * Release the cached connections and reusable handles
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @note Requests may still be made afterwards, a new cache is created as needed.
+ *    Call at the end of a program to close connections cleanly
+ */
+void
+request_cleanup() {
+    for(size_t i = 0; i < xarray_length(_HANDLES); i++) {
+        curl_easy_cleanup(_HANDLES[i]);
+    }
+    xarray_free(_HANDLES);
+    _HANDLES = NULL;
+    if(_BUCKETS) {
+        dict_free(_BUCKETS, free);
+        _BUCKETS = NULL;
+    }
+    request_set_log(NULL);
+    request_set_bandwidth_shared(NULL);
+    if(_WEIGHTS) {
+        dict_free(_WEIGHTS, free);
+        _WEIGHTS = NULL;
+    }
+    xarray_free(_FLOWING);
+    _FLOWING = NULL;
+    if(_SHARE) {
+        curl_share_cleanup(_SHARE);
+        _SHARE = NULL;
+    }
+}
+
+/**
+ * Create a new transfer
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param url        URL to request data from
+ * @param post_data  POST data to send, NULL for a GET request
+ * @param group      group name for limiting transfers, may be NULL
+ * @param progress   show a progress bar
+ * @param done       completion callback
+ * @param data       completion callback data
+ *
+ * @return new transfer, NULL on error
+ *
+ * @note url, post_data and group are copied
+ */
+static transfer *
+transfer_new(char *url, char *post_data, char *group, int progress,
+             request_callback done, void *data) {
+    transfer *t = calloc(1, sizeof(transfer));
+    t->sinks = xarray_new('p');
+    t->keep_data = 1;
+    if(!(t->curl = curl_handle_get())) {
+        xarray_free(t->sinks);
+        FREE(t);
+        return NULL;
+    }
+    zarray_init(&t->data);
+    t->url       = strdup(url);
+    t->post_data = (post_data) ? strdup(post_data) : NULL;
+    t->group     = (group) ? strdup(group) : NULL;
+    t->host      = url_host(url);
+    t->progress  = progress;
+    t->done      = done;
+    t->userdata  = data;
+
+    t->prog.curl = t->curl;
+    t->prog.last_dlnow = -1;
+    memset(t->dnld_params.remote_fname, 0, sizeof(t->dnld_params.remote_fname));
+
+    // URL
+    curl_easy_setopt(t->curl, CURLOPT_URL, t->url);
+    // Set User-Agent
+    t->list = curl_slist_append(t->list, "User-Agent: sac/102.0");
+    // Peer Verification
+    //curl_easy_setopt(t->curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    // Hostname Verificaiton
+    //curl_easy_setopt(t->curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    // Callback to collect data
+    curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, transfer_write);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, (void *) t);
+
+    // Callback to parse header data
+    curl_easy_setopt(t->curl, CURLOPT_HEADERFUNCTION, dnld_header_parse);
+    curl_easy_setopt(t->curl, CURLOPT_HEADERDATA, &t->dnld_params);
+
+    /* enable all supported built-in compressions */
+    curl_easy_setopt(t->curl, CURLOPT_ACCEPT_ENCODING, "");
+
+    // Setup POST if necessary
+    if(t->post_data) {
+        t->list = curl_slist_append(t->list, "Content-Type: text/plain");
+        curl_easy_setopt(t->curl, CURLOPT_POST, 1); // Send a POST
+        curl_easy_setopt(t->curl, CURLOPT_POSTFIELDS, t->post_data); // Send post data
+    }
+    curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->list);
+    // Verbose
+    //curl_easy_setopt(t->curl, CURLOPT_VERBOSE, 1L);
+    return t;
+}
+
+/**
+ * Free a transfer
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer to free
+ *
+ */
+static void
+transfer_free(transfer *t) {
+    if(t) {
+        curl_slist_free_all(t->list);
+        curl_handle_put(t->curl);
+        xarray_free_items(t->sinks, free);
+        xarray_free(t->sinks);
+        FREE(t->data.data);
+        FREE(t->url);
+        FREE(t->post_data);
+        FREE(t->post_key);
+        FREE(t->post_buf);
+        FREE(t->group);
+        FREE(t->host);
+        cache_entry_free(t->cached);
+        FREE(t);
+    }
+}
+
+/**
+ * Callback supplying streamed POST data to curl
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param buf     output buffer
+ * @param size    size of each item
+ * @param nitems  number of items that fit in buf
+ * @param userp   transfer
+ *
+ * @return number of bytes written to buf, 0 after the last line,
+ *    CURL_READFUNC_ABORT if a line is longer than POST_LINE_MAX - 1
+ *
+ * @note Lines are formatted one at a time, the POST data is never held in
+ *    memory as a whole
+ */
+static size_t
+transfer_read(char *buf, size_t size, size_t nitems, void *userp) {
+    int k = 0;
+    size_t n = 0;
+    size_t nmax = size * nitems;
+    transfer *t = (transfer *) userp;
+    while(n < nmax) {
+        if(t->post_off >= t->post_len) {
+            if((k = t->post_fn(t->post_fn_data, t->post_line, t->post_buf, POST_LINE_MAX)) < 0) {
+                break;
+            }
+            if(k >= POST_LINE_MAX) {
+                printf("Error: line %zu of POST data is longer than %d bytes\n",
+                       t->post_line, POST_LINE_MAX - 1);
+                return CURL_READFUNC_ABORT;
+            }
+            t->post_line++;
+            t->post_off = 0;
+            t->post_len = (size_t) k;
+            continue;
+        }
+        size_t m = t->post_len - t->post_off;
+        if(m > nmax - n) {
+            m = nmax - n;
+        }
+        memcpy(buf + n, t->post_buf + t->post_off, m);
+        t->post_off += m;
+        n += m;
+    }
+    return n;
+}
+
+/**
+ * Restart streamed POST data from the first line
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer
+ *
+ */
+static void
+transfer_rewind(transfer *t) {
+    t->post_line = 0;
+    t->post_off  = 0;
+    t->post_len  = 0;
+}
+
+/**
+ * Callback for curl to restart streamed POST data, e.g. on a redirect
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param userp   transfer
+ * @param offset  position to seek to
+ * @param origin  SEEK_SET, SEEK_CUR or SEEK_END
+ *
+ * @return CURL_SEEKFUNC_OK if restarted, CURL_SEEKFUNC_CANTSEEK otherwise
+ */
+static int
+transfer_seek(void *userp, curl_off_t offset, int origin) {
+    if(origin != SEEK_SET || offset != 0) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    transfer_rewind((transfer *) userp);
+    return CURL_SEEKFUNC_OK;
+}
+
+/**
+ * Send POST data line by line from a function
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t        transfer
+ * @param fn       function formatting each line, see \ref post_line_func
+ * @param fn_data  data passed to fn
+ *
+ * @return 1 on success, 0 if a line is longer than POST_LINE_MAX - 1
+ *
+ * @note The lines are formatted once here to find the length of the POST data
+ *    and a key for the cache, and again as curl sends them.  fn_data must
+ *    remain valid until the transfer completes
+ */
+static int
+transfer_post_lines(transfer *t, post_line_func fn, void *fn_data) {
+    int k = 0;
+    int64_t size = 0;
+    uint64_t h = 14695981039346656037ULL;
+    t->post_fn      = fn;
+    t->post_fn_data = fn_data;
+    t->post_buf     = calloc(POST_LINE_MAX, sizeof(char));
+    for(size_t i = 0; (k = fn(fn_data, i, t->post_buf, POST_LINE_MAX)) >= 0; i++) {
+        if(k >= POST_LINE_MAX) {
+            printf("Error: line %zu of POST data is longer than %d bytes\n", i, POST_LINE_MAX - 1);
+            return 0;
+        }
+        for(int j = 0; j < k; j++) {
+            h = (h ^ (uint8_t) t->post_buf[j]) * 1099511628211ULL;
+        }
+        size += (int64_t) k;
+    }
+    transfer_rewind(t);
+    fern_asprintf(&t->post_key, "lines %" PRId64 " %016" PRIx64, size, h);
+
+    t->list = curl_slist_append(t->list, "Content-Type: text/plain");
+    curl_easy_setopt(t->curl, CURLOPT_POST, 1);
+    curl_easy_setopt(t->curl, CURLOPT_READFUNCTION, transfer_read);
+    curl_easy_setopt(t->curl, CURLOPT_READDATA, (void *) t);
+    curl_easy_setopt(t->curl, CURLOPT_SEEKFUNCTION, transfer_seek);
+    curl_easy_setopt(t->curl, CURLOPT_SEEKDATA, (void *) t);
+    curl_easy_setopt(t->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) size);
+    curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->list);
+    return 1;
+}
+
+/**
+ * Get the key of the POST data of a transfer in the cache
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer
+ *
+ * @return POST data, a key for streamed POST data, or NULL for GET
+ */
+static char *
+transfer_post_key(transfer *t) {
+    return (t->post_fn) ? t->post_key : t->post_data;
+}
+
+/**
+ * Setup the progress bar for a transfer
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer
+ *
+ * @note The progress bar is only shown if stderr is a terminal
+ */
+static void
+transfer_progress(transfer *t) {
+    if(t->progress) {
+        if(!isatty(fileno(stderr))) {
+            t->progress = 0;
+        }
+    }
+    curl_easy_setopt(t->curl, CURLOPT_NOPROGRESS, ! t->progress);
+    if(t->progress) {
+        // Transfer Information
+#if CURL_AT_LEAST_VERSION(7,32,0)
+        curl_easy_setopt(t->curl, CURLOPT_XFERINFOFUNCTION, xferinfo);
+        curl_easy_setopt(t->curl, CURLOPT_XFERINFODATA, &t->prog);
+#else
+        curl_easy_setopt(t->curl, CURLOPT_PROGRESSFUNCTION, older_progress);
+        curl_easy_setopt(t->curl, CURLOPT_PROGRESSDATA, &t->prog);
+#endif
+    }
+}
+
+/**
+ * Complete a transfer and create its result
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t     transfer
+ * @param code  CURL return code of the transfer
+ *
+ * @return result with data and return codes
+ *
+ * @note Ownership of the returned data moves from the transfer to the result
+ */
+static result *
+transfer_result(transfer *t, int code) {
+    result *r = result_new();
+    curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &r->http_code);
+    r->filename = strdup(t->dnld_params.remote_fname);
+    result_from_curl(r, code, t->data.data, t->data.n);
+    if(r->data == t->data.data) {
+        t->data.data = NULL;
+    }
+    // CURLINFO_CONTENT_LENGTH_DOWNLOAD_T -- Content Body size
+    // https://stackoverflow.com/a/25878250 - Server provided File
+    if(t->progress) {
+        clear_line();
+    }
+    return r;
+}
+
+/**
+ * Get the network timing of a completed transfer
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t   transfer
+ * @param tm  output timing
+ *
+ */
+static void
+transfer_timing(transfer *t, request_timing *tm) {
+    memset(tm, 0, sizeof(request_timing));
+    TIMING_INFO(t->curl, CURLINFO_NAMELOOKUP_TIME,    tm->namelookup);
+    TIMING_INFO(t->curl, CURLINFO_CONNECT_TIME,       tm->connect);
+    TIMING_INFO(t->curl, CURLINFO_APPCONNECT_TIME,    tm->appconnect);
+    TIMING_INFO(t->curl, CURLINFO_STARTTRANSFER_TIME, tm->starttransfer);
+    TIMING_INFO(t->curl, CURLINFO_TOTAL_TIME,         tm->total);
+    TIMING_SIZE(t->curl, CURLINFO_SIZE_DOWNLOAD,      tm->bytes_down);
+    TIMING_SIZE(t->curl, CURLINFO_SIZE_UPLOAD,        tm->bytes_up);
+    TIMING_SIZE(t->curl, CURLINFO_SPEED_DOWNLOAD,     tm->speed);
+    tm->attempts = t->attempts;
+    tm->cached = FALSE;
+}
+
+/**
+ * Add a record for a request to the request log
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t          transfer
+ * @param code       CURL return code of the transfer
+ * @param http_code  HTTP response code of the transfer
+ * @param tm         timing of the transfer
+ * @param retry      if the transfer will be retried
+ *
+ * @note Nothing is written unless logging is on, see request_set_log()
+ */
+static void
+transfer_log(transfer *t, int code, long http_code, request_timing *tm, int retry) {
+    char date[64] = {0};
+    char *line = NULL;
+    cJSON *j = NULL;
+    time_t now = time(NULL);
+    if(!_LOG) {
+        return;
+    }
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    j = cJSON_CreateObject();
+    cJSON_AddStringToObject(j, "time", date);
+    cJSON_AddStringToObject(j, "method", (t->post_data || t->post_fn) ? "POST" : "GET");
+    cJSON_AddStringToObject(j, "url", t->url);
+    cJSON_AddStringToObject(j, "host", (t->host) ? t->host : "");
+    if(t->group) {
+        cJSON_AddStringToObject(j, "group", t->group);
+    }
+    cJSON_AddNumberToObject(j, "status", (double) http_code);
+    cJSON_AddNumberToObject(j, "curl_code", code);
+    if(code != CURLE_OK) {
+        cJSON_AddStringToObject(j, "error", curl_easy_strerror(code));
+    }
+    cJSON_AddNumberToObject(j, "bytes_down", (double) tm->bytes_down);
+    cJSON_AddNumberToObject(j, "bytes_up", (double) tm->bytes_up);
+    cJSON_AddNumberToObject(j, "attempt", tm->attempts);
+    cJSON_AddBoolToObject(j, "retry", retry);
+    cJSON_AddBoolToObject(j, "cached", tm->cached);
+    cJSON_AddNumberToObject(j, "dns", tm->namelookup);
+    cJSON_AddNumberToObject(j, "connect", tm->connect);
+    cJSON_AddNumberToObject(j, "tls", tm->appconnect);
+    cJSON_AddNumberToObject(j, "ttfb", tm->starttransfer);
+    cJSON_AddNumberToObject(j, "total", tm->total);
+    cJSON_AddNumberToObject(j, "speed", (double) tm->speed);
+    if((line = cJSON_PrintUnformatted(j))) {
+        fprintf(_LOG, "%s\n", line);
+        fflush(_LOG);
+        cJSON_free(line);
+    }
+    cJSON_Delete(j);
+}
+
+/**
+ * Look up the response to a transfer in the cache
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer
+ *
+ * @note A current response is used without contacting the server.  An expired
+ *    response is revalidated using its ETag or Last-Modified time, see
+ *    \ref cache
+ */
+static void
+transfer_cache_lookup(transfer *t) {
+    char *hdr = NULL;
+    cache_entry *e = NULL;
+    if(!(e = cache_get(t->url, transfer_post_key(t)))) {
+        return;
+    }
+    t->cached = e;
+    if(cache_entry_is_fresh(e)) {
+        return;
+    }
+    if(!*cache_entry_etag(e) && !*cache_entry_last_modified(e)) {
+        cache_entry_free(e);
+        t->cached = NULL;
+        return;
+    }
+    if(*cache_entry_etag(e)) {
+        fern_asprintf(&hdr, "If-None-Match: %s", cache_entry_etag(e));
+        t->list = curl_slist_append(t->list, hdr);
+        FREE(hdr);
+    }
+    if(*cache_entry_last_modified(e)) {
+        fern_asprintf(&hdr, "If-Modified-Since: %s", cache_entry_last_modified(e));
+        t->list = curl_slist_append(t->list, hdr);
+        FREE(hdr);
+    }
+    curl_easy_setopt(t->curl, CURLOPT_HTTPHEADER, t->list);
+}
+
+/**
+ * Complete a transfer with its cached response
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer with a cached response
+ *
+ * @return result with the cached data, as if returned by the server
+ *
+ * @note The cached data is passed to the consumers of the transfer
+ */
+static result *
+transfer_cached_result(transfer *t) {
+    result *r = result_new();
+    char *data = cache_entry_data(t->cached);
+    size_t n = cache_entry_len(t->cached);
+    r->code = CURLE_OK;
+    r->http_code = 200;
+    r->filename = strdup(t->dnld_params.remote_fname);
+    for(size_t i = 0; i < xarray_length(t->sinks); i++) {
+        sink *k = t->sinks[i];
+        if(k->func(data, n, k->data) != n) {
+            r->code = CURLE_WRITE_ERROR;
+            r->error = curl_easy_strerror(r->code);
+            return r;
+        }
+    }
+    if(t->keep_data) {
+        r->data = calloc(n + 1, sizeof(char));
+        memcpy(r->data, data, n);
+        r->n = n;
+    }
+    return r;
+}
+
+/**
+ * Check if a failed transfer should be retried
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t          transfer
+ * @param code       CURL return code of the transfer
+ * @param http_code  HTTP response code of the transfer
+ *
+ * @return 1 if the transfer should be retried, 0 otherwise
+ *
+ * @note Transfers that passed data to their consumers are not retried, as
+ *    the data cannot be taken back
+ */
+static int
+transfer_retryable(transfer *t, int code, long http_code) {
+    if(t->attempts > _RETRY_MAX || t->delivered > 0) {
+        return 0;
+    }
+    switch(code) {
+    case CURLE_OK:
+        return (http_code == 429 || http_code == 502 ||
+                http_code == 503 || http_code == 504);
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SSL_CONNECT_ERROR:
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Determine the delay before retrying a transfer
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param t  transfer
+ *
+ * @return delay in seconds
+ *
+ * @note The delay doubles with each attempt up to the maximum delay, with a
+ *    random jitter so concurrent transfers do not retry together.  A longer
+ *    delay requested with Retry-After, in seconds or as a date, is used instead
+ */
+static double
+transfer_retry_delay(transfer *t) {
+    char *ra = t->dnld_params.retry_after;
+    double delay = _RETRY_BASE * pow(2.0, (double) (t->attempts - 1));
+    if(delay > _RETRY_LIMIT) {
+        delay = _RETRY_LIMIT;
+    }
+    delay = delay / 2.0 + (delay / 2.0) * ((double) rand() / (double) RAND_MAX);
+    if(*ra) {
+        double after = 0.0;
+        if(isdigit((unsigned char) *ra)) {
+            after = atof(ra);
+        } else {
+            time_t when = curl_getdate(ra, NULL);
+            if(when > 0) {
+                after = difftime(when, time(NULL));
+            }
+        }
+        if(after > delay) {
+            delay = after;
+        }
+    }
+    return delay;
+}
+
+/**
+ * Queue a failed transfer to be tried again
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param loop   transfer loop
+ * @param t      transfer to retry
+ * @param delay  delay before starting the transfer in seconds
+ *
+ */
+static void
+transfer_retry(fern_loop *loop, transfer *t, double delay) {
+    t->data.n = 0;
+    if(t->data.data) {
+        t->data.data[0] = 0;
+    }
+    t->route = ROUTE_UNKNOWN;
+    memset(&t->dnld_params, 0, sizeof(t->dnld_params));
+    t->prog.last_dlnow = -1;
+    t->not_before = now_seconds() + delay;
+    loop->pending = xarray_append(loop->pending, t);
+}
+
+/**
+ * Create a new transfer loop
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ *
+ * @return new transfer loop, one transfer at a time
+ *
+ * @warning User owns the loop and must free it with fern_loop_free()
+ */
+fern_loop *
+fern_loop_new() {
+    fern_loop *loop = calloc(1, sizeof(fern_loop));
+    loop->multi = curl_multi_init();
+    loop->max_transfers = 1;
+    loop->max_per_group = 1;
+    loop->pending = xarray_new('p');
+    loop->active  = xarray_new('p');
+    return loop;
+}
+
+/**
+ * Free a transfer loop
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ *
+ * @param loop  loop to free
+ *
+ * @note Transfers that have not completed are discarded without calling
+ *    their completion callback
+ */
+void
+fern_loop_free(fern_loop *loop) {
+    if(loop) {
+        for(size_t i = 0; i < xarray_length(loop->active); i++) {
+            curl_multi_remove_handle(loop->multi, loop->active[i]->curl);
+            bandwidth_flowing(loop->active[i], FALSE);
+            transfer_free(loop->active[i]);
+        }
+        for(size_t i = 0; i < xarray_length(loop->pending); i++) {
+            transfer_free(loop->pending[i]);
+        }
+        xarray_free(loop->active);
+        xarray_free(loop->pending);
+        curl_multi_cleanup(loop->multi);
+        FREE(loop);
+    }
+}
+
+/**
+ * Set the maximum number of concurrent transfers
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ *
+ * @param loop  transfer loop
+ * @param n     maximum number of concurrent transfers, minimum of 1
+ *
+ * @note Progress bars are only shown when a single transfer is allowed
+ */
+void
+fern_loop_set_max_transfers(fern_loop *loop, int n) {
+    if(loop) {
+        loop->max_transfers = (n < 1) ? 1 : n;
+    }
+}
+
+/**
+ * Set the maximum number of concurrent transfers within a group
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ *
+ * @param loop  transfer loop
+ * @param n     maximum number of concurrent transfers per group, minimum of 1
+ *
+ */
+void
+fern_loop_set_max_per_group(fern_loop *loop, int n) {
+    if(loop) {
+        loop->max_per_group = (n < 1) ? 1 : n;
+    }
+}
+
+/**
+ * Add a URL to a transfer loop
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ * @private
+ *
+ * @param loop       transfer loop
+ * @param url        URL to request data from
+ * @param post_data  POST data to send, NULL for a GET request
+ * @param group      group name for limiting transfers, may be NULL
+ * @param progress   show a progress bar
+ * @param done       completion callback
+ * @param data       completion callback data
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int
+fern_loop_add_url(fern_loop *loop, char *url, char *post_data, char *group,
+                  int progress, request_callback done, void *data) {
+    transfer *t = NULL;
+    if(!(t = transfer_new(url, post_data, group, progress, done, data))) {
+        return 0;
+    }
+    loop->pending = xarray_append(loop->pending, t);
+    return 1;
+}
+
+/**
+ * Print POST data line by line
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param fn       function formatting each line, see \ref post_line_func
+ * @param fn_data  data passed to fn
+ *
+ */
+static void
+post_lines_print(post_line_func fn, void *fn_data) {
+    int k = 0;
+    char line[POST_LINE_MAX] = {0};
+    for(size_t i = 0; (k = fn(fn_data, i, line, sizeof(line))) >= 0; i++) {
+        printf("%s", line);
+    }
+    printf("\n");
+}
+
+/**
+ * Add a request to a transfer loop with POST data from a string or a function
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ * @private
+ *
+ * @param loop       transfer loop
+ * @param r          request to make
+ * @param post_data  POST data to send, NULL for a GET request or if fn is given
+ * @param fn         function formatting POST data line by line, may be NULL
+ * @param fn_data    data passed to fn
+ * @param group      group name for limiting transfers, may be NULL
+ * @param done       function called with the result when the transfer completes
+ * @param data       data passed to the done function
+ *
+ * @return 1 on success, 0 on failure
+ */
+static int
+fern_loop_add_post(fern_loop *loop, request *r, char *post_data,
+                   post_line_func fn, void *fn_data, char *group,
+                   request_callback done, void *data) {
+    int retval = 0;
+    char *url = NULL;
+    if(!loop || !r || !(url = request_to_url(r))) {
+        return 0;
+    }
+    if(r->verbose) {
+        printf("%s\n", url);
+        if(post_data) {
+            printf("%s\n", post_data);
+        }
+        if(fn) {
+            post_lines_print(fn, fn_data);
+        }
+    }
+    retval = fern_loop_add_url(loop, url, post_data, group, r->progress, done, data);
+    if(retval) {
+        transfer *t = loop->pending[xarray_length(loop->pending)-1];
+        if(fn && !transfer_post_lines(t, fn, fn_data)) {
+            // The POST data cannot be sent as given
+            xarray_pop(loop->pending);
+            transfer_free(t);
+            FREE(url);
+            return 0;
+        }
+        for(size_t i = 0; i < xarray_length(r->sinks); i++) {
+            sink *k = calloc(1, sizeof(sink));
+            *k = *r->sinks[i];
+            t->sinks = xarray_append(t->sinks, k);
+        }
+        t->keep_data = r->keep_data;
+        if(r->range_from > 0) {
+            char range[64] = {0};
+            t->range_from = r->range_from;
+            snprintf(range, sizeof(range), "%" PRId64 "-", t->range_from);
+            curl_easy_setopt(t->curl, CURLOPT_RANGE, range);
+            // Byte offsets are of the stored data, not a compressed response
+            curl_easy_setopt(t->curl, CURLOPT_ACCEPT_ENCODING, NULL);
+        } else {
+            transfer_cache_lookup(t);
+        }
+    }
+    FREE(url);
+    return retval;
+}
+
+/**
+ * Add a request to a transfer loop
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ *
+ * @param loop       transfer loop
+ * @param r          request to make
+ * @param post_data  POST data to send, NULL for a GET request
+ * @param group      group name for limiting transfers, e.g. data center, may be NULL
+ * @param done       function called with the result when the transfer completes
+ * @param data       data passed to the done function
+ *
+ * @return 1 on success, 0 on failure
+ *
+ * @note The request is not made until fern_loop_run() is called.  The URL and
+ *    POST data are copied, so the request may be freed after this call
+ *
+ * @warning The done function owns the result and must free it with result_free()
+ */
+int
+fern_loop_add(fern_loop *loop, request *r, char *post_data, char *group,
+              request_callback done, void *data) {
+    return fern_loop_add_post(loop, r, post_data, NULL, NULL, group, done, data);
+}
+
+/**
+ * Add a request to a transfer loop with POST data formatted line by line
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ *
+ * @param loop       transfer loop
+ * @param r          request to make
+ * @param fn         function formatting each line of POST data, see \ref post_line_func
+ * @param fn_data    data passed to fn
+ * @param group      group name for limiting transfers, e.g. data center, may be NULL
+ * @param done       function called with the result when the transfer completes
+ * @param data       data passed to the done function
+ *
+ * @return 1 on success, 0 on failure, including a line of POST data
+ *    longer than 2047 bytes
+ *
+ * @note Lines are formatted as they are sent, so large POST data is never
+ *    copied into a single string.  The request may be freed after this call
+ *
+ * @warning fn_data must remain valid until the done function is called
+ */
+int
+fern_loop_add_lines(fern_loop *loop, request *r, post_line_func fn, void *fn_data,
+                    char *group, request_callback done, void *data) {
+    if(!fn) {
+        return 0;
+    }
+    return fern_loop_add_post(loop, r, NULL, fn, fn_data, group, done, data);
+}
+
+/**
+ * Count the transfers in flight within a group
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ * @private
+ *
+ * @param loop   transfer loop
+ * @param group  group name
+ *
+ * @return number of active transfers within the group
+ */
+static int
+fern_loop_group_count(fern_loop *loop, char *group) {
+    int n = 0;
+    for(size_t i = 0; i < xarray_length(loop->active); i++) {
+        char *g = loop->active[i]->group;
+        if(g && group && strcmp(g, group) == 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * Start waiting transfers, honoring the transfer limits
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ * @private
+ *
+ * @param loop   transfer loop
+ *
+ */
+static void
+fern_loop_start(fern_loop *loop) {
+    size_t i = 0;
+    double now = now_seconds();
+    // Current cached responses do not need a connection
+    while(i < xarray_length(loop->pending)) {
+        transfer *t = loop->pending[i];
+        if(!t->cached || !cache_entry_is_fresh(t->cached)) {
+            i++;
+            continue;
+        }
+        xarray_delete(loop->pending, (int) i);
+        result *r = transfer_cached_result(t);
+        r->timing.bytes_down = (int64_t) cache_entry_len(t->cached);
+        r->timing.cached = TRUE;
+        transfer_log(t, r->code, r->http_code, &r->timing, FALSE);
+        if(t->done) {
+            t->done(r, t->userdata);
+        } else {
+            result_free(r);
+        }
+        transfer_free(t);
+    }
+    i = 0;
+    while(i < xarray_length(loop->pending)) {
+        double wait = 0.0;
+        transfer *t = loop->pending[i];
+        if(xarray_length(loop->active) >= (size_t) loop->max_transfers) {
+            break;
+        }
+        if(t->not_before > now) {
+            i++;
+            continue;
+        }
+        if(t->group && fern_loop_group_count(loop, t->group) >= loop->max_per_group) {
+            i++;
+            continue;
+        }
+        if((wait = host_take_token(t->host, now)) > 0.0) {
+            t->not_before = now + wait;
+            i++;
+            continue;
+        }
+        xarray_delete(loop->pending, (int) i);
+        t->attempts++;
+        if(loop->max_transfers > 1) {
+            t->progress = 0;
+        }
+        transfer_progress(t);
+        if(t->post_fn) {
+            transfer_rewind(t);
+        }
+        curl_multi_add_handle(loop->multi, t->curl);
+        loop->active = xarray_append(loop->active, t);
+        bandwidth_flowing(t, TRUE);
+    }
+}
+
+/**
+ * Complete finished transfers and call their completion functions
+ *
+ * @memberof fern_loop
+ * @ingroup request
+ * @private
+ *
+ * @param loop   transfer loop
+ *
+ */
+static void
+fern_loop_finish(fern_loop *loop) {
+    int nmsg = 0;
+    CURLMsg *msg = NULL;
+    while((msg = curl_multi_info_read(loop->multi, &nmsg))) {
+        transfer *t = NULL;
+        if(msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+        for(size_t i = 0; i < xarray_length(loop->active); i++) {
+            if(loop->active[i]->curl == msg->easy_handle) {
+                t = loop->active[i];
+                xarray_delete(loop->active, (int) i);
+                break;
+            }
+        }
+        if(!t) {
+            continue;
         }
-        s = tmp;
+        int code = msg->data.result;
+        long http_code = 0;
+        int retry = FALSE;
+        result *r = NULL;
+        request_timing tm;
+        curl_multi_remove_handle(loop->multi, t->curl);
+        bandwidth_flowing(t, FALSE);
+        curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &http_code);
+        transfer_timing(t, &tm);
+        tm.cached = (code == CURLE_OK && http_code == 304 && t->cached);
+        retry = transfer_retryable(t, code, http_code);
+        transfer_log(t, code, http_code, &tm, retry);
+        if(retry) {
+            char why[128] = {0};
+            double delay = transfer_retry_delay(t);
+            if(code != CURLE_OK) {
+                fern_strlcpy(why, curl_easy_strerror(code), sizeof(why));
+            } else {
+                snprintf(why, sizeof(why), "HTTP %ld", http_code);
+            }
+            if(t->progress) {
+                clear_line();
+            }
+            printf(" WARNING: %s from %s, retrying in %.1f s [%d/%d]\n",
+                   why, t->host, delay, t->attempts, _RETRY_MAX);
+            transfer_retry(loop, t, delay);
+            continue;
+        }
+        if(code == CURLE_OK && http_code == 304 && t->cached) {
+            // Cached response is still current
+            cache_refresh(t->cached);
+            r = transfer_cached_result(t);
+            if(t->progress) {
+                clear_line();
+            }
+        } else {
+            r = transfer_result(t, code);
+            if(code == CURLE_OK && http_code == 200 && t->keep_data && t->range_from == 0) {
+                cache_put(t->url, transfer_post_key(t), r->data, r->n,
+                          t->dnld_params.etag, t->dnld_params.last_modified);
+            }
+        }
+        r->timing = tm;
+        if(t->done) {
+            t->done(r, t->userdata);
+        } else {
+            result_free(r);
+        }
+        transfer_free(t);
     }
-    return s;
 }
 
 /**
- * Convert a request to a URL
+ * Make progress on the transfers in a loop without blocking
  *
- * @memberof request
+ * @memberof fern_loop
  * @ingroup request
  *
- * @private
+ * @param loop  transfer loop
  *
- * @param r  request to convert to a URL
+ * @return number of transfers not yet completed
  *
- * @return URL character string
+ * @note Waiting transfers are started, data is read and completion functions
+ *    of finished transfers are called.  Use with fern_loop_fdset() and
+ *    fern_loop_timeout() to run a loop from an application's own event loop
  *
- * @warning The output character string is owned by the user and it is the user's 
- *    responsibility to free the underlying memory with \ref free
+ * @code
+ *   while(fern_loop_perform(loop) > 0) {
+ *       // Wait on the loop and other work, e.g. with select()
+ *       fern_loop_fdset(loop, &rd, &wr, &ex, &maxfd);
+ *       ms = fern_loop_timeout(loop);
+ *       ...
+ *   }
+ * @endcode
  */
-char *
-request_to_url(request *r) {
-    /// Data request would be from
-    ///   - Reading a station file and eventid (time) + duration
-    ///   - Taking a station search parameter and eventid (time + location)
-    ///       - Make the stations request
-    ///       - Make the availability request
-    ///   - After avail request, then the data request
-    ///   - How to restart a data download after stopping?
-    ///     - Chunk up request and save
-    char *out = NULL;
-    size_t nalloc = 256;
-    size_t n = 0;
-    char tmp[128];
-
-    if(!r->url) {
-        return NULL;
-    }
-    out = str_grow(out, &nalloc, n, strlen(r->url));
-    fern_strlcat(out, r->url, nalloc);
-    n = strlen(out);
-    char **keys = dict_keys(r->args);
-    for(size_t i = 0; keys[i]; i++) {
-        arg_to_string(dict_get(r->args, keys[i]), tmp, sizeof(tmp));
-        out = str_grow(out, &nalloc, n, strlen(tmp) + strlen(keys[i] + 2) );
-        snprintf(out+n, nalloc-n, "%s=%s&", keys[i], tmp);
-        n = strlen(out);
-    }
-    dict_keys_free(keys);
-
-    if(out[strlen(out)-1] == '&') {
-        out[strlen(out)-1] = 0;
+int
+fern_loop_perform(fern_loop *loop) {
+    int running = 0;
+    if(!loop) {
+        return 0;
     }
-
-
-    return out;
+    fern_loop_start(loop);
+    bandwidth_share(FALSE);
+    bandwidth_resume();
+    curl_multi_perform(loop->multi, &running);
+    fern_loop_finish(loop);
+    fern_loop_start(loop);
+    return (int) (xarray_length(loop->active) + xarray_length(loop->pending));
 }
 
-
 /**
- * Set the URL for the request
+ * Get the file descriptors a loop is waiting on
  *
- * @memberof request
+ * @memberof fern_loop
  * @ingroup request
  *
- * @param r        Request to modify
- * @param url      URL of the request
+ * @param loop   transfer loop
+ * @param rd     file descriptors waiting to be read, added to
+ * @param wr     file descriptors waiting to be written, added to
+ * @param ex     file descriptors waiting for exceptions, added to
+ * @param maxfd  largest file descriptor, -1 if none
  *
- * @note If the request does not exist, nothing is done
+ * @return 1 on success, 0 on error
  *
+ * @note Call fern_loop_perform() when a file descriptor is ready or after
+ *    fern_loop_timeout(), file descriptors may change after each call
  */
-void
-request_set_url(request *r, char *url) {
-    if(!r) {
-        return;
+int
+fern_loop_fdset(fern_loop *loop, fd_set *rd, fd_set *wr, fd_set *ex, int *maxfd) {
+    *maxfd = -1;
+    if(!loop) {
+        return 0;
     }
-    FREE(r->url);
-    r->url = strdup(url);
+    return curl_multi_fdset(loop->multi, rd, wr, ex, maxfd) == CURLM_OK;
 }
+
 /**
- * Get the URL for the request
+ * Get the time until a loop needs to make progress
  *
- * @memberof request
+ * @memberof fern_loop
  * @ingroup request
  *
- * @param r        Request to get the URL from
+ * @param loop  transfer loop
  *
- * If the request or the URL does not exist, NULL is returned
+ * @return time in milliseconds to wait before calling fern_loop_perform(),
+ *    at most 1000, -1 if there are no transfers
  *
- * @warning The URL is owned by the request and should not be modified
+ * @note Transfers waiting to be retried, for the request rate to allow
+ *    them or for bandwidth are included
  */
-char *
-request_get_url(request *r) {
-    if(!r) {
-        return NULL;
+int
+fern_loop_timeout(fern_loop *loop) {
+    long ms = -1;
+    double now = now_seconds();
+    double wait = 1.0;
+    if(!loop || (xarray_length(loop->active) == 0 && xarray_length(loop->pending) == 0)) {
+        return -1;
     }
-    return r->url;
+    if(xarray_length(loop->active) > 0) {
+        wait = bandwidth_wait(wait);
+    }
+    for(size_t i = 0; i < xarray_length(loop->pending); i++) {
+        double dt = loop->pending[i]->not_before - now;
+        if(dt > 0.0 && dt < wait) {
+            wait = dt;
+        }
+    }
+    if(xarray_length(loop->active) > 0 &&
+       curl_multi_timeout(loop->multi, &ms) == CURLM_OK &&
+       ms >= 0 && (double) ms < wait * 1000.0) {
+        return (int) ms;
+    }
+    return (int) ceil(wait * 1000.0);
 }
 
 /**
- * Set an argument for the request
+ * Wait for activity on the transfers in a loop
  *
- * @memberof request
+ * @memberof fern_loop
  * @ingroup request
  *
- * @param r     Request to add the argument to
- * @param key   Name of the argument
- * @param a     Value of the Argument
+ * @param loop     transfer loop
+ * @param timeout  maximum time to wait in milliseconds
  *
- * @note Undefined requests, keys, or argument results in nothing 
+ * @note Returns early when data arrives, then call fern_loop_perform()
  */
 void
-request_set_arg(request *r, char *key, Arg *a) {
-    if(!r || !r->args || !key || !a) {
+fern_loop_wait(fern_loop *loop, int timeout) {
+    int numfds = 0;
+    if(!loop || timeout <= 0) {
         return;
     }
-    dict_put(r->args, key, a);
+    if(xarray_length(loop->active) == 0) {
+        usleep((useconds_t) timeout * 1000);
+        return;
+    }
+    curl_multi_wait(loop->multi, NULL, 0, timeout, &numfds);
 }
 
 /**
- * Get an argument for the request
+ * Run all transfers in a loop until they complete
  *
- * @memberof request
+ * @memberof fern_loop
  * @ingroup request
  *
- * @param r     Request to get the argument from
- * @param key   Name of the argument
+ * @param loop  transfer loop
  *
- * @note Undefined requests, keys, or unknown keys results in nothing
- * @warning Arugment is owned by the request and must not be modified
+ * @note Completion functions are called from within this function and may
+ *    add further transfers to the loop
  */
-Arg *
-request_get_arg(request *r, char *key) {
-    if(!r || !r->args || !key) {
-        return NULL;
+void
+fern_loop_run(fern_loop *loop) {
+    while(fern_loop_perform(loop) > 0) {
+        fern_loop_wait(loop, fern_loop_timeout(loop));
     }
-    return dict_get(r->args, key);
 }
 
 /**
- * Remove an argument for the request
+ * Store a result from a transfer
  *
- * @memberof request
+ * @private
  * @ingroup request
  *
- * @param r   Request to remove the argument from
- * @param key Name of the argument to remove
+ * @param r     result from a transfer
+ * @param data  location to store the result
  *
- * @return 1 if successful, 0 if not successful
  */
-int
-request_del_arg(request *r, char *key) {
-    if(!r || !r->args || !key) {
-        return 0;
-    }
-    return dict_remove(r->args, key, arg_free);
+static void
+result_store(result *r, void *data) {
+    result **out = (result **) data;
+    *out = r;
 }
 
+/**
+ * Create a result for a transfer that completed without one
+ *
+ * @memberof result
+ * @ingroup request
+ * @private
+ *
+ * @return new result with an error
+ *
+ * @note The transfer loop stopped before the transfer reported its outcome
+ */
+static result *
+result_missing(void) {
+    result *r = result_new();
+    r->code = CURLE_GOT_NOTHING;
+    r->error = "Transfer completed without a result";
+    return r;
+}
 
 /**
  * Make a request, with POST data if needed
@@ -479,6 +2631,7 @@ request_del_arg(request *r, char *key) {
  *
  * @param url         URL to request data from
  * @param post_data   POST data to send
+ * @param progress_bar  show a progress bar
  *
  * @return result with data and return codes
  *
@@ -487,96 +2640,15 @@ request_del_arg(request *r, char *key) {
  */
 result *
 request_url_post(char *url, char *post_data, int progress_bar) {
-    result *r = result_new();
-    struct myprogress prog;
-    dnld_params_t dnld_params;
-    CURL *curl;
-    struct curl_slist *list = NULL;
-
-    zarray data;
-    zarray_init(&data);
-
-    //curl_global_init(CURL_GLOBAL_DEFAULT);
-
-    curl = curl_easy_init();
-
-    prog.lastruntime[0] = 0;
-    prog.lastruntime[1] = 0;
-    prog.lastruntime[2] = 0;
-    prog.prog[0] = 0;
-    prog.prog[1] = 0;
-    prog.prog[2] = 0;
-    prog.curl = curl;
-    prog.last_dlnow = -1;
-    memset(dnld_params.remote_fname, 0, sizeof(dnld_params.remote_fname));
-    if(curl) {
-        // URL
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        // Set User-Agent
-        list = curl_slist_append(list, "User-Agent: sac/102.0");
-        // Peer Verification
-        //curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
-        // Hostname Verificaiton
-        //curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
-        // Callback to collect data
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, memory_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)& data);
-
-        // Callback to parse header data
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, dnld_header_parse);
-        curl_easy_setopt(curl, CURLOPT_HEADERDATA, &dnld_params);
-
-        /* enable all supported built-in compressions */
-        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
-
-        if(progress_bar) {
-            if(!isatty(fileno(stderr))) {
-                progress_bar = 0;
-            }
-        }
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, ! progress_bar);
-        if(progress_bar) {
-            // Transfer Information
-#if CURL_AT_LEAST_VERSION(7,32,0)
-            curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, xferinfo);
-            curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &prog);
-#else
-            curl_easy_setopt(curl, CURLOPT_PROGRESSFUNCTION, older_progress);
-            curl_easy_setopt(curl, CURLOPT_PROGRESSDATA, &prog);
-#endif
-        }
-
-        // Setup POST if necessary
-        if(post_data) {
-            list = curl_slist_append(list, "Content-Type: text/plain");
-            curl_easy_setopt(curl, CURLOPT_POST, 1); // Send a POST
-            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_data); // Send post data
-        }
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-        // Verbose
-        //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-
-        /* Perform the request, res will get the return code */
-
-        int code = curl_easy_perform(curl);
-
-        // Create Error result
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &r->http_code);
-        r->filename = strdup(dnld_params.remote_fname);
-        result_from_curl(r, code, data.data, data.n);
-
-        // CURLINFO_CONTENT_LENGTH_DOWNLOAD_T -- Content Body size
-        // https://stackoverflow.com/a/25878250 - Server provided File
-
-        // cleanup
-        curl_slist_free_all(list); // free the list
-        curl_easy_cleanup(curl);
+    result *r = NULL;
+    fern_loop *loop = fern_loop_new();
+    if(fern_loop_add_url(loop, url, post_data, NULL, progress_bar, result_store, &r)) {
+        fern_loop_run(loop);
     }
-    //curl_global_cleanup();
-    if(progress_bar) {
-        clear_line();
+    fern_loop_free(loop);
+    if(!r) {
+        r = result_missing();
     }
-
     return r;
 }
 
@@ -597,22 +2669,53 @@ request_url_post(char *url, char *post_data, int progress_bar) {
 result *
 request_post(request *r, char *post_data) {
     result *out = NULL;
-    char *url = NULL;
-    if(!(url = request_to_url(r))) {
+    fern_loop *loop = fern_loop_new();
+    if(!fern_loop_add(loop, r, post_data, NULL, result_store, &out)) {
         out = result_error(667, "Error constructing url");
         goto error;
     }
-    if(r->verbose) {
-        printf("%s\n", url);
-        if(post_data) {
-            printf("%s\n", post_data);
-        }
+    fern_loop_run(loop);
+    if(!out) {
+        out = result_missing();
     }
-    out = request_url_post(url, post_data, r->progress);
  error:
-    FREE(url);
+    fern_loop_free(loop);
+    return out;
+}
+/**
+ * Make a POST request with POST data formatted line by line
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param r        request to make
+ * @param fn       function formatting each line of POST data, see \ref post_line_func
+ * @param fn_data  data passed to fn
+ *
+ * @return result with data and return codes
+ *
+ * @note See fern_loop_add_lines()
+ *
+ * @warning It is the user's responsibility to free the result, use result_free()
+ *
+ */
+result *
+request_post_lines(request *r, post_line_func fn, void *fn_data) {
+    result *out = NULL;
+    fern_loop *loop = fern_loop_new();
+    if(!fern_loop_add_lines(loop, r, fn, fn_data, NULL, result_store, &out)) {
+        out = result_error(667, "Error constructing url");
+        goto error;
+    }
+    fern_loop_run(loop);
+    if(!out) {
+        out = result_missing();
+    }
+ error:
+    fern_loop_free(loop);
     return out;
 }
+
 /**
  * Make a GET request
  *
@@ -631,6 +2734,64 @@ request_get(request *r) {
     return request_post(r, NULL);
 }
 
+/**
+ * Make a POST request without waiting for it to complete
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param loop       transfer loop to make the request in
+ * @param r          request to make
+ * @param post_data  POST data to send
+ * @param done       function called with the result when the request completes
+ * @param data       data passed to the done function
+ *
+ * @return 1 on success, 0 on failure
+ *
+ * @note The request is made while the loop runs, see fern_loop_run() and
+ *    fern_loop_perform(), and may be freed after this call.  Requests are
+ *    grouped by host for fern_loop_set_max_per_group()
+ *
+ * @warning The done function owns the result and must free it with result_free()
+ */
+int
+request_post_async(fern_loop *loop, request *r, char *post_data,
+                   request_callback done, void *data) {
+    int retval = 0;
+    char *url = NULL;
+    char *host = NULL;
+    if(!loop || !r || !(url = request_to_url(r))) {
+        return 0;
+    }
+    host = url_host(url);
+    retval = fern_loop_add(loop, r, post_data, host, done, data);
+    FREE(host);
+    FREE(url);
+    return retval;
+}
+
+/**
+ * Make a GET request without waiting for it to complete
+ *
+ * @memberof request
+ * @ingroup request
+ *
+ * @param loop  transfer loop to make the request in
+ * @param r     request to make
+ * @param done  function called with the result when the request completes
+ * @param data  data passed to the done function
+ *
+ * @return 1 on success, 0 on failure
+ *
+ * @note See request_post_async()
+ *
+ * @warning The done function owns the result and must free it with result_free()
+ */
+int
+request_get_async(fern_loop *loop, request *r, request_callback done, void *data) {
+    return request_post_async(loop, r, NULL, done, data);
+}
+
 
 /**
  * Make a GET request
@@ -1088,6 +3249,30 @@ bail:
     return ret;
 }
 
+/**
+ * Copy a header value, without surrounding whitespace
+ *
+ * @private
+ * @ingroup request
+ *
+ * @param v     header value, not NUL terminated
+ * @param n     length of v
+ * @param dst   output value
+ * @param ndst  size of dst
+ *
+ */
+static void
+header_value(const char *v, size_t n, char *dst, size_t ndst) {
+    char *p = NULL;
+    if(n >= ndst) {
+        n = ndst - 1;
+    }
+    memcpy(dst, v, n);
+    dst[n] = 0;
+    p = fern_lstrip(fern_rstrip(dst));
+    memmove(dst, p, strlen(p) + 1);
+}
+
 /**
  * Parse the Download Header
  *
@@ -1114,6 +3299,17 @@ dnld_header_parse(void *hdr, size_t size, size_t nmemb, void *userdata) {
      * Content-Type: text/html
      * Content-Disposition: filename=name1367; charset=funny; option=strange
      */
+    if (cb > 5 && !strncasecmp(hdr_str, "ETag:", 5)) {
+        header_value(hdr_str + 5, cb - 5, dnld_params->etag, sizeof(dnld_params->etag));
+    }
+    if (cb > 12 && !strncasecmp(hdr_str, "Retry-After:", 12)) {
+        header_value(hdr_str + 12, cb - 12, dnld_params->retry_after,
+                     sizeof(dnld_params->retry_after));
+    }
+    if (cb > 14 && !strncasecmp(hdr_str, "Last-Modified:", 14)) {
+        header_value(hdr_str + 14, cb - 14, dnld_params->last_modified,
+                     sizeof(dnld_params->last_modified));
+    }
     if (!strncasecmp(hdr_str, cdtag, strlen(cdtag))) {
         //printf ("Found c-d: %s\n", hdr_str);
         int ret = get_oname_from_cd(hdr_str+strlen(cdtag), dnld_params->remote_fname);
@@ -1134,16 +3330,45 @@ dnld_header_parse(void *hdr, size_t size, size_t nmemb, void *userdata) {
  * @param contents  data
  * @param size      size of data
  * @param nmemb     number of items
- * @param userp     user data
+ * @param userp     transfer
  *
- * @return total size of data
+ * @return total size of data, less on error
  *
+ * @note Data from a successful response is passed to each consumer and kept
+ *    in memory if requested, data from an error response is kept in memory.
+ *    A full response (200) to a Range request stops the transfer.  The
+ *    transfer is paused while it is over its share of the bandwidth
  */
 static size_t
-memory_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+transfer_write(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
-    zarray *a = (zarray *) userp;
-    zarray_append(a, contents, realsize);
+    transfer *t = (transfer *) userp;
+    if(t->route == ROUTE_UNKNOWN) {
+        long code = 0;
+        curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &code);
+        t->route = (code >= 200 && code < 300) ? ROUTE_SINKS : ROUTE_MEMORY;
+        if(t->range_from > 0 && code == 200) {
+            t->route = ROUTE_ABORT;
+        }
+    }
+    if(t->route == ROUTE_ABORT) {
+        return 0;
+    }
+    if(!bandwidth_take(t, realsize)) {
+        return CURL_WRITEFUNC_PAUSE;
+    }
+    if(t->route == ROUTE_MEMORY || t->keep_data) {
+        zarray_append(&t->data, contents, realsize);
+    }
+    if(t->route == ROUTE_SINKS) {
+        for(size_t i = 0; i < xarray_length(t->sinks); i++) {
+            sink *k = t->sinks[i];
+            if(k->func(contents, realsize, k->data) != realsize) {
+                return 0;
+            }
+        }
+        t->delivered += realsize;
+    }
     return realsize;
 }
 
@@ -1164,6 +3389,24 @@ char *
 result_filename(result *r) {
     return r->filename;
 }
+/**
+ * Get the network timing of the request
+ *
+ * @memberof result
+ * @ingroup request
+ *
+ * @param r result to get the timing of
+ *
+ * @return timing of the request, owned by the result
+ *
+ * @note Times are in seconds from the start of the last attempt.  A response
+ *    from the cache has no times
+ */
+request_timing *
+result_timing(result *r) {
+    return &r->timing;
+}
+
 /**
  * Get the CURL return code
  *
@@ -1433,7 +3676,7 @@ result_from_curl(result *r, int code, char *data, size_t n) {
  * @param nfile   length of file
  *
  */
-static void
+void
 find_unique_filename(char *base, char *file, size_t nfile) {
     int n = 0;
     fern_strlcpy(file, base, nfile);
@@ -14,11 +14,58 @@ typedef struct request request;
  * Arguments for the Request type
  */
 typedef struct Arg Arg;
+/**
+ * Loop for making concurrent requests
+ */
+typedef struct fern_loop fern_loop;
+/**
+ * Function called when a request in a \ref fern_loop completes
+ */
+typedef void (*request_callback)(result *r, void *data);
+/**
+ * Function receiving data from a \ref request as it arrives
+ */
+typedef size_t (*request_sink)(char *data, size_t n, void *userdata);
+/**
+ * Function formatting line i of POST data into buf of size n, returning the
+ * length of the line including its newline, or -1 after the last line
+ */
+typedef int (*post_line_func)(void *data, size_t i, char *buf, size_t n);
 
+#include <sys/select.h>
 #include <sacio/timespec.h>
 
+/**
+ * Network timing of a \ref request
+ */
+typedef struct request_timing request_timing;
+
+/**
+ * @brief Network timing of a \ref request, from curl
+ * @ingroup request
+ *
+ * Times are in seconds from the start of the request
+ */
+struct request_timing {
+    double namelookup;    /**< host name resolved */
+    double connect;       /**< connected to the host */
+    double appconnect;    /**< TLS handshake completed, 0 without TLS */
+    double starttransfer; /**< first byte of the response received */
+    double total;         /**< request completed */
+    int64_t bytes_down;   /**< bytes downloaded */
+    int64_t bytes_up;     /**< bytes uploaded */
+    int64_t speed;        /**< average download speed in bytes per second */
+    int attempts;         /**< attempts made, including retries */
+    int cached;           /**< response came from the cache */
+};
+
 result * request_get(request *r);
 result * request_post(request *r, char *post_data);
+result * request_post_lines(request *r, post_line_func fn, void *fn_data);
+int      request_get_async(fern_loop *loop, request *r,
+                           request_callback done, void *data);
+int      request_post_async(fern_loop *loop, request *r, char *post_data,
+                            request_callback done, void *data);
 
 void     request_free(request *r);
 char *   request_to_url(request *r);
@@ -30,6 +77,33 @@ void     request_set_url(request *r, char *url);
 void     request_set_verbose(request *r, int verbose);
 void     request_set_progress(request *r, int progress);
 char    *request_get_url(request *r);
+void     request_cleanup();
+void     request_add_sink(request *r, request_sink func, void *data);
+void     request_add_sink_fd(request *r, int fd);
+void     request_set_keep_data(request *r, int keep);
+void     request_set_range_from(request *r, int64_t offset);
+void     request_set_retry(int max_retries, double base_delay, double max_delay);
+void     request_set_rate_limit(double per_second, int burst);
+int      request_set_log(char *file);
+void     request_set_bandwidth(double bytes_per_second);
+void     request_set_bandwidth_weight(char *group, double weight);
+int      request_set_bandwidth_shared(char *file);
+
+fern_loop *fern_loop_new();
+void       fern_loop_free(fern_loop *loop);
+void       fern_loop_set_max_transfers(fern_loop *loop, int n);
+void       fern_loop_set_max_per_group(fern_loop *loop, int n);
+int        fern_loop_add(fern_loop *loop, request *r, char *post_data, char *group,
+                         request_callback done, void *data);
+int        fern_loop_add_lines(fern_loop *loop, request *r, post_line_func fn,
+                               void *fn_data, char *group,
+                               request_callback done, void *data);
+void       fern_loop_run(fern_loop *loop);
+int        fern_loop_perform(fern_loop *loop);
+int        fern_loop_fdset(fern_loop *loop, fd_set *rd, fd_set *wr, fd_set *ex,
+                           int *maxfd);
+int        fern_loop_timeout(fern_loop *loop);
+void       fern_loop_wait(fern_loop *loop, int timeout);
 
 result *result_new();
 void    result_free();
@@ -38,6 +112,7 @@ void    result_init(result *r);
 char   *result_error_msg(result *r);
 int     result_code(result *r);
 int     result_http_code(result *r);
+request_timing *result_timing(result *r);
 char   *result_data(result *r);
 size_t  result_len(result *r);
 int     result_is_ok(result *r);
@@ -60,6 +135,7 @@ int    arg_get_data(Arg *a, void **data);
 int    arg_get_time(Arg *a, timespec64 *t);
 
 char * data_size(int64_t bytes, char *out, size_t n);
+void   find_unique_filename(char *base, char *file, size_t nfile);
 void clear_line();
 
 char * str_grow(char *s, size_t *nalloc, size_t n, size_t nadd);
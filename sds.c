@@ -0,0 +1,387 @@
+/**
+ * @file
+ * @brief Miniseed records written into an SDS archive
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libmseed/libmseed.h>
+
+#include "sds.h"
+#include "archive.h"
+#include "miniseed_sac.h"
+#include "chash.h"
+#include "array.h"
+#include "strip.h"
+#include "defs.h"
+
+/**
+ * @defgroup sds sds
+ * @brief Miniseed records written into an SDS archive
+ *
+ * @details Records are appended, as they are received, to the day file of
+ *    their channel and start time in a SeisComP Data Structure (SDS),
+ *    ROOT/YEAR/NET/STA/CHA.D/NET.STA.LOC.CHA.D.YEAR.DOY.  Records are not
+ *    unpacked or rewritten.  Recently used files are kept open, so data
+ *    arriving in time order for a few channels is written without opening
+ *    a file for each record.  Records whose data is already in the day file,
+ *    e.g. a record at the boundary of two requests delivered by both, are
+ *    skipped
+ *
+ * @code
+ *   sds_writer *w = sds_writer_new("/data/SDS");
+ *   mseed_stream *ms = mseed_stream_new(NULL);
+ *   mseed_stream_set_record_func(ms, sds_writer_record, w);
+ *   request_add_sink(r, mseed_stream_write, ms);
+ *   ...
+ *   sds_writer_free(w);
+ * @endcode
+ */
+
+#define SDS_MAX_OPEN 64 /**< @private default number of files kept open */
+
+/**
+ * @brief Open day file
+ * @private
+ * @ingroup sds
+ */
+typedef struct {
+    char *path;     /**< \private file path */
+    int fd;         /**< \private file descriptor, opened for appending */
+    uint64_t used;  /**< \private time of last use, counted in writes */
+} sds_file;
+
+/**
+ * @brief Writer of miniseed records into an SDS archive
+ * @ingroup sds
+ */
+struct sds_writer {
+    char *root;        /**< @private top directory of the archive */
+    dict *open;        /**< @private open sds_file by path */
+    sds_file **files;  /**< @private open files, for closing the least used */
+    size_t max_open;   /**< @private maximum number of files kept open */
+    uint64_t clock;    /**< @private number of writes, for least recent use */
+    int64_t nbytes;    /**< @private bytes written */
+    dict *written;     /**< @private paths written to */
+    archive *have;     /**< @private data in the day files written to */
+    int64_t nskipped;  /**< @private records skipped as already written */
+};
+
+/**
+ * @brief Create a writer of miniseed records into an SDS archive
+ *
+ * @memberof   sds_writer
+ * @ingroup    sds
+ *
+ * @param      root   top directory of the archive, created if needed
+ *
+ * @return     SDS writer
+ */
+sds_writer *
+sds_writer_new(char *root) {
+    sds_writer *w = calloc(1, sizeof(sds_writer));
+    w->root = strdup(root);
+    w->open = dict_new();
+    w->written = dict_new();
+    w->have = archive_new();
+    w->files = xarray_new('p');
+    w->max_open = SDS_MAX_OPEN;
+    return w;
+}
+
+/**
+ * @brief Set the number of files kept open
+ *
+ * @memberof   sds_writer
+ * @ingroup    sds
+ *
+ * @param      w   SDS writer
+ * @param      n   maximum number of open files [64]
+ *
+ */
+void
+sds_writer_set_max_open(sds_writer *w, size_t n) {
+    w->max_open = (n < 1) ? 1 : n;
+}
+
+/**
+ * @brief Number of bytes written into the archive
+ *
+ * @memberof   sds_writer
+ * @ingroup    sds
+ *
+ * @param      w   SDS writer
+ *
+ * @return     bytes written
+ */
+int64_t
+sds_writer_bytes(sds_writer *w) {
+    return (w) ? w->nbytes : 0;
+}
+
+/**
+ * @brief Number of day files written to
+ *
+ * @memberof   sds_writer
+ * @ingroup    sds
+ *
+ * @param      w   SDS writer
+ *
+ * @return     number of files
+ */
+size_t
+sds_writer_files(sds_writer *w) {
+    size_t n = 0;
+    char **keys = NULL;
+    if(!w) {
+        return 0;
+    }
+    keys = dict_keys(w->written);
+    while(keys[n]) {
+        n++;
+    }
+    dict_keys_free(keys);
+    return n;
+}
+
+/**
+ * @brief Number of records skipped as their data was already written
+ *
+ * @memberof   sds_writer
+ * @ingroup    sds
+ *
+ * @param      w   SDS writer
+ *
+ * @return     number of records
+ */
+int64_t
+sds_writer_skipped(sds_writer *w) {
+    return (w) ? w->nskipped : 0;
+}
+
+/**
+ * @brief Close an open day file
+ *
+ * @ingroup    sds
+ * @private
+ *
+ * @param      p   open file
+ *
+ */
+static void
+sds_file_free(void *p) {
+    sds_file *f = (sds_file *) p;
+    if(f) {
+        if(f->fd >= 0) {
+            close(f->fd);
+        }
+        FREE(f->path);
+        FREE(f);
+    }
+}
+
+/**
+ * @brief Close all open day files
+ *
+ * @memberof   sds_writer
+ * @ingroup    sds
+ *
+ * @param      w   SDS writer
+ *
+ * @note Files are opened again if more records are written
+ */
+void
+sds_writer_close(sds_writer *w) {
+    if(!w) {
+        return;
+    }
+    dict_free(w->open, NULL);
+    w->open = dict_new();
+    xarray_free_items(w->files, sds_file_free);
+    xarray_free(w->files);
+    w->files = xarray_new('p');
+}
+
+/**
+ * @brief Free an SDS writer, closing all files
+ *
+ * @memberof   sds_writer
+ * @ingroup    sds
+ *
+ * @param      w   SDS writer
+ *
+ */
+void
+sds_writer_free(sds_writer *w) {
+    if(w) {
+        sds_writer_close(w);
+        dict_free(w->open, NULL);
+        dict_free(w->written, NULL);
+        archive_free(w->have);
+        xarray_free(w->files);
+        FREE(w->root);
+        FREE(w);
+    }
+}
+
+/**
+ * @brief Get the SDS day file of a channel and time
+ *
+ * @ingroup    sds
+ *
+ * @param      root   top directory of the archive
+ * @param      sid    miniseed source id, e.g. FDSN:IU_ANMO_00_B_H_Z
+ * @param      t      time within the day
+ * @param      out    output path, ROOT/YEAR/NET/STA/CHA.D/NET.STA.LOC.CHA.D.YEAR.DOY
+ * @param      n      length of out
+ *
+ * @return     1 on success, 0 if the source id cannot be converted or the
+ *    path does not fit in out
+ */
+int
+sds_path(char *root, char *sid, nstime_t t, char *out, size_t n) {
+    char net[64] = {0}, sta[64] = {0}, loc[64] = {0}, cha[64] = {0};
+    uint16_t year = 0, doy = 0;
+    uint8_t hour = 0, min = 0, sec = 0;
+    uint32_t nsec = 0;
+    int k = 0;
+    if(ms_sid2nslc(sid, net, sta, loc, cha) != 0 ||
+       ms_nstime2time(t, &year, &doy, &hour, &min, &sec, &nsec) != 0) {
+        return 0;
+    }
+    k = snprintf(out, n, "%s/%04d/%s/%s/%s.D/%s.%s.%s.%s.D.%04d.%03d",
+                 root, year, net, sta, cha, net, sta, loc, cha, year, doy);
+    return (k > 0 && (size_t) k < n);
+}
+
+/**
+ * @brief Create the directories of a path
+ *
+ * @ingroup    sds
+ * @private
+ *
+ * @param      path   file path, the last component is not created
+ *
+ * @return     1 on success, 0 on error
+ */
+static int
+sds_mkdirs(char *path) {
+    char *p = NULL;
+    char *dir = strdup(path);
+    int ok = 1;
+    for(p = dir + 1; *p; p++) {
+        if(*p != '/') {
+            continue;
+        }
+        *p = 0;
+        if(mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            ok = 0;
+            break;
+        }
+        *p = '/';
+    }
+    FREE(dir);
+    return ok;
+}
+
+/**
+ * @brief Get an open day file, opening it and closing the least used if needed
+ *
+ * @ingroup    sds
+ * @private
+ *
+ * @param      w      SDS writer
+ * @param      path   day file
+ *
+ * @return     open file, NULL on error
+ *
+ * @note The data already in a day file is read the first time it is opened
+ */
+static sds_file *
+sds_writer_open(sds_writer *w, char *path) {
+    sds_file *f = dict_get(w->open, path);
+    int fd = -1;
+    struct stat st;
+    if(f) {
+        return f;
+    }
+    if(!dict_get(w->written, path) && stat(path, &st) == 0 && st.st_size > 0) {
+        archive_add_file(w->have, path);
+    }
+    if(xarray_length(w->files) >= w->max_open) {
+        size_t k = 0;
+        for(size_t i = 1; i < xarray_length(w->files); i++) {
+            if(w->files[i]->used < w->files[k]->used) {
+                k = i;
+            }
+        }
+        dict_remove(w->open, w->files[k]->path, NULL);
+        sds_file_free(w->files[k]);
+        xarray_delete(w->files, (int) k);
+    }
+    if(!sds_mkdirs(path) ||
+       (fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        printf("Error writing data: Could not open file: %s\n", path);
+        return NULL;
+    }
+    f = calloc(1, sizeof(sds_file));
+    f->path = strdup(path);
+    f->fd = fd;
+    dict_put(w->open, path, f);
+    w->files = xarray_append(w->files, f);
+    dict_put(w->written, path, w);
+    return f;
+}
+
+/**
+ * @brief Append a miniseed record to its day file
+ *
+ * @memberof   sds_writer
+ * @ingroup    sds
+ *
+ * @param      msr    parsed miniseed record, with the raw record
+ * @param      data   SDS writer, \ref sds_writer
+ *
+ * @return     1 on success, 0 on error
+ *
+ * @note Matches \ref mseed_record_func, see mseed_stream_set_record_func().
+ *    A record is written to the day file of its start time, even if it
+ *    ends on the next day.  A record whose data is already in the archive,
+ *    from this writer or in the day file before, is skipped
+ */
+int
+sds_writer_record(MS3Record *msr, void *data) {
+    char path[2048] = {0};
+    sds_writer *w = (sds_writer *) data;
+    sds_file *f = NULL;
+    nstime_t *gaps = NULL;
+    nstime_t next = mseed_record_next(msr);
+    size_t n = 0;
+    if(!sds_path(w->root, msr->sid, msr->starttime, path, sizeof(path))) {
+        printf("Error writing data: Cannot place %s in an SDS archive\n", msr->sid);
+        return 0;
+    }
+    if(!(f = sds_writer_open(w, path))) {
+        return 0;
+    }
+    if(msr->samplecnt > 0) {
+        if(!(gaps = archive_missing(w->have, msr->sid, msr->starttime, next, &n))) {
+            w->nskipped += 1;
+            return 1;
+        }
+        FREE(gaps);
+    }
+    if(write(f->fd, msr->record, (size_t) msr->reclen) != (ssize_t) msr->reclen) {
+        printf("Error writing data to %s: Incomplete write\n", path);
+        return 0;
+    }
+    f->used = ++w->clock;
+    w->nbytes += msr->reclen;
+    archive_add_span(w->have, msr->sid, msr->starttime, next);
+    return 1;
+}
@@ -0,0 +1,29 @@
+/**
+ * @file
+ * @brief Miniseed records written into an SDS archive
+ */
+
+#ifndef _SDS_H_
+#define _SDS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <libmseed/libmseed.h>
+
+/**
+ * Writer of miniseed records into an SDS archive
+ */
+typedef struct sds_writer sds_writer;
+
+sds_writer * sds_writer_new(char *root);
+void         sds_writer_set_max_open(sds_writer *w, size_t n);
+int          sds_writer_record(MS3Record *msr, void *data);
+int64_t      sds_writer_bytes(sds_writer *w);
+size_t       sds_writer_files(sds_writer *w);
+int64_t      sds_writer_skipped(sds_writer *w);
+void         sds_writer_close(sds_writer *w);
+void         sds_writer_free(sds_writer *w);
+
+int          sds_path(char *root, char *sid, nstime_t t, char *out, size_t n);
+
+#endif /* _SDS_H_ */
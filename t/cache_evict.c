@@ -0,0 +1,119 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#define SIZE 1000
+
+static char *dir = "t/cache.test";
+
+// Make every cached response older, keeping their order, or remove them
+static size_t
+cache_age(int64_t seconds, int remove) {
+    size_t n = 0;
+    DIR *d = NULL;
+    struct dirent *e = NULL;
+    if(!(d = opendir(dir))) {
+        return 0;
+    }
+    while((e = readdir(d))) {
+        char file[2048] = {0};
+        struct stat st;
+        struct utimbuf t;
+        if(e->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(file, sizeof(file), "%s/%s", dir, e->d_name);
+        if(remove) {
+            unlink(file);
+        } else if(stat(file, &st) == 0) {
+            t.actime = st.st_atime - seconds;
+            t.modtime = st.st_mtime - seconds;
+            utime(file, &t);
+        }
+        n++;
+    }
+    closedir(d);
+    return n;
+}
+
+static int
+put(char *url, char *data) {
+    int ok = cache_put(url, NULL, data, SIZE, "\"etag\"", NULL);
+    cache_age(10, 0);
+    return ok;
+}
+
+static int
+has(char *url, char *data) {
+    int ok = 0;
+    cache_entry *e = NULL;
+    if((e = cache_get(url, NULL))) {
+        ok = (cache_entry_len(e) == SIZE && memcmp(cache_entry_data(e), data, SIZE) == 0);
+        cache_entry_free(e);
+    }
+    return ok;
+}
+
+int
+main() {
+    char a[SIZE], b[SIZE], c[SIZE], d[SIZE];
+    char *ua = "http://127.0.0.1:9/fdsnws/event/1/query?eventid=a";
+    char *ub = "http://127.0.0.1:9/fdsnws/event/1/query?eventid=b";
+    char *uc = "http://127.0.0.1:9/fdsnws/event/1/query?eventid=c";
+    char *ud = "http://127.0.0.1:9/fdsnws/event/1/query?eventid=d";
+    memset(a, 'a', SIZE);
+    memset(b, 'b', SIZE);
+    memset(c, 'c', SIZE);
+    memset(d, 'd', SIZE);
+
+    cache_set_dir(dir);
+    cache_age(0, 1);
+    cache_set_ttl(CacheEvent, 3600);
+    // Room for three responses
+    cache_set_max_size(3500);
+
+    if(!put(ua, a) || !put(ub, b) || !put(uc, c)) {
+        printf("Error storing responses in %s\n", dir);
+        return -1;
+    }
+    if(!has(ua, a) || !has(ub, b) || !has(uc, c)) {
+        printf("Stored responses not found\n");
+        return -1;
+    }
+    // Reading a response marks it as recently used, b is now the oldest
+    cache_age(10, 0);
+    has(ua, a);
+    has(uc, c);
+    cache_age(10, 0);
+    if(!put(ud, d)) {
+        printf("Error storing response in %s\n", dir);
+        return -1;
+    }
+    if(cache_age(0, 0) != 3 || has(ub, b)) {
+        printf("Least recently used response not evicted\n");
+        return -1;
+    }
+    if(!has(ua, a) || !has(uc, c) || !has(ud, d)) {
+        printf("Recently used responses evicted\n");
+        return -1;
+    }
+    // Replacing a response keeps the size of the cache
+    if(!put(ud, d) || cache_age(0, 0) != 3 || !has(ua, a)) {
+        printf("Replacing a response evicted another\n");
+        return -1;
+    }
+    // Responses larger than the cache are not kept
+    cache_set_max_size(SIZE / 2);
+    if(cache_put(ub, NULL, b, SIZE, NULL, NULL)) {
+        printf("Response larger than the cache stored\n");
+        return -1;
+    }
+    cache_age(0, 1);
+    rmdir(dir);
+    cache_set_dir(NULL);
+    return 0;
+}
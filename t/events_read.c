@@ -0,0 +1,39 @@
+#include <fern.h>
+#include <math.h>
+#include <string.h>
+
+int
+main() {
+    // Events written by fern -E, see t/test_event.sh
+    Event **ev = events_read("t/events.txt");
+    if(!ev || xarray_length(ev) != 5) {
+        printf("Expected 5 events in t/events.txt, found %zu\n", (ev) ? xarray_length(ev) : 0);
+        return -1;
+    }
+    // 2011-03-11T05:46:24  38.30  142.37  29.00 9.10 mww US/official - usgs:official20110311054624120_30
+    if(strcmp(event_id(ev[0]), "usgs:official20110311054624120_30") != 0 ||
+       event_time(ev[0]).tv_sec != 1299822384 ||
+       fabs(event_lat(ev[0]) - 38.30) > 1e-6 ||
+       fabs(event_lon(ev[0]) - 142.37) > 1e-6 ||
+       fabs(event_depth(ev[0]) - 29.00) > 1e-6) {
+        printf("First event does not match t/events.txt\n");
+        event_print(ev[0], stdout);
+        return -1;
+    }
+    // 1952-11-04T16:58:30  52.62  159.78  21.60 9.00 mw  iscgem/official - usgs:official19521104165830_30
+    if(strcmp(event_id(ev[4]), "usgs:official19521104165830_30") != 0 ||
+       event_time(ev[4]).tv_sec != -541407690 ||
+       fabs(event_depth(ev[4]) - 21.60) > 1e-6) {
+        printf("Last event does not match t/events.txt\n");
+        event_print(ev[4], stdout);
+        return -1;
+    }
+    xarray_free_items(ev, (void (*)(void *)) event_free);
+    xarray_free(ev);
+    // A missing file is an error, not an empty list
+    if(events_read("t/events.txt.missing")) {
+        printf("Expected no events from a missing file\n");
+        return -1;
+    }
+    return 0;
+}
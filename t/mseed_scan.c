@@ -0,0 +1,87 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static char *file = "t/scan.mseed.test";
+
+// Append packed records to the partial file, the last one cut short by cut bytes
+static void
+scan_record(char *record, int reclen, void *data) {
+    int *cut = (int *) data;
+    FILE *fp = fopen(file, "ab");
+    if(fp) {
+        fwrite(record, 1, (size_t) (reclen - *cut), fp);
+        fclose(fp);
+    }
+}
+
+// Pack npts samples at 1 sample per second
+static int
+scan_fill(char *sid, char *start, int64_t npts, int cut) {
+    int64_t packed = 0;
+    int32_t *y = calloc((size_t) npts, sizeof(int32_t));
+    MS3Record *msr = msr3_init(NULL);
+    strncpy(msr->sid, sid, sizeof(msr->sid) - 1);
+    msr->formatversion = 2;
+    msr->reclen = 512;
+    msr->pubversion = 1;
+    msr->starttime = ms_timestr2nstime(start);
+    msr->samprate = 1.0;
+    msr->encoding = DE_INT32;
+    msr->sampletype = 'i';
+    msr->datasamples = y;
+    msr->datasize = (uint64_t) npts * sizeof(int32_t);
+    msr->numsamples = npts;
+    msr->samplecnt = npts;
+    msr3_pack(msr, scan_record, &cut, &packed, MSF_FLUSHDATA, 0);
+    msr->datasamples = NULL;
+    msr3_free(&msr);
+    free(y);
+    return packed == npts;
+}
+
+int
+main() {
+    int64_t n = 0;
+    struct stat st;
+    nstime_t *t = NULL;
+    nstime_t t0 = ms_timestr2nstime("2020-01-01T00:00:00");
+    dict *next = dict_new();
+
+    unlink(file);
+    if(!scan_fill("FDSN:IU_ANMO_00_B_H_Z", "2020-01-01T00:00:00", 250, 0) ||
+       !scan_fill("FDSN:IU_COLA_00_B_H_Z", "2020-01-01T00:00:00", 100, 0)) {
+        printf("Error writing miniseed into %s\n", file);
+        return -1;
+    }
+    stat(file, &st);
+    // A download interrupted part way through a record
+    if(!scan_fill("FDSN:IU_COLA_00_B_H_Z", "2020-01-01T00:01:40", 100, 256)) {
+        printf("Error writing miniseed into %s\n", file);
+        return -1;
+    }
+    if((n = mseed_file_scan(file, next)) != (int64_t) st.st_size) {
+        printf("Expected %" PRId64 " bytes of complete records, found %" PRId64 "\n",
+               (int64_t) st.st_size, n);
+        return -1;
+    }
+    // Data is requested again from the sample after the last complete record
+    if(!(t = dict_get(next, "FDSN:IU_ANMO_00_B_H_Z")) || *t != t0 + (nstime_t) 250 * NSTMODULUS) {
+        printf("IU.ANMO does not continue after its last record\n");
+        return -1;
+    }
+    if(!(t = dict_get(next, "FDSN:IU_COLA_00_B_H_Z")) || *t != t0 + (nstime_t) 100 * NSTMODULUS) {
+        printf("IU.COLA does not continue after its last complete record\n");
+        return -1;
+    }
+    dict_free(next, free);
+    unlink(file);
+    // A missing file cannot be resumed
+    if(mseed_file_scan(file, NULL) != -1) {
+        printf("Expected an error scanning a missing file\n");
+        return -1;
+    }
+    return 0;
+}
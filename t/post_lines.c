@@ -0,0 +1,58 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Lines of POST data, each of the given length including its newline
+static int
+post_line(void *data, size_t i, char *buf, size_t n) {
+    int *len = (int *) data;
+    char *line = NULL;
+    int k = 0;
+    if(i >= 3) {
+        return -1;
+    }
+    line = calloc((size_t) len[i] + 1, sizeof(char));
+    memset(line, 'x', (size_t) len[i] - 1);
+    line[len[i] - 1] = '\n';
+    k = snprintf(buf, n, "%s", line);
+    free(line);
+    return k;
+}
+
+static void
+done(result *r, void *data) {
+    int *called = (int *) data;
+    *called = 1;
+    result_free(r);
+}
+
+// Queue a POST request with three lines of the given lengths
+static int
+add(int *len, int *called) {
+    int ok = 0;
+    fern_loop *loop = fern_loop_new();
+    request *r = request_new();
+    request_set_url(r, "http://127.0.0.1:9/fdsnws/dataselect/1/query");
+    ok = fern_loop_add_lines(loop, r, post_line, len, NULL, done, called);
+    request_free(r);
+    fern_loop_free(loop);
+    return ok;
+}
+
+int
+main() {
+    int called = 0;
+    int fits[3] = { 10, 2047, 1 };
+    int long_line[3] = { 10, 2048, 1 };
+    if(!add(fits, &called)) {
+        printf("POST data with lines of up to 2047 bytes not accepted\n");
+        return -1;
+    }
+    // A line cut short would send a broken request
+    if(add(long_line, &called) || called) {
+        printf("POST data with a line longer than 2047 bytes accepted\n");
+        return -1;
+    }
+    request_cleanup();
+    return 0;
+}
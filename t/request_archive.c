@@ -0,0 +1,116 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "slurp.h"
+
+static char *root = "t/sds.test";
+static char *file = "t/archive.request.test";
+
+static char *request_text =
+    "DATACENTER=A,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "IU ANMO 00 BHZ 2020-01-01T00:00:00 2020-01-01T02:00:00\n"
+    "IU * 00 BHZ 2020-01-01T00:00:00 2020-01-01T02:00:00\n"
+    "\n"
+    "DATACENTER=B,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "IU COLA 00 BHZ 2020-01-01T00:00:00 2020-01-01T00:30:00\n"
+    "\n";
+
+// Append a packed record to a day file
+static void
+sds_record(char *record, int reclen, void *data) {
+    FILE *fp = fopen((char *) data, "ab");
+    if(fp) {
+        fwrite(record, 1, (size_t) reclen, fp);
+        fclose(fp);
+    }
+}
+
+// Write npts samples at 1 sample per second into a day file of the SDS archive
+static int
+sds_fill(char *dir, char *day, char *sid, char *start, int64_t npts) {
+    int64_t packed = 0;
+    char cmd[2048] = {0};
+    char path[2048] = {0};
+    int32_t *y = NULL;
+    MS3Record *msr = NULL;
+    snprintf(cmd, sizeof(cmd), "mkdir -p %s/%s", root, dir);
+    snprintf(path, sizeof(path), "%s/%s/%s", root, dir, day);
+    if(system(cmd) != 0) {
+        return 0;
+    }
+    y = calloc((size_t) npts, sizeof(int32_t));
+    msr = msr3_init(NULL);
+    strncpy(msr->sid, sid, sizeof(msr->sid) - 1);
+    msr->formatversion = 2;
+    msr->reclen = 512;
+    msr->pubversion = 1;
+    msr->starttime = ms_timestr2nstime(start);
+    msr->samprate = 1.0;
+    msr->encoding = DE_INT32;
+    msr->sampletype = 'i';
+    msr->datasamples = y;
+    msr->datasize = (uint64_t) npts * sizeof(int32_t);
+    msr->numsamples = npts;
+    msr->samplecnt = npts;
+    msr3_pack(msr, sds_record, path, &packed, MSF_FLUSHDATA, 0);
+    msr->datasamples = NULL;
+    msr3_free(&msr);
+    free(y);
+    return packed == npts;
+}
+
+int
+main() {
+    size_t n = 0, changed = 0;
+    char *data = NULL;
+    archive *a = NULL;
+    data_request *fdr = NULL;
+    char *expect =
+        "IU ANMO 00 BHZ 2020-01-01T00:30:00.000 2020-01-01T01:00:00.000\n"
+        "IU ANMO 00 BHZ 2020-01-01T01:30:00.000 2020-01-01T02:00:00.000\n"
+        "IU * 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n";
+
+    chunk_size_set_file("");
+    system("rm -rf t/sds.test");
+    // Two half hours of IU.ANMO and the requested half hour of IU.COLA
+    if(!sds_fill("2020/IU/ANMO/BHZ.D", "IU.ANMO.00.BHZ.D.2020.001",
+                 "FDSN:IU_ANMO_00_B_H_Z", "2020-01-01T00:00:00", 1800) ||
+       !sds_fill("2020/IU/ANMO/BHZ.D", "IU.ANMO.00.BHZ.D.2020.001",
+                 "FDSN:IU_ANMO_00_B_H_Z", "2020-01-01T01:00:00", 1800) ||
+       !sds_fill("2020/IU/COLA/BHZ.D", "IU.COLA.00.BHZ.D.2020.001",
+                 "FDSN:IU_COLA_00_B_H_Z", "2020-01-01T00:00:00", 1800)) {
+        printf("Error writing miniseed into %s\n", root);
+        return -1;
+    }
+
+    a = archive_new();
+    if(!archive_add(a, root) || archive_files(a) != 2) {
+        printf("Expected 2 day files in %s, found %zu\n", root, archive_files(a));
+        return -1;
+    }
+    data = strdup(request_text);
+    fdr = data_request_parse(data);
+    free(data);
+    // IU.ANMO is split around the data, IU.COLA and its request are removed
+    if((changed = data_request_subtract_archive(fdr, a)) != 2) {
+        printf("Expected 2 request lines changed, found %zu\n", changed);
+        return -1;
+    }
+    data_request_write_to_file(fdr, file);
+    data_request_free(fdr);
+    archive_free(a);
+    if(!(data = slurp(file, &n))) {
+        return -1;
+    }
+    if(!strstr(data, expect) || strstr(data, "COLA") || strstr(data, "DATACENTER=B")) {
+        printf("Expected only the missing data in the request\n%s\nexpected\n%s\n", data, expect);
+        return -1;
+    }
+    free(data);
+    unlink(file);
+    system("rm -rf t/sds.test");
+    return 0;
+}
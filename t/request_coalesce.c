@@ -0,0 +1,101 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "slurp.h"
+
+// Data center A is listed twice, around a completed request to B
+static char *request_text =
+    "DATACENTER=A,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "IU ANMO 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "IU ANMO 00 BHZ 2020-01-01T01:00:05 2020-01-01T02:00:00\n"
+    "\n"
+    "# DATACENTER=B,http://127.0.0.1:9\n"
+    "# DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "# IU COLA 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "\n"
+    "DATACENTER=C,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "II KDAK 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "II KDAK 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "\n"
+    "DATACENTER=A,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "IU ANMO 00 BHZ 2020-01-01T00:30:00 2020-01-01T01:00:00\n"
+    "\n";
+
+static char *file = "t/coalesce.request.test";
+
+// Data centers and request lines, in the order written
+static char *
+coalesce(double tolerance, size_t *changed) {
+    size_t n = 0;
+    char *data = strdup(request_text);
+    char *line = NULL, *p = NULL, *out = NULL;
+    data_request *fdr = data_request_parse(data);
+    free(data);
+    *changed = data_request_coalesce(fdr, tolerance);
+    data_request_write_to_file(fdr, file);
+    data_request_free(fdr);
+    if(!(data = slurp(file, &n))) {
+        return NULL;
+    }
+    out = calloc(n + 1, sizeof(char));
+    p = data;
+    while((line = strsep(&p, "\n")) != NULL) {
+        char dc[64], net[16], sta[16], loc[16], cha[16], t1[64], t2[64];
+        int c = (strncmp(line, "# ", 2) == 0);
+        char *q = (c) ? line + 2 : line;
+        if(sscanf(q, "DATACENTER=%63[^,]", dc) == 1) {
+            sprintf(out + strlen(out), "%s%s\n", (c) ? "# " : "", dc);
+        } else if(sscanf(q, "%15s %15s %15s %15s %63s %63s", net, sta, loc, cha, t1, t2) == 6) {
+            sprintf(out + strlen(out), "%s%s %s %s %s %s %s\n", (c) ? "# " : "",
+                    net, sta, loc, cha, t1, t2);
+        }
+    }
+    free(data);
+    unlink(file);
+    return out;
+}
+
+static int
+check(char *name, double tolerance, size_t changed, char *expect) {
+    size_t n = 0;
+    char *out = coalesce(tolerance, &n);
+    if(!out || n != changed || strcmp(out, expect) != 0) {
+        printf("%s: %zu lines merged, expected %zu\n%s\nexpected\n%s\n",
+               name, n, changed, (out) ? out : "", expect);
+        free(out);
+        return 0;
+    }
+    free(out);
+    return 1;
+}
+
+int
+main() {
+    chunk_size_set_file("");
+    // Overlapping and duplicate lines are merged, the 5 s gap is kept
+    if(!check("1 s", 1.0, 2,
+              "A\n"
+              "IU ANMO 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T01:00:00.000\n"
+              "IU ANMO 00 BHZ 2020-01-01T01:00:05.000 2020-01-01T02:00:00.000\n"
+              "# B\n"
+              "# IU COLA 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T01:00:00.000\n"
+              "C\n"
+              "II KDAK 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T01:00:00.000\n")) {
+        return -1;
+    }
+    // A larger tolerance closes the gap
+    if(!check("10 s", 10.0, 3,
+              "A\n"
+              "IU ANMO 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n"
+              "# B\n"
+              "# IU COLA 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T01:00:00.000\n"
+              "C\n"
+              "II KDAK 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T01:00:00.000\n")) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "slurp.h"
+#include "strip.h"
+
+// IU ANMO and IU COLA are available from both data centers
+static char *request_text =
+    "%sDATACENTER=A,http://127.0.0.1:9\n"
+    "%sDATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "%sIU ANMO 00 BHZ 2020-01-01T00:00:00 2020-01-01T02:00:00\n"
+    "%sIU COLA 00 BHZ 2020-01-01T00:00:00 2020-01-01T02:00:00\n"
+    "\n"
+    "DATACENTER=B,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "IU ANMO 00 BHZ 2020-01-01T01:00:00 2020-01-01T03:00:00\n"
+    "IU COLA 00 BHZ 2020-01-01T00:30:00 2020-01-01T01:30:00\n"
+    "IU * 00 BHZ 2020-01-01T00:00:00 2020-01-01T02:00:00\n"
+    "\n";
+
+static char *file = "t/dedupe.request.test";
+
+// Request lines by data center after removing duplicates
+static char *
+dedupe(char *prefer, int a_done, size_t *changed) {
+    size_t n = 0;
+    char *data = NULL, *line = NULL, *p = NULL, *out = NULL;
+    char dc[64] = {0};
+    char *c = (a_done) ? "# " : "";
+    data_request *fdr = NULL;
+    if(fern_asprintf(&data, request_text, c, c, c, c) < 0) {
+        return NULL;
+    }
+    fdr = data_request_parse(data);
+    free(data);
+    data_request_set_prefer(fdr, prefer);
+    *changed = data_request_dedupe(fdr);
+    data_request_write_to_file(fdr, file);
+    data_request_free(fdr);
+    if(!(data = slurp(file, &n))) {
+        return NULL;
+    }
+    out = calloc(n + 1, sizeof(char));
+    p = data;
+    while((line = strsep(&p, "\n")) != NULL) {
+        char net[16], sta[16], loc[16], cha[16], t1[64], t2[64];
+        char *q = (strncmp(line, "# ", 2) == 0) ? line + 2 : line;
+        if(sscanf(q, "DATACENTER=%63[^,]", dc) == 1) {
+            continue;
+        }
+        if(sscanf(q, "%15s %15s %15s %15s %63s %63s", net, sta, loc, cha, t1, t2) == 6) {
+            sprintf(out + strlen(out), "%s %s %s %s %s %s %s\n", dc, net, sta, loc, cha, t1, t2);
+        }
+    }
+    free(data);
+    unlink(file);
+    return out;
+}
+
+static int
+check(char *name, char *prefer, int a_done, size_t changed, char *expect) {
+    size_t n = 0;
+    char *out = dedupe(prefer, a_done, &n);
+    if(!out || n != changed || strcmp(out, expect) != 0) {
+        printf("%s: %zu lines changed, expected %zu\n%s\nexpected\n%s\n",
+               name, n, changed, (out) ? out : "", expect);
+        free(out);
+        return 0;
+    }
+    free(out);
+    return 1;
+}
+
+int
+main() {
+    chunk_size_set_file("");
+    // Data center A is first in the list
+    if(!check("order", NULL, 0, 2,
+              "A IU ANMO 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n"
+              "A IU COLA 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n"
+              "B IU ANMO 00 BHZ 2020-01-01T02:00:00.000 2020-01-01T03:00:00.000\n"
+              "B IU * 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n")) {
+        return -1;
+    }
+    // Data center B is preferred, A keeps what B does not have
+    if(!check("prefer", "B", 0, 2,
+              "A IU ANMO 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T01:00:00.000\n"
+              "A IU COLA 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T00:30:00.000\n"
+              "A IU COLA 00 BHZ 2020-01-01T01:30:00.000 2020-01-01T02:00:00.000\n"
+              "B IU ANMO 00 BHZ 2020-01-01T01:00:00.000 2020-01-01T03:00:00.000\n"
+              "B IU COLA 00 BHZ 2020-01-01T00:30:00.000 2020-01-01T01:30:00.000\n"
+              "B IU * 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n")) {
+        return -1;
+    }
+    // Data already downloaded from A is not requested from B
+    if(!check("done", "B", 1, 2,
+              "A IU ANMO 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n"
+              "A IU COLA 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n"
+              "B IU ANMO 00 BHZ 2020-01-01T02:00:00.000 2020-01-01T03:00:00.000\n"
+              "B IU * 00 BHZ 2020-01-01T00:00:00.000 2020-01-01T02:00:00.000\n")) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "slurp.h"
+
+// Chunks of the data request below, as identified in the journal
+//   The identifiers must not change between versions, or downloads
+//   interrupted by an older version start over
+#define CHUNK_A "ddd270abe350e76e"
+#define CHUNK_B "8317736d3de6ef42"
+
+static char *request_text =
+    "DATACENTER=A,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "IU ANMO 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "IU COLA 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "\n"
+    "DATACENTER=B,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "II KDAK 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "\n";
+
+static int
+check_journal_replay() {
+    size_t n = 0;
+    char *data = NULL;
+    FILE *fp = NULL;
+    data_request *fdr = NULL;
+    char *file = "t/resume.request.test";
+    char *journal = "t/resume.request.test.journal";
+    // Both chunks completed in an earlier run, which crashed while
+    //   writing the next entry of the journal
+    data = strdup(request_text);
+    fdr = data_request_parse(data);
+    free(data);
+    data_request_write_to_file(fdr, file);
+    if(!(fp = fopen(journal, "w"))) {
+        printf("Error writing %s\n", journal);
+        return 0;
+    }
+    fprintf(fp, "%s\n%s\n0123abcd", CHUNK_B, CHUNK_A);
+    fclose(fp);
+    // Nothing is left to download, the data centers are not contacted
+    data_request_download(fdr, file, "t/resume.test", 1, 0);
+    data_request_free(fdr);
+    if(access(journal, F_OK) == 0) {
+        printf("Journal not removed once the request is rewritten\n");
+        return 0;
+    }
+    if(!(data = slurp(file, &n))) {
+        printf("Error reading %s\n", file);
+        return 0;
+    }
+    if(!strstr(data, "# DATACENTER=A,") || !strstr(data, "# DATACENTER=B,") ||
+       !strstr(data, "# IU ANMO 00 BHZ") || !strstr(data, "# IU COLA 00 BHZ") ||
+       !strstr(data, "# II KDAK 00 BHZ")) {
+        printf("Chunks in the journal are not commented\n%s\n", data);
+        free(data);
+        return 0;
+    }
+    free(data);
+    unlink(file);
+    return 1;
+}
+
+static int
+check_claim_takeover() {
+    int64_t now = (int64_t) time(NULL);
+    int64_t expires = 0;
+    size_t n = 0;
+    char *data = NULL;
+    FILE *fp = NULL;
+    claim_table *c = NULL;
+    char *file = "t/resume.claims.test";
+    // Chunk 1 is held by another process, its claim on chunk 2 has expired
+    if(!(fp = fopen(file, "w"))) {
+        printf("Error writing %s\n", file);
+        return 0;
+    }
+    fprintf(fp, "chunk-1 otherhost:1 %" PRId64 "\n", now + 600);
+    fprintf(fp, "chunk-2 otherhost:1 %" PRId64 "\n", now - 1);
+    fclose(fp);
+    if(!(c = claim_table_open(file, 60))) {
+        return 0;
+    }
+    if(claim_take(c, "chunk-1", &expires) || expires != now + 600) {
+        printf("Claim of another process taken before its lease expired\n");
+        return 0;
+    }
+    if(!claim_take(c, "chunk-2", NULL)) {
+        printf("Expired claim not taken over\n");
+        return 0;
+    }
+    if(!claim_take(c, "chunk-3", NULL) || !claim_renew(c, "chunk-2")) {
+        printf("Claim not taken or renewed\n");
+        return 0;
+    }
+    // Another process took over chunk 2
+    if(!(fp = fopen(file, "w"))) {
+        printf("Error writing %s\n", file);
+        return 0;
+    }
+    fprintf(fp, "chunk-2 otherhost:2 %" PRId64 "\n", now + 600);
+    fclose(fp);
+    if(claim_renew(c, "chunk-2")) {
+        printf("Claim renewed after another process took it over\n");
+        return 0;
+    }
+    if(!claim_take(c, "chunk-3", NULL)) {
+        printf("Claim not taken\n");
+        return 0;
+    }
+    claim_release(c, "chunk-3");
+    claim_table_free(c);
+    if(!(data = slurp(file, &n))) {
+        printf("Error reading %s\n", file);
+        return 0;
+    }
+    if(!strstr(data, "chunk-2 otherhost:2 ") || strstr(data, "chunk-3")) {
+        printf("Claims not kept or released\n%s\n", data);
+        free(data);
+        return 0;
+    }
+    free(data);
+    unlink(file);
+    return 1;
+}
+
+int
+main() {
+    // Learned sizes are not kept
+    chunk_size_set_file("");
+    if(!check_journal_replay()) {
+        return -1;
+    }
+    if(!check_claim_takeover()) {
+        return -1;
+    }
+    request_cleanup();
+    return 0;
+}
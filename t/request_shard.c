@@ -0,0 +1,188 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "slurp.h"
+
+#define NSHARDS 3
+
+static char *request_text =
+    "DATACENTER=A,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "IU ANMO 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "IU ANMO 00 BHN 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "IU COLA 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "IU HRV 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "IU PFO 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "\n"
+    "DATACENTER=B,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "II KDAK 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "II BFO 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "II PFO 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "GE WLF 00 BHZ 2020-01-01T00:00:00 2020-01-01T01:00:00\n"
+    "\n";
+
+static char *file = "t/shard.request.test";
+
+// Read a data request from text, as written by data_request_write()
+static data_request *
+request_from_text(char *text) {
+    char *data = strdup(text);
+    data_request *fdr = data_request_parse(data);
+    free(data);
+    return fdr;
+}
+
+// Comment every request of a data request file, as if it was downloaded
+static char *
+request_text_done(char *text) {
+    int in_request = 0;
+    char *line = NULL, *p = NULL;
+    char *data = strdup(text);
+    char *out = calloc(2 * strlen(text) + 1, sizeof(char));
+    p = data;
+    while((line = strsep(&p, "\n")) != NULL) {
+        if(strncmp(line, "## REQUEST ", 11) == 0 && strncmp(line, "## REQUEST PARAMETERS", 21) != 0) {
+            in_request = 1;
+        } else if(in_request && strlen(line) > 0 && line[0] != '#') {
+            strcat(out, "# ");
+        }
+        strcat(out, line);
+        if(p) {
+            strcat(out, "\n");
+        }
+    }
+    free(data);
+    return out;
+}
+
+// Count request lines, commented or not
+static void
+request_lines(char *text, size_t *open, size_t *done) {
+    char *line = NULL, *p = NULL;
+    char *data = strdup(text);
+    *open = *done = 0;
+    p = data;
+    while((line = strsep(&p, "\n")) != NULL) {
+        char net[16], sta[16], loc[16], cha[16], t1[64], t2[64];
+        int comment = (strncmp(line, "# ", 2) == 0);
+        if(sscanf(line + ((comment) ? 2 : 0), "%15s %15s %15s %15s %63s %63s",
+                  net, sta, loc, cha, t1, t2) == 6) {
+            *done += (comment) ? 1 : 0;
+            *open += (comment) ? 0 : 1;
+        }
+    }
+    free(data);
+}
+
+// Write each shard of the data request, with its chunks commented if done
+static size_t
+write_shards(char *text, int *done) {
+    size_t total = 0;
+    for(int i = 1; i <= NSHARDS; i++) {
+        size_t n = 0;
+        char *data = NULL;
+        char sfile[2048] = {0};
+        data_request *fdr = request_from_text(text);
+        total += data_request_shard(fdr, i, NSHARDS);
+        data_request_shard_name(file, i, NSHARDS, sfile, sizeof(sfile));
+        data_request_write_to_file(fdr, sfile);
+        data_request_free(fdr);
+        if(done && done[i-1] && (data = slurp(sfile, &n))) {
+            char *out = request_text_done(data);
+            FILE *fp = fopen(sfile, "w");
+            fputs(out, fp);
+            fclose(fp);
+            free(out);
+            free(data);
+        }
+    }
+    return total;
+}
+
+// Merge the shards into the data request file
+static char *
+merge_shards(char *text, size_t *found) {
+    size_t n = 0;
+    data_request *fdr = request_from_text(text);
+    *found = data_request_merge_shards(fdr, file, NSHARDS);
+    data_request_free(fdr);
+    return slurp(file, &n);
+}
+
+int
+main() {
+    size_t n = 0, found = 0, open = 0, done = 0, total = 0;
+    char *text = NULL, *merged = NULL, *all_done = NULL;
+    int shard_done[NSHARDS] = {0};
+    data_request *fdr = NULL;
+
+    chunk_size_set_file("");
+    fdr = request_from_text(request_text);
+    data_request_write_to_file(fdr, file);
+    data_request_free(fdr);
+    text = slurp(file, &n);
+    request_lines(text, &open, &done);
+    total = open;
+
+    // Every line is in exactly one shard
+    if((n = write_shards(text, NULL)) != total) {
+        printf("Shards hold %zu lines, expected %zu\n", n, total);
+        return -1;
+    }
+    // Merging shards without progress gives back the same data request
+    merged = merge_shards(text, &found);
+    if(found != NSHARDS || strcmp(merged, text) != 0) {
+        printf("Merged %zu shards, expected the same data request\n%s\n", found, merged);
+        return -1;
+    }
+    free(merged);
+    for(int i = 1; i <= NSHARDS; i++) {
+        char sfile[2048] = {0};
+        data_request_shard_name(file, i, NSHARDS, sfile, sizeof(sfile));
+        if(access(sfile, F_OK) == 0) {
+            printf("Shard file not removed after merging: %s\n", sfile);
+            return -1;
+        }
+    }
+    // Without any shard, the data request file is left alone
+    merged = merge_shards(text, &found);
+    if(found != 0 || strcmp(merged, text) != 0) {
+        printf("Merged %zu shards, none expected\n", found);
+        return -1;
+    }
+    free(merged);
+
+    // Lines of a completed shard are not requested again
+    shard_done[0] = 1;
+    write_shards(text, shard_done);
+    fdr = request_from_text(text);
+    n = data_request_shard(fdr, 1, NSHARDS);
+    data_request_free(fdr);
+    merged = merge_shards(text, &found);
+    request_lines(merged, &open, &done);
+    if(found != NSHARDS || done != n || open != total - n) {
+        printf("Lines done: %zu open: %zu, expected done: %zu open: %zu\n%s\n",
+               done, open, n, total - n, merged);
+        return -1;
+    }
+    free(merged);
+
+    // Completing every shard completes every chunk
+    for(int i = 0; i < NSHARDS; i++) {
+        shard_done[i] = 1;
+    }
+    write_shards(text, shard_done);
+    merged = merge_shards(text, &found);
+    all_done = request_text_done(text);
+    if(found != NSHARDS || strcmp(merged, all_done) != 0) {
+        printf("Merged %zu shards, expected every chunk done\n%s\n", found, merged);
+        return -1;
+    }
+    free(merged);
+    free(all_done);
+    free(text);
+    unlink(file);
+    return 0;
+}
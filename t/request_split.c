@@ -0,0 +1,113 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "slurp.h"
+
+#define RATE       20.0    // Samples per second of the channel
+#define BYTES      30      // Bytes per second, at 1.5 bytes per sample
+#define HEADROOM   4096    // Record downloaded by both sides of a split
+#define HOUR       3600
+#define DAY        86400
+#define MAX_SLICES 64
+
+static char *request_text =
+    "DATACENTER=A,http://127.0.0.1:9\n"
+    "DATASELECTSERVICE=http://127.0.0.1:9/fdsnws/dataselect/1/\n"
+    "IU ANMO 00 BHZ 2020-01-01T06:30:00 2020-01-04T12:00:00\n"
+    "\n";
+
+static char *file = "t/split.request.test";
+
+// Split the request line into chunks of at most max bytes
+static size_t
+split(SplitAlign align, size_t max, timespec64 *t1, timespec64 *t2) {
+    size_t n = 0, k = 0;
+    char *data = strdup(request_text);
+    char *line = NULL, *p = NULL;
+    data_request *fdr = data_request_parse(data);
+    free(data);
+    data_request_set_split(fdr, align);
+    data_request_chunks(fdr, max);
+    data_request_write_to_file(fdr, file);
+    data_request_free(fdr);
+    if(!(data = slurp(file, &n))) {
+        return 0;
+    }
+    p = data;
+    while((line = strsep(&p, "\n")) != NULL && k < MAX_SLICES) {
+        char net[16], sta[16], loc[16], cha[16], s1[64], s2[64];
+        if(sscanf(line, "%15s %15s %15s %15s %63s %63s", net, sta, loc, cha, s1, s2) == 6 &&
+           timespec64_parse(s1, &t1[k]) && timespec64_parse(s2, &t2[k])) {
+            k++;
+        }
+    }
+    free(data);
+    unlink(file);
+    return k;
+}
+
+// Slices cover the line without gaps and fit in max, with room for a record
+static int
+check_slices(char *name, size_t n, timespec64 *t1, timespec64 *t2, size_t max, int64_t unit) {
+    timespec64 start = {0,0}, end = {0,0};
+    timespec64_parse("2020-01-01T06:30:00", &start);
+    timespec64_parse("2020-01-04T12:00:00", &end);
+    if(n < 2 || timespec64_cmp(&t1[0], &start) != 0 || timespec64_cmp(&t2[n-1], &end) != 0) {
+        printf("%s: %zu slices do not span the request line\n", name, n);
+        return 0;
+    }
+    for(size_t i = 0; i < n; i++) {
+        int64_t dt = t2[i].tv_sec - t1[i].tv_sec;
+        if(i > 0 && timespec64_cmp(&t1[i], &t2[i-1]) != 0) {
+            printf("%s: slice %zu does not start where slice %zu ends\n", name, i, i-1);
+            return 0;
+        }
+        if((size_t) (dt * BYTES) + HEADROOM > max) {
+            printf("%s: slice %zu of %" PRId64 " s is larger than %zu bytes\n", name, i, dt, max);
+            return 0;
+        }
+        if(unit > 0 && i > 0 && (t1[i].tv_sec % unit != 0 || t1[i].tv_nsec != 0)) {
+            printf("%s: slice %zu does not start on a boundary of %" PRId64 " s\n", name, i, unit);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int
+main() {
+    size_t n = 0;
+    size_t day = DAY * BYTES;
+    timespec64 t1[MAX_SLICES], t2[MAX_SLICES];
+
+    chunk_size_set_file("");
+    chunk_size_set_sample_rate("IU", "ANMO", "00", "BHZ", RATE);
+
+    // A whole day fits with room for a record: one slice per UTC day
+    n = split(SplitDay, day + HEADROOM, t1, t2);
+    if(n != 4 || !check_slices("day", n, t1, t2, day + HEADROOM, DAY)) {
+        printf("day: expected 4 slices on days, found %zu\n", n);
+        return -1;
+    }
+    // A whole day leaves no room for a record: slices fall back to hours
+    n = split(SplitDay, day, t1, t2);
+    if(n != 4 || !check_slices("day - record", n, t1, t2, day, HOUR) ||
+       t2[0].tv_sec - t1[0].tv_sec != 22 * HOUR + 30 * 60) {
+        printf("day - record: expected 4 slices of 23 hours, found %zu\n", n);
+        return -1;
+    }
+    // Hours, with as many hours in a slice as fit
+    n = split(SplitHour, 6 * HOUR * BYTES + HEADROOM, t1, t2);
+    if(n != 13 || !check_slices("hour", n, t1, t2, 6 * HOUR * BYTES + HEADROOM, HOUR)) {
+        printf("hour: expected 13 slices of 6 hours, found %zu\n", n);
+        return -1;
+    }
+    // Equal slices at arbitrary times
+    n = split(SplitNone, day + HEADROOM, t1, t2);
+    if(n != 4 || !check_slices("none", n, t1, t2, day + HEADROOM, 0)) {
+        printf("none: expected 4 equal slices, found %zu\n", n);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include <fern.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static char *root = "t/sdswrite.test";
+
+typedef struct {
+    sds_writer *w;
+    int64_t nrecords;
+} sds_test;
+
+// Place a packed record in the SDS archive
+static void
+sds_record(char *record, int reclen, void *data) {
+    sds_test *s = (sds_test *) data;
+    MS3Record *msr = NULL;
+    if(msr3_parse(record, (uint64_t) reclen, &msr, 0, 0) == MS_NOERROR) {
+        sds_writer_record(msr, s->w);
+        s->nrecords += 1;
+    }
+    msr3_free(&msr);
+}
+
+// Write npts samples at 1 sample per second into the SDS archive
+static int
+sds_fill(sds_test *s, char *sid, char *start, int64_t npts) {
+    int64_t packed = 0;
+    int32_t *y = calloc((size_t) npts, sizeof(int32_t));
+    MS3Record *msr = msr3_init(NULL);
+    strncpy(msr->sid, sid, sizeof(msr->sid) - 1);
+    msr->formatversion = 2;
+    msr->reclen = 512;
+    msr->pubversion = 1;
+    msr->starttime = ms_timestr2nstime(start);
+    msr->samprate = 1.0;
+    msr->encoding = DE_INT32;
+    msr->sampletype = 'i';
+    msr->datasamples = y;
+    msr->datasize = (uint64_t) npts * sizeof(int32_t);
+    msr->numsamples = npts;
+    msr->samplecnt = npts;
+    msr3_pack(msr, sds_record, s, &packed, MSF_FLUSHDATA, 0);
+    msr->datasamples = NULL;
+    msr3_free(&msr);
+    free(y);
+    return packed == npts;
+}
+
+static int64_t
+sds_size(char *path) {
+    struct stat st;
+    return (stat(path, &st) == 0) ? (int64_t) st.st_size : -1;
+}
+
+int
+main() {
+    int64_t size = 0;
+    char path[2048] = {0};
+    char *expect = "t/sdswrite.test/2020/IU/ANMO/BHZ.D/IU.ANMO.00.BHZ.D.2020.001";
+    sds_test s = { NULL, 0 };
+
+    system("rm -rf t/sdswrite.test");
+    if(!sds_path(root, "FDSN:IU_ANMO_00_B_H_Z", ms_timestr2nstime("2020-01-01T12:00:00"),
+                 path, sizeof(path)) || strcmp(path, expect) != 0) {
+        printf("Expected day file %s, found %s\n", expect, path);
+        return -1;
+    }
+    // The first half hour of the day
+    s.w = sds_writer_new(root);
+    if(!sds_fill(&s, "FDSN:IU_ANMO_00_B_H_Z", "2020-01-01T00:00:00", 1800)) {
+        printf("Error writing miniseed into %s\n", root);
+        return -1;
+    }
+    sds_writer_close(s.w);
+    size = sds_size(path);
+    if(sds_writer_files(s.w) != 1 || size <= 0 || size != sds_writer_bytes(s.w)) {
+        printf("Expected one day file of %" PRId64 " bytes, found %" PRId64 "\n",
+               sds_writer_bytes(s.w), size);
+        return -1;
+    }
+    sds_writer_free(s.w);
+    // A later run delivers the same half hour again, and the next one
+    s.w = sds_writer_new(root);
+    s.nrecords = 0;
+    if(!sds_fill(&s, "FDSN:IU_ANMO_00_B_H_Z", "2020-01-01T00:00:00", 1800) ||
+       sds_writer_skipped(s.w) != s.nrecords || sds_writer_bytes(s.w) != 0) {
+        printf("Expected %" PRId64 " records already in %s skipped, found %" PRId64 "\n",
+               s.nrecords, path, sds_writer_skipped(s.w));
+        return -1;
+    }
+    if(!sds_fill(&s, "FDSN:IU_ANMO_00_B_H_Z", "2020-01-01T00:30:00", 1800)) {
+        printf("Error writing miniseed into %s\n", root);
+        return -1;
+    }
+    sds_writer_close(s.w);
+    if(sds_size(path) != 2 * size || sds_writer_bytes(s.w) != size) {
+        printf("Expected %s to hold each record once\n", path);
+        return -1;
+    }
+    sds_writer_free(s.w);
+    system("rm -rf t/sdswrite.test");
+    return 0;
+}
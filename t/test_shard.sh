@@ -0,0 +1,4 @@
+# Shards divide a request file planned beforehand, see -i
+./fern -D miniseed -n IU -s ANMO -c BHZ -t 2020/01/01 2020/01/02 -H 1/2 > t/test_shard.txt.test && exit -1
+grep -q "error: --shard requires a request file from --input" t/test_shard.txt.test || exit -1
+exit 0